@@ -5582,6 +5582,23 @@ int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return 0;
 }
 
+/*
+ * Stat the local file that @bs, a protocol node, has open.  Unlike a
+ * stat() of bs->filename, this cannot race with the file being replaced.
+ */
+int bdrv_fstat(BlockDriverState *bs, struct stat *st)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    if (!drv->bdrv_fstat) {
+        return -ENOTSUP;
+    }
+    return drv->bdrv_fstat(bs, st);
+}
+
 ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs,
                                           Error **errp)
 {
@@ -0,0 +1,188 @@
+/*
+ * Block status map
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block-status-map.h"
+#include "block/dirty-bitmap.h"
+#include "trace.h"
+
+#define BLOCK_STATUS_MAP_MASK \
+    (BDRV_BLOCK_DATA | BDRV_BLOCK_ZERO | BDRV_BLOCK_ALLOCATED)
+
+typedef struct BlockStatusExtent {
+    int64_t offset;
+    int64_t bytes;
+    int status;
+} BlockStatusExtent;
+
+struct BlockStatusMap {
+    BlockDriverState *bs;
+    BlockDriverState *base;
+    int64_t prefetch;
+    /* Non-overlapping BlockStatusExtents, used both as key and value */
+    GTree *extents;
+    /* Bumped on invalidation, so that racing queries are not cached */
+    uint64_t generation;
+    /* Records writes to @bs if the map tracks writes itself */
+    BdrvDirtyBitmap *dirty;
+};
+
+/*
+ * Extents in the tree never overlap, so they are totally ordered, and
+ * a lookup with any range finds an extent that overlaps it.
+ */
+static gint extent_cmp(gconstpointer a, gconstpointer b, gpointer opaque)
+{
+    const BlockStatusExtent *ea = a;
+    const BlockStatusExtent *eb = b;
+
+    if (ea->offset + ea->bytes <= eb->offset) {
+        return -1;
+    }
+    if (eb->offset + eb->bytes <= ea->offset) {
+        return 1;
+    }
+    return 0;
+}
+
+static void extent_insert(BlockStatusMap *map, int64_t offset, int64_t bytes,
+                          int status)
+{
+    BlockStatusExtent *e = g_new(BlockStatusExtent, 1);
+
+    *e = (BlockStatusExtent) {
+        .offset = offset,
+        .bytes = bytes,
+        .status = status,
+    };
+    g_tree_insert(map->extents, e, e);
+}
+
+/* Remove [@offset, @offset + @bytes), splitting the extents around it */
+static void extent_remove(BlockStatusMap *map, int64_t offset, int64_t bytes)
+{
+    BlockStatusExtent key = { .offset = offset, .bytes = bytes };
+    BlockStatusExtent *e;
+
+    while ((e = g_tree_lookup(map->extents, &key))) {
+        BlockStatusExtent old = *e;
+
+        g_tree_remove(map->extents, e);
+        if (old.offset < offset) {
+            extent_insert(map, old.offset, offset - old.offset, old.status);
+        }
+        if (old.offset + old.bytes > offset + bytes) {
+            extent_insert(map, offset + bytes,
+                          old.offset + old.bytes - (offset + bytes),
+                          old.status);
+        }
+    }
+}
+
+BlockStatusMap *bdrv_block_status_map_new(BlockDriverState *bs,
+                                          BlockDriverState *base,
+                                          int64_t prefetch,
+                                          bool track_writes,
+                                          Error **errp)
+{
+    BlockStatusMap *map;
+    BdrvDirtyBitmap *dirty = NULL;
+
+    if (track_writes) {
+        dirty = bdrv_create_dirty_bitmap(
+            bs, bdrv_get_default_bitmap_granularity(bs), NULL, errp);
+        if (!dirty) {
+            return NULL;
+        }
+    }
+
+    map = g_new0(BlockStatusMap, 1);
+    map->bs = bs;
+    map->base = base;
+    map->prefetch = prefetch;
+    map->extents = g_tree_new_full(extent_cmp, NULL, g_free, NULL);
+    map->dirty = dirty;
+    return map;
+}
+
+void bdrv_block_status_map_free(BlockStatusMap *map)
+{
+    if (!map) {
+        return;
+    }
+    if (map->dirty) {
+        bdrv_release_dirty_bitmap(map->dirty);
+    }
+    g_tree_destroy(map->extents);
+    g_free(map);
+}
+
+/* Drop the areas written since the last call from @map */
+static void bdrv_block_status_map_sync(BlockStatusMap *map)
+{
+    BdrvDirtyBitmap *bitmap = map->dirty;
+    int64_t end, start, dirty_start, dirty_count;
+
+    bdrv_dirty_bitmap_lock(bitmap);
+    end = bdrv_dirty_bitmap_size(bitmap);
+    for (start = 0;
+         bdrv_dirty_bitmap_next_dirty_area(bitmap, start, end, INT64_MAX,
+                                           &dirty_start, &dirty_count);
+         start = dirty_start + dirty_count)
+    {
+        bdrv_block_status_map_invalidate(map, dirty_start, dirty_count);
+    }
+    bdrv_reset_dirty_bitmap_locked(bitmap, 0, end);
+    bdrv_dirty_bitmap_unlock(bitmap);
+}
+
+int bdrv_block_status_map_get(BlockStatusMap *map, int64_t offset,
+                              int64_t bytes, int64_t *pnum)
+{
+    BlockStatusExtent key = { .offset = offset, .bytes = 1 };
+    BlockStatusExtent *e;
+    uint64_t generation;
+    int64_t count;
+    int ret;
+
+    if (map->dirty) {
+        bdrv_block_status_map_sync(map);
+    }
+
+    e = g_tree_lookup(map->extents, &key);
+    if (e) {
+        *pnum = MIN(e->offset + e->bytes - offset, bytes);
+        trace_bdrv_block_status_map_hit(map, offset, *pnum, e->status);
+        return e->status;
+    }
+
+    generation = map->generation;
+    ret = bdrv_block_status_above(map->bs, map->base, offset,
+                                  MAX(bytes, map->prefetch), &count,
+                                  NULL, NULL);
+    if (ret < 0) {
+        return ret;
+    }
+    trace_bdrv_block_status_map_miss(map, offset, count, ret);
+    ret &= BLOCK_STATUS_MAP_MASK;
+
+    /* The result is stale if the area was written in the meantime */
+    if (count && map->generation == generation) {
+        extent_remove(map, offset, count);
+        extent_insert(map, offset, count, ret);
+    }
+
+    *pnum = MIN(count, bytes);
+    return ret;
+}
+
+void bdrv_block_status_map_invalidate(BlockStatusMap *map, int64_t offset,
+                                      int64_t bytes)
+{
+    map->generation++;
+    extent_remove(map, offset, bytes);
+}
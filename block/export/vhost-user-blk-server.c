@@ -18,6 +18,7 @@
 #include "qapi/error.h"
 #include "qom/object_interfaces.h"
 #include "sysemu/block-backend.h"
+#include "sysemu/iothread.h"
 #include "util/block-helpers.h"
 
 enum {
@@ -35,6 +36,7 @@ typedef struct VuBlkReq {
     struct virtio_blk_outhdr out;
     VuServer *server;
     struct VuVirtq *vq;
+    int vq_idx;
 } VuBlkReq;
 
 /* vhost user block device */
@@ -45,16 +47,27 @@ typedef struct {
     QIOChannelSocket *sioc;
     struct virtio_blk_config blkcfg;
     bool writable;
+
+    /*
+     * IOThread of each virtqueue with queue-iothreads, referenced until the
+     * export is deleted
+     */
+    IOThread **queue_iothreads;
+    uint16_t num_queues;
 } VuBlkExport;
 
 static void vu_blk_req_complete(VuBlkReq *req)
 {
     VuDev *vu_dev = &req->server->vu_dev;
 
+    vhost_user_server_queue_lock(req->server, req->vq_idx);
+
     /* IO size with 1 extra status byte */
     vu_queue_push(vu_dev, req->vq, &req->elem, req->size + 1);
     vu_queue_notify(vu_dev, req->vq);
 
+    vhost_user_server_queue_unlock(req->server, req->vq_idx);
+
     free(req);
 }
 
@@ -89,6 +102,7 @@ static void coroutine_fn vu_blk_virtio_process_req(void *opaque)
     VuBlkReq *req = opaque;
     VuServer *server = req->server;
     VuVirtqElement *elem = &req->elem;
+    int vq_idx = req->vq_idx;
     uint32_t type;
 
     VuBlkExport *vexp = container_of(server, VuBlkExport, vu_server);
@@ -124,6 +138,15 @@ static void coroutine_fn vu_blk_virtio_process_req(void *opaque)
               - sizeof(struct virtio_blk_inhdr);
     iov_discard_back(in_iov, &in_num, sizeof(struct virtio_blk_inhdr));
 
+    /*
+     * If the queue has its own AioContext, only the request parsing and
+     * completion run there; the BlockBackend is only accessed from its
+     * own AioContext, which may change while we are rescheduled.
+     */
+    while (qemu_get_current_aio_context() != blk_get_aio_context(blk)) {
+        aio_co_reschedule_self(blk_get_aio_context(blk));
+    }
+
     type = le32_to_cpu(req->out.type);
     switch (type & ~VIRTIO_BLK_T_BARRIER) {
     case VIRTIO_BLK_T_IN:
@@ -190,11 +213,14 @@ static void coroutine_fn vu_blk_virtio_process_req(void *opaque)
         break;
     }
 
+    aio_co_reschedule_self(vhost_user_server_queue_ctx(server, req->vq_idx));
     vu_blk_req_complete(req);
+    vhost_user_server_dec_in_flight(server, vq_idx);
     return;
 
 err:
     free(req);
+    vhost_user_server_dec_in_flight(server, vq_idx);
 }
 
 static void vu_blk_process_vq(VuDev *vu_dev, int idx)
@@ -212,6 +238,8 @@ static void vu_blk_process_vq(VuDev *vu_dev, int idx)
 
         req->server = server;
         req->vq = vq;
+        req->vq_idx = idx;
+        vhost_user_server_inc_in_flight(server, idx);
 
         Coroutine *co =
             qemu_coroutine_create(vu_blk_virtio_process_req, req);
@@ -368,6 +396,59 @@ static void vu_blk_exp_request_shutdown(BlockExport *exp)
     vhost_user_server_stop(&vexp->vu_server);
 }
 
+static void vu_blk_put_queue_iothreads(VuBlkExport *vexp)
+{
+    uint16_t i;
+
+    if (!vexp->queue_iothreads) {
+        return;
+    }
+    for (i = 0; i < vexp->num_queues; i++) {
+        object_unref(OBJECT(vexp->queue_iothreads[i]));
+    }
+    g_free(vexp->queue_iothreads);
+    vexp->queue_iothreads = NULL;
+}
+
+/*
+ * Assign the virtqueues to @iothreads round-robin and return the
+ * AioContext of each.  The IOThreads are referenced so that they stay
+ * around while the server uses their AioContexts.
+ */
+static AioContext **vu_blk_queue_ctx(VuBlkExport *vexp, strList *iothreads,
+                                     Error **errp)
+{
+    AioContext **queue_ctx;
+    strList *iothread = iothreads;
+    uint16_t i;
+
+    if (!iothreads) {
+        error_setg(errp, "queue-iothreads must not be empty");
+        return NULL;
+    }
+
+    vexp->queue_iothreads = g_new0(IOThread *, vexp->num_queues);
+    for (i = 0; i < vexp->num_queues; i++) {
+        IOThread *obj = iothread_by_id(iothread->value);
+
+        if (!obj) {
+            error_setg(errp, "iothread \"%s\" not found", iothread->value);
+            vexp->num_queues = i;
+            vu_blk_put_queue_iothreads(vexp);
+            return NULL;
+        }
+        object_ref(OBJECT(obj));
+        vexp->queue_iothreads[i] = obj;
+        iothread = iothread->next ?: iothreads;
+    }
+
+    queue_ctx = g_new(AioContext *, vexp->num_queues);
+    for (i = 0; i < vexp->num_queues; i++) {
+        queue_ctx[i] = iothread_get_aio_context(vexp->queue_iothreads[i]);
+    }
+    return queue_ctx;
+}
+
 static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
                              Error **errp)
 {
@@ -376,6 +457,7 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
     Error *local_err = NULL;
     uint64_t logical_block_size;
     uint16_t num_queues = VHOST_USER_BLK_NUM_QUEUES_DEFAULT;
+    AioContext **queue_ctx = NULL;
 
     vexp->writable = opts->writable;
     vexp->blkcfg.wce = 0;
@@ -402,6 +484,14 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
         return -EINVAL;
     }
 
+    vexp->num_queues = num_queues;
+    if (vu_opts->has_queue_iothreads) {
+        queue_ctx = vu_blk_queue_ctx(vexp, vu_opts->queue_iothreads, errp);
+        if (!queue_ctx) {
+            return -EINVAL;
+        }
+    }
+
     vu_blk_initialize_config(blk_bs(exp->blk), &vexp->blkcfg,
                              logical_block_size, num_queues);
 
@@ -409,9 +499,10 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
                                  vexp);
 
     if (!vhost_user_server_start(&vexp->vu_server, vu_opts->addr, exp->ctx,
-                                 num_queues, &vu_blk_iface, errp)) {
+                                 queue_ctx, num_queues, &vu_blk_iface, errp)) {
         blk_remove_aio_context_notifier(exp->blk, blk_aio_attached,
                                         blk_aio_detach, vexp);
+        vu_blk_put_queue_iothreads(vexp);
         return -EADDRNOTAVAIL;
     }
 
@@ -424,6 +515,9 @@ static void vu_blk_exp_delete(BlockExport *exp)
 
     blk_remove_aio_context_notifier(exp->blk, blk_aio_attached, blk_aio_detach,
                                     vexp);
+
+    /* The server was stopped in vu_blk_exp_request_shutdown() */
+    vu_blk_put_queue_iothreads(vexp);
 }
 
 const BlockExportDriver blk_exp_vhost_user_blk = {
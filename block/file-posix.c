@@ -160,6 +160,9 @@ typedef struct BDRVRawState {
     bool discard_zeroes:1;
     bool use_linux_aio:1;
     bool use_linux_io_uring:1;
+    bool io_uring_fixed_bufs:1;
+    bool io_uring_fixed_files:1;
+    bool io_uring_iopoll:1;
     bool page_cache_inconsistent:1;
     bool has_fallocate;
     bool needs_alignment;
@@ -172,6 +175,18 @@ typedef struct BDRVRawState {
     } stats;
 
     PRManager *pr_mgr;
+
+#ifdef CONFIG_LINUX_IO_URING
+    /*
+     * Ring with SQPOLL or IOPOLL (as given by luring_flags), used instead of
+     * the AioContext's ring.  It is shared with the other nodes in the same
+     * AioContext that use the same flags.
+     */
+    LuringState *luring;
+    unsigned int luring_flags;
+    /* The fd registered in the ring's file table, or -1 */
+    int luring_fixed_fd;
+#endif
 } BDRVRawState;
 
 typedef struct BDRVRawReopenState {
@@ -519,6 +534,24 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "host AIO implementation (threads, native, io_uring)",
         },
+        {
+            .name = "io-uring-fixed",
+            .type = QEMU_OPT_BOOL,
+            .help = "register guest RAM and the image file with io_uring "
+                    "(default: off)",
+        },
+        {
+            .name = "io-uring-sqpoll",
+            .type = QEMU_OPT_BOOL,
+            .help = "use a kernel thread to poll the io_uring submission "
+                    "queue (default: off)",
+        },
+        {
+            .name = "io-uring-iopoll",
+            .type = QEMU_OPT_BOOL,
+            .help = "poll the device for io_uring completions instead of "
+                    "waiting for interrupts (default: off)",
+        },
         {
             .name = "locking",
             .type = QEMU_OPT_STRING,
@@ -547,6 +580,53 @@ static QemuOptsList raw_runtime_opts = {
 
 static const char *const mutable_opts[] = { "x-check-cache-dropped", NULL };
 
+#ifdef CONFIG_LINUX_IO_URING
+static LuringState *raw_get_luring(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+
+    return s->luring ?: aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+}
+
+/* Makes s->fd the file registered in the io_uring file table */
+static void raw_luring_register_fd(BlockDriverState *bs, LuringState *aio)
+{
+    BDRVRawState *s = bs->opaque;
+    int ret;
+
+    if (!s->io_uring_fixed_files || s->luring_fixed_fd == s->fd) {
+        return;
+    }
+
+    if (s->luring_fixed_fd >= 0) {
+        luring_unregister_fd(aio, s->luring_fixed_fd);
+        s->luring_fixed_fd = -1;
+    }
+
+    ret = luring_register_fd(aio, s->fd);
+    if (ret < 0) {
+        warn_report("Failed to register '%s' with io_uring: %s",
+                    bs->filename, strerror(-ret));
+        s->io_uring_fixed_files = false;
+        return;
+    }
+    s->luring_fixed_fd = s->fd;
+}
+#endif
+
+/* Must be called before closing the file registered with io_uring */
+static void raw_luring_unregister_fd(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+
+    if (s->luring_fixed_fd >= 0) {
+        luring_unregister_fd(raw_get_luring(bs), s->luring_fixed_fd);
+        s->luring_fixed_fd = -1;
+    }
+#endif
+}
+
 static int raw_open_common(BlockDriverState *bs, QDict *options,
                            int bdrv_flags, int open_flags,
                            bool device, Error **errp)
@@ -560,6 +640,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     int fd, ret;
     struct stat st;
     OnOffAuto locking;
+    bool io_uring_sqpoll;
 
     opts = qemu_opts_create(&raw_runtime_opts, NULL, 0, &error_abort);
     if (!qemu_opts_absorb_qdict(opts, options, errp)) {
@@ -596,7 +677,21 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     s->use_linux_aio = (aio == BLOCKDEV_AIO_OPTIONS_NATIVE);
 #ifdef CONFIG_LINUX_IO_URING
     s->use_linux_io_uring = (aio == BLOCKDEV_AIO_OPTIONS_IO_URING);
-#endif
+    s->luring_fixed_fd = -1;
+#endif
+
+    io_uring_sqpoll = qemu_opt_get_bool(opts, "io-uring-sqpoll", false);
+    s->io_uring_iopoll = qemu_opt_get_bool(opts, "io-uring-iopoll", false);
+    s->io_uring_fixed_bufs = qemu_opt_get_bool(opts, "io-uring-fixed", false);
+    /* Older kernels only support registered files with SQPOLL */
+    s->io_uring_fixed_files = s->io_uring_fixed_bufs || io_uring_sqpoll;
+    if ((s->io_uring_fixed_files || s->io_uring_iopoll) &&
+        aio != BLOCKDEV_AIO_OPTIONS_IO_URING) {
+        error_setg(errp, "io-uring-fixed, io-uring-sqpoll and "
+                   "io-uring-iopoll require aio=io_uring");
+        ret = -EINVAL;
+        goto fail;
+    }
 
     locking = qapi_enum_parse(&OnOffAuto_lookup,
                               qemu_opt_get(opts, "locking"),
@@ -691,12 +786,35 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
 #endif /* !defined(CONFIG_LINUX_AIO) */
 
 #ifdef CONFIG_LINUX_IO_URING
-    if (s->use_linux_io_uring) {
+    if (s->io_uring_iopoll && !(s->open_flags & O_DIRECT)) {
+        error_setg(errp, "io-uring-iopoll was specified, but it requires "
+                         "cache.direct=on, which was not specified.");
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (s->use_linux_io_uring && (io_uring_sqpoll || s->io_uring_iopoll)) {
+        /*
+         * SQPOLL and IOPOLL are properties of the ring, so use a ring of our
+         * own instead of the one shared by the AioContext
+         */
+        s->luring_flags = (io_uring_sqpoll ? LURING_SQPOLL : 0) |
+                          (s->io_uring_iopoll ? LURING_IOPOLL : 0);
+        s->luring = luring_get_shared(bdrv_get_aio_context(bs),
+                                      s->luring_flags, errp);
+        if (!s->luring) {
+            error_prepend(errp, "Unable to use io_uring: ");
+            ret = -EINVAL;
+            goto fail;
+        }
+    } else if (s->use_linux_io_uring) {
         if (!aio_setup_linux_io_uring(bdrv_get_aio_context(bs), errp)) {
             error_prepend(errp, "Unable to use io_uring: ");
             goto fail;
         }
     }
+    if (s->io_uring_fixed_bufs) {
+        luring_enable_fixed_bufs(raw_get_luring(bs));
+    }
 #else
     if (s->use_linux_io_uring) {
         error_setg(errp, "aio=io_uring was specified, but is not supported "
@@ -789,6 +907,12 @@ fail:
     if (ret < 0 && s->fd != -1) {
         qemu_close(s->fd);
     }
+#ifdef CONFIG_LINUX_IO_URING
+    if (ret < 0 && s->luring) {
+        luring_put_shared(s->luring);
+        s->luring = NULL;
+    }
+#endif
     if (filename && (bdrv_flags & BDRV_O_TEMPORARY)) {
         unlink(filename);
     }
@@ -1114,6 +1238,12 @@ static int raw_reopen_prepare(BDRVReopenState *state,
         goto out;
     }
 
+    if (s->io_uring_iopoll && !(rs->open_flags & O_DIRECT)) {
+        error_setg(errp, "io-uring-iopoll requires cache.direct=on");
+        ret = -EINVAL;
+        goto out_fd;
+    }
+
     /* Fail already reopen_prepare() if we can't get a working O_DIRECT
      * alignment with the new fd. */
     if (rs->fd != -1) {
@@ -1146,6 +1276,7 @@ static void raw_reopen_commit(BDRVReopenState *state)
     s->check_cache_dropped = rs->check_cache_dropped;
     s->open_flags = rs->open_flags;
 
+    raw_luring_unregister_fd(state->bs);
     qemu_close(s->fd);
     s->fd = rs->fd;
 
@@ -2010,8 +2141,9 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
         type |= QEMU_AIO_MISALIGNED;
 #ifdef CONFIG_LINUX_IO_URING
     } else if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        LuringState *aio = raw_get_luring(bs);
         assert(qiov->size == bytes);
+        raw_luring_register_fd(bs, aio);
         return luring_co_submit(bs, aio, s->fd, offset, qiov, type);
 #endif
 #ifdef CONFIG_LINUX_AIO
@@ -2064,7 +2196,7 @@ static void raw_aio_plug(BlockDriverState *bs)
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        LuringState *aio = raw_get_luring(bs);
         luring_io_plug(bs, aio);
     }
 #endif
@@ -2081,7 +2213,7 @@ static void raw_aio_unplug(BlockDriverState *bs)
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        LuringState *aio = raw_get_luring(bs);
         luring_io_unplug(bs, aio);
     }
 #endif
@@ -2105,8 +2237,10 @@ static int raw_co_flush_to_disk(BlockDriverState *bs)
     };
 
 #ifdef CONFIG_LINUX_IO_URING
-    if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+    /* IOPOLL rings cannot fsync, use the thread pool instead */
+    if (s->use_linux_io_uring && !s->io_uring_iopoll) {
+        LuringState *aio = raw_get_luring(bs);
+        raw_luring_register_fd(bs, aio);
         return luring_co_submit(bs, aio, s->fd, 0, NULL, QEMU_AIO_FLUSH);
     }
 #endif
@@ -2128,21 +2262,56 @@ static void raw_aio_attach_aio_context(BlockDriverState *bs,
     }
 #endif
 #ifdef CONFIG_LINUX_IO_URING
-    if (s->use_linux_io_uring) {
+    if (s->luring_flags && s->use_linux_io_uring) {
+        Error *local_err = NULL;
+        s->luring = luring_get_shared(new_context, s->luring_flags,
+                                      &local_err);
+        if (!s->luring) {
+            error_reportf_err(local_err, "Unable to use linux io_uring, "
+                                         "falling back to thread pool: ");
+            s->use_linux_io_uring = false;
+        } else if (s->io_uring_fixed_bufs) {
+            luring_enable_fixed_bufs(s->luring);
+        }
+    } else if (s->use_linux_io_uring) {
         Error *local_err = NULL;
         if (!aio_setup_linux_io_uring(new_context, &local_err)) {
             error_reportf_err(local_err, "Unable to use linux io_uring, "
                                          "falling back to thread pool: ");
             s->use_linux_io_uring = false;
+        } else if (s->io_uring_fixed_bufs) {
+            luring_enable_fixed_bufs(aio_get_linux_io_uring(new_context));
         }
     }
 #endif
 }
 
+static void raw_aio_detach_aio_context(BlockDriverState *bs)
+{
+    /* The fd is registered again with the new ring on the next request */
+    raw_luring_unregister_fd(bs);
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+
+    if (s->luring) {
+        luring_put_shared(s->luring);
+        s->luring = NULL;
+    }
+#endif
+}
+
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
 
+    raw_luring_unregister_fd(bs);
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->luring) {
+        luring_put_shared(s->luring);
+        s->luring = NULL;
+    }
+#endif
+
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
@@ -3012,6 +3181,16 @@ static int raw_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return 0;
 }
 
+static int raw_fstat(BlockDriverState *bs, struct stat *st)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (fstat(s->fd, st) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
 static BlockStatsSpecificFile get_blockstats_specific_file(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
@@ -3146,6 +3325,7 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     /* For reopen, we have already switched to the new fd (.bdrv_set_perm is
      * called after .bdrv_reopen_commit) */
     if (s->perm_change_fd && s->fd != s->perm_change_fd) {
+        raw_luring_unregister_fd(bs);
         qemu_close(s->fd);
         s->fd = s->perm_change_fd;
         s->open_flags = s->perm_change_flags;
@@ -3248,10 +3428,12 @@ BlockDriver bdrv_file = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
 
     .bdrv_co_truncate = raw_co_truncate,
     .bdrv_getlength = raw_getlength,
     .bdrv_get_info = raw_get_info,
+    .bdrv_fstat = raw_fstat,
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
     .bdrv_get_specific_stats = raw_get_specific_stats,
@@ -3622,6 +3804,7 @@ static BlockDriver bdrv_host_device = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
 
     .bdrv_co_truncate       = raw_co_truncate,
     .bdrv_getlength	= raw_getlength,
@@ -3746,6 +3929,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
 
     .bdrv_co_truncate    = raw_co_truncate,
     .bdrv_getlength      = raw_getlength,
@@ -3876,6 +4060,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
 
     .bdrv_co_truncate    = raw_co_truncate,
     .bdrv_getlength      = raw_getlength,
@@ -10,18 +10,32 @@
  */
 #include "qemu/osdep.h"
 #include <liburing.h>
+#include <sys/syscall.h>
 #include "qemu-common.h"
 #include "block/aio.h"
 #include "qemu/queue.h"
 #include "block/block.h"
 #include "block/raw-aio.h"
 #include "qemu/coroutine.h"
+#include "qemu/error-report.h"
+#include "qemu/units.h"
 #include "qapi/error.h"
+#include "exec/ramlist.h"
+#include "exec/cpu-common.h"
 #include "trace.h"
 
 /* io_uring ring size */
 #define MAX_ENTRIES 128
 
+/* Number of slots in the registered file table */
+#define MAX_FIXED_FILES 64
+
+/* The kernel limits the size of each registered buffer */
+#define MAX_FIXED_BUF_SIZE (1 * GiB)
+
+/* Idle time after which the SQPOLL kernel thread goes to sleep */
+#define SQPOLL_IDLE_MS 1000
+
 typedef struct LuringAIOCB {
     Coroutine *co;
     struct io_uring_sqe sqeq;
@@ -56,8 +70,51 @@ typedef struct LuringState {
 
     /* I/O completion processing.  Only runs in I/O thread.  */
     QEMUBH *completion_bh;
+
+    /*
+     * The ring was created with IORING_SETUP_IOPOLL: completions are not
+     * signalled through the ring fd and must be polled for.
+     */
+    bool iopoll;
+
+    /*
+     * Copy of luring_ram that is registered with IORING_REGISTER_BUFFERS.
+     * Requests whose buffer lies entirely within one of them are submitted
+     * as READ_FIXED/WRITE_FIXED, which saves pinning the pages for every
+     * request.
+     */
+    bool fixed_bufs_enabled;
+    bool fixed_bufs_registered;
+    GArray *fixed_bufs;
+    QLIST_ENTRY(LuringState) fixed_bufs_next;
+
+    /* luring_init() flags, and users of a ring from luring_get_shared() */
+    unsigned int flags;
+    int refcnt;
+    QLIST_ENTRY(LuringState) shared_next;
+
+    /*
+     * Files registered with IORING_REGISTER_FILES, indexed by slot.  Unused
+     * slots contain -1.
+     */
+    bool fixed_files_registered;
+    int fixed_files[MAX_FIXED_FILES];
 } LuringState;
 
+/*
+ * Guest RAM as a sorted array of struct iovec.  It is tracked once for all
+ * rings that use fixed buffers; the kernel cannot share a buffer
+ * registration between rings, so each of them registers a copy.
+ */
+static GArray *luring_ram;
+static RAMBlockNotifier luring_ram_notifier;
+static QLIST_HEAD(, LuringState) luring_fixed_bufs_rings =
+    QLIST_HEAD_INITIALIZER(luring_fixed_bufs_rings);
+
+/* Rings returned by luring_get_shared() */
+static QLIST_HEAD(, LuringState) luring_shared_rings =
+    QLIST_HEAD_INITIALIZER(luring_shared_rings);
+
 /**
  * luring_resubmit:
  *
@@ -102,6 +159,12 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     qemu_iovec_concat(resubmit_qiov, luringcb->qiov, luringcb->total_read,
                       remaining);
 
+    /* The remainder is read into the qiov, not the registered buffer */
+    if (luringcb->sqeq.opcode == IORING_OP_READ_FIXED) {
+        luringcb->sqeq.opcode = IORING_OP_READV;
+        luringcb->sqeq.buf_index = 0;
+    }
+
     /* Update sqe */
     luringcb->sqeq.off = nread;
     luringcb->sqeq.addr = (__u64)(uintptr_t)luringcb->resubmit_qiov.iov;
@@ -110,6 +173,21 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     luring_resubmit(s, luringcb);
 }
 
+/**
+ * luring_iopoll:
+ *
+ * Makes the kernel poll the device for completed requests of an IOPOLL ring
+ * and put them on the completion queue.  This does not wait.
+ */
+static void luring_iopoll(LuringState *s)
+{
+    if (!s->iopoll || !s->io_q.in_flight) {
+        return;
+    }
+    syscall(__NR_io_uring_enter, s->ring.ring_fd, 0, 0,
+            IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
 /**
  * luring_process_completions:
  * @s: AIO state
@@ -144,6 +222,8 @@ static void luring_process_completions(LuringState *s)
      */
     qemu_bh_schedule(s->completion_bh);
 
+    luring_iopoll(s);
+
     while (io_uring_peek_cqe(&s->ring, &cqes) == 0) {
         LuringAIOCB *luringcb;
         int ret;
@@ -204,7 +284,14 @@ end:
             aio_co_wake(luringcb->co);
         }
     }
-    qemu_bh_cancel(s->completion_bh);
+
+    /*
+     * Nothing wakes up the event loop when IOPOLL requests complete, so keep
+     * the BH scheduled and poll again until all of them are done.
+     */
+    if (!s->iopoll || !s->io_q.in_flight) {
+        qemu_bh_cancel(s->completion_bh);
+    }
 }
 
 static int ioq_submit(LuringState *s)
@@ -278,6 +365,8 @@ static bool qemu_luring_poll_cb(void *opaque)
 {
     LuringState *s = opaque;
 
+    luring_iopoll(s);
+
     if (io_uring_cq_ready(&s->ring)) {
         luring_process_completions_and_submit(s);
         return true;
@@ -312,6 +401,64 @@ void luring_io_unplug(BlockDriverState *bs, LuringState *s)
     }
 }
 
+/**
+ * luring_fixed_file_index:
+ *
+ * Returns the slot of @fd in the registered file table, or -1 if @fd is not
+ * registered.
+ */
+static int luring_fixed_file_index(LuringState *s, int fd)
+{
+    int i;
+
+    if (!s->fixed_files_registered) {
+        return -1;
+    }
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        if (s->fixed_files[i] == fd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * luring_fixed_buf_index:
+ *
+ * Returns the index of the registered buffer that contains all of @qiov, or
+ * -1 if there is none.  Fixed buffer requests cannot be vectored, so only
+ * single-element I/O vectors are considered.
+ */
+static int luring_fixed_buf_index(LuringState *s, QEMUIOVector *qiov)
+{
+    uintptr_t start, end;
+    int lo, hi;
+
+    if (!s->fixed_bufs_registered || qiov->niov != 1) {
+        return -1;
+    }
+
+    start = (uintptr_t)qiov->iov[0].iov_base;
+    end = start + qiov->iov[0].iov_len;
+
+    lo = 0;
+    hi = s->fixed_bufs->len;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        struct iovec *buf = &g_array_index(s->fixed_bufs, struct iovec, mid);
+        uintptr_t buf_start = (uintptr_t)buf->iov_base;
+
+        if (start < buf_start) {
+            hi = mid;
+        } else if (start >= buf_start + buf->iov_len) {
+            lo = mid + 1;
+        } else {
+            return end <= buf_start + buf->iov_len ? mid : -1;
+        }
+    }
+    return -1;
+}
+
 /**
  * luring_do_submit:
  * @fd: file descriptor for I/O
@@ -328,17 +475,38 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
 {
     int ret;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
+    int file_index = luring_fixed_file_index(s, fd);
+    int buf_index = -1;
+
+    if (file_index >= 0) {
+        fd = file_index;
+    }
+    if (type == QEMU_AIO_READ || type == QEMU_AIO_WRITE) {
+        buf_index = luring_fixed_buf_index(s, luringcb->qiov);
+    }
 
     switch (type) {
     case QEMU_AIO_WRITE:
-        io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
-                             luringcb->qiov->niov, offset);
+        if (buf_index >= 0) {
+            io_uring_prep_write_fixed(sqes, fd, luringcb->qiov->iov[0].iov_base,
+                                      luringcb->qiov->size, offset, buf_index);
+        } else {
+            io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
+                                 luringcb->qiov->niov, offset);
+        }
         break;
     case QEMU_AIO_READ:
-        io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
-                            luringcb->qiov->niov, offset);
+        if (buf_index >= 0) {
+            io_uring_prep_read_fixed(sqes, fd, luringcb->qiov->iov[0].iov_base,
+                                     luringcb->qiov->size, offset, buf_index);
+        } else {
+            io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
+                                luringcb->qiov->niov, offset);
+        }
         break;
     case QEMU_AIO_FLUSH:
+        /* IOPOLL rings only support reads and writes */
+        assert(!s->iopoll);
         io_uring_prep_fsync(sqes, fd, IORING_FSYNC_DATASYNC);
         break;
     default:
@@ -346,6 +514,9 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                         __func__, type);
         abort();
     }
+    if (file_index >= 0) {
+        sqes->flags |= IOSQE_FIXED_FILE;
+    }
     io_uring_sqe_set_data(sqes, luringcb);
 
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
@@ -402,29 +573,323 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
                        qemu_luring_completion_cb, NULL, qemu_luring_poll_cb, s);
 }
 
-LuringState *luring_init(Error **errp)
+/*
+ * Turns the READ_FIXED/WRITE_FIXED requests that have been prepared but not
+ * submitted yet back into READV/WRITEV, so that they do not use a buffer
+ * index of a registration that is about to be replaced.
+ */
+static void luring_unfix_queued_bufs(LuringState *s)
+{
+    LuringAIOCB *luringcb;
+
+    /* With SQPOLL, the kernel thread may not have consumed all sqes yet */
+    while (io_uring_sq_ready(&s->ring)) {
+        if (io_uring_submit(&s->ring) < 0) {
+            break;
+        }
+    }
+
+    QSIMPLEQ_FOREACH(luringcb, &s->io_q.submit_queue, next) {
+        struct io_uring_sqe *sqe = &luringcb->sqeq;
+
+        if (sqe->opcode == IORING_OP_READ_FIXED) {
+            sqe->opcode = IORING_OP_READV;
+        } else if (sqe->opcode == IORING_OP_WRITE_FIXED) {
+            sqe->opcode = IORING_OP_WRITEV;
+        } else {
+            continue;
+        }
+        sqe->addr = (__u64)(uintptr_t)luringcb->qiov->iov;
+        sqe->len = luringcb->qiov->niov;
+        sqe->buf_index = 0;
+    }
+}
+
+/*
+ * Registers the current luring_ram with the ring, replacing the previous set
+ * of registered buffers.  Registration waits for in-flight requests, and
+ * requests that are still queued fall back to READV/WRITEV, so the caller
+ * must hold the AioContext lock to keep new requests from using stale
+ * buffer indexes.
+ */
+static void luring_update_fixed_bufs(LuringState *s)
+{
+    int ret;
+
+    luring_unfix_queued_bufs(s);
+
+    if (s->fixed_bufs_registered) {
+        io_uring_unregister_buffers(&s->ring);
+        s->fixed_bufs_registered = false;
+    }
+    g_array_set_size(s->fixed_bufs, 0);
+    g_array_append_vals(s->fixed_bufs, luring_ram->data, luring_ram->len);
+    if (s->fixed_bufs->len == 0) {
+        return;
+    }
+
+    ret = io_uring_register_buffers(&s->ring,
+                                    (struct iovec *)s->fixed_bufs->data,
+                                    s->fixed_bufs->len);
+    trace_luring_register_buffers(s, s->fixed_bufs->len, ret);
+    if (ret < 0) {
+        /* Not fatal, requests just use the normal readv/writev path */
+        warn_report_once("io_uring: failed to register guest RAM: %s",
+                         strerror(-ret));
+        return;
+    }
+    s->fixed_bufs_registered = true;
+}
+
+static gint luring_fixed_buf_compare(gconstpointer a, gconstpointer b)
+{
+    const struct iovec *iov_a = a, *iov_b = b;
+
+    if (iov_a->iov_base < iov_b->iov_base) {
+        return -1;
+    }
+    return iov_a->iov_base > iov_b->iov_base;
+}
+
+static void luring_add_ram(void *host, size_t size)
+{
+    uint8_t *p = host;
+
+    while (size > 0) {
+        struct iovec iov = {
+            .iov_base = p,
+            .iov_len = MIN(size, MAX_FIXED_BUF_SIZE),
+        };
+
+        g_array_append_val(luring_ram, iov);
+        p += iov.iov_len;
+        size -= iov.iov_len;
+    }
+    g_array_sort(luring_ram, luring_fixed_buf_compare);
+}
+
+/* Registers the new luring_ram with every ring that uses fixed buffers */
+static void luring_update_all_fixed_bufs(void)
+{
+    LuringState *s;
+
+    QLIST_FOREACH(s, &luring_fixed_bufs_rings, fixed_bufs_next) {
+        if (s->aio_context) {
+            aio_context_acquire(s->aio_context);
+        }
+        luring_update_fixed_bufs(s);
+        if (s->aio_context) {
+            aio_context_release(s->aio_context);
+        }
+    }
+}
+
+static void luring_ram_block_added(RAMBlockNotifier *n, void *host,
+                                   size_t size)
+{
+    luring_add_ram(host, size);
+    luring_update_all_fixed_bufs();
+}
+
+static void luring_ram_block_removed(RAMBlockNotifier *n, void *host,
+                                     size_t size)
+{
+    int i;
+
+    for (i = luring_ram->len - 1; i >= 0; i--) {
+        struct iovec *iov = &g_array_index(luring_ram, struct iovec, i);
+
+        if ((uint8_t *)iov->iov_base >= (uint8_t *)host &&
+            (uint8_t *)iov->iov_base < (uint8_t *)host + size) {
+            g_array_remove_index(luring_ram, i);
+        }
+    }
+    luring_update_all_fixed_bufs();
+}
+
+static int luring_init_ramblock(RAMBlock *rb, void *opaque)
+{
+    void *host_addr = qemu_ram_get_host_addr(rb);
+
+    if (host_addr) {
+        luring_add_ram(host_addr, qemu_ram_get_used_length(rb));
+    }
+    return 0;
+}
+
+/**
+ * luring_enable_fixed_bufs:
+ *
+ * Registers all guest RAM with the ring and keeps the registration up to
+ * date as RAM blocks are added and removed.  Must be called with the BQL
+ * held.
+ */
+void luring_enable_fixed_bufs(LuringState *s)
+{
+    if (s->fixed_bufs_enabled) {
+        return;
+    }
+    s->fixed_bufs_enabled = true;
+
+    if (QLIST_EMPTY(&luring_fixed_bufs_rings)) {
+        if (!luring_ram) {
+            luring_ram = g_array_new(false, false, sizeof(struct iovec));
+        }
+        luring_ram_notifier.ram_block_added = luring_ram_block_added;
+        luring_ram_notifier.ram_block_removed = luring_ram_block_removed;
+        ram_block_notifier_add(&luring_ram_notifier);
+        qemu_ram_foreach_block(luring_init_ramblock, NULL);
+    }
+    QLIST_INSERT_HEAD(&luring_fixed_bufs_rings, s, fixed_bufs_next);
+
+    luring_update_fixed_bufs(s);
+}
+
+/**
+ * luring_register_fd:
+ *
+ * Adds @fd to the registered file table so that requests for it skip the
+ * file descriptor lookup in the kernel.  The caller must call
+ * luring_unregister_fd() before closing @fd.
+ *
+ * Returns: 0 on success, -errno on failure.
+ */
+int luring_register_fd(LuringState *s, int fd)
+{
+    int i, ret;
+
+    if (luring_fixed_file_index(s, fd) >= 0) {
+        return 0;
+    }
+
+    if (!s->fixed_files_registered) {
+        ret = io_uring_register_files(&s->ring, s->fixed_files,
+                                      MAX_FIXED_FILES);
+        if (ret < 0) {
+            return ret;
+        }
+        s->fixed_files_registered = true;
+    }
+
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        if (s->fixed_files[i] == -1) {
+            break;
+        }
+    }
+    if (i == MAX_FIXED_FILES) {
+        return -ENOSPC;
+    }
+
+    ret = io_uring_register_files_update(&s->ring, i, &fd, 1);
+    trace_luring_register_fd(s, fd, i, ret);
+    if (ret < 0) {
+        return ret;
+    }
+    s->fixed_files[i] = fd;
+    return 0;
+}
+
+void luring_unregister_fd(LuringState *s, int fd)
+{
+    int i = luring_fixed_file_index(s, fd);
+    int unused = -1;
+
+    if (i < 0) {
+        return;
+    }
+
+    trace_luring_unregister_fd(s, fd, i);
+    io_uring_register_files_update(&s->ring, i, &unused, 1);
+    s->fixed_files[i] = -1;
+}
+
+LuringState *luring_init(unsigned int flags, Error **errp)
 {
-    int rc;
+    int rc, i;
     LuringState *s = g_new0(LuringState, 1);
     struct io_uring *ring = &s->ring;
+    struct io_uring_params params = { 0 };
 
     trace_luring_init_state(s, sizeof(*s));
 
-    rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+    if (flags & LURING_SQPOLL) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = SQPOLL_IDLE_MS;
+    }
+    if (flags & LURING_IOPOLL) {
+        params.flags |= IORING_SETUP_IOPOLL;
+        s->iopoll = true;
+    }
+
+    rc = io_uring_queue_init_params(MAX_ENTRIES, ring, &params);
     if (rc < 0) {
-        error_setg_errno(errp, errno, "failed to init linux io_uring ring");
+        error_setg_errno(errp, -rc, "failed to init linux io_uring ring");
         g_free(s);
         return NULL;
     }
 
     ioq_init(&s->io_q);
+    s->flags = flags;
+    s->fixed_bufs = g_array_new(false, false, sizeof(struct iovec));
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        s->fixed_files[i] = -1;
+    }
     return s;
 
 }
 
 void luring_cleanup(LuringState *s)
 {
+    if (s->fixed_bufs_enabled) {
+        QLIST_REMOVE(s, fixed_bufs_next);
+        if (QLIST_EMPTY(&luring_fixed_bufs_rings)) {
+            ram_block_notifier_remove(&luring_ram_notifier);
+            g_array_set_size(luring_ram, 0);
+        }
+    }
     io_uring_queue_exit(&s->ring);
+    g_array_free(s->fixed_bufs, true);
     trace_luring_cleanup_state(s);
     g_free(s);
 }
+
+/**
+ * luring_get_shared:
+ *
+ * Returns a ring with @flags that is attached to @ctx.  Rings are shared by
+ * all callers with the same AioContext and flags, so that guest RAM is only
+ * registered once per ring and there is a single SQPOLL kernel thread per
+ * AioContext.  Must be called with the BQL held; drop the reference with
+ * luring_put_shared().
+ */
+LuringState *luring_get_shared(AioContext *ctx, unsigned int flags,
+                               Error **errp)
+{
+    LuringState *s;
+
+    QLIST_FOREACH(s, &luring_shared_rings, shared_next) {
+        if (s->aio_context == ctx && s->flags == flags) {
+            s->refcnt++;
+            return s;
+        }
+    }
+
+    s = luring_init(flags, errp);
+    if (!s) {
+        return NULL;
+    }
+    s->refcnt = 1;
+    luring_attach_aio_context(s, ctx);
+    QLIST_INSERT_HEAD(&luring_shared_rings, s, shared_next);
+    return s;
+}
+
+void luring_put_shared(LuringState *s)
+{
+    if (--s->refcnt > 0) {
+        return;
+    }
+    QLIST_REMOVE(s, shared_next);
+    luring_detach_aio_context(s, s->aio_context);
+    luring_cleanup(s);
+}
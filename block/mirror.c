@@ -18,6 +18,7 @@
 #include "trace.h"
 #include "block/blockjob_int.h"
 #include "block/block_int.h"
+#include "block/block-status-map.h"
 #include "sysemu/block-backend.h"
 #include "qapi/error.h"
 #include "qapi/qmp/qerror.h"
@@ -81,6 +82,8 @@ typedef struct MirrorBlockJob {
     int target_cluster_size;
     int max_iov;
     bool initial_zeroing_ongoing;
+    /* Block status of the source, kept up to date with its writes */
+    BlockStatusMap *status_map;
     int in_active_write_counter;
     bool prepared;
     bool in_drain;
@@ -456,7 +459,6 @@ static unsigned mirror_perform(MirrorBlockJob *s, int64_t offset,
 
 static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
 {
-    BlockDriverState *source = s->mirror_top_bs->backing->bs;
     MirrorOp *pseudo_op;
     int64_t offset;
     uint64_t delay_ns = 0, ret = 0;
@@ -535,9 +537,9 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
         MirrorMethod mirror_method = MIRROR_METHOD_COPY;
 
         assert(!(offset % s->granularity));
-        ret = bdrv_block_status_above(source, NULL, offset,
-                                      nb_chunks * s->granularity,
-                                      &io_bytes, NULL, NULL);
+        ret = bdrv_block_status_map_get(s->status_map, offset,
+                                        nb_chunks * s->granularity,
+                                        &io_bytes);
         if (ret < 0) {
             io_bytes = MIN(nb_chunks * s->granularity, max_io_bytes);
         } else if (ret & BDRV_BLOCK_DATA) {
@@ -928,6 +930,17 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
     length = DIV_ROUND_UP(s->bdev_length, s->granularity);
     s->in_flight_bitmap = bitmap_new(length);
 
+    /* Query whole extents, so that the chunks of a large extent can be
+     * looked up in memory instead of asking the driver for each of them.
+     * The map tracks writes from all parents of the source, not only
+     * those that go through mirror_top. */
+    s->status_map = bdrv_block_status_map_new(bs, NULL, s->bdev_length, true,
+                                              errp);
+    if (!s->status_map) {
+        ret = -ENOMEM;
+        goto immediate_exit;
+    }
+
     /* If we have no backing file yet in the destination, we cannot let
      * the destination do COW.  Instead, we copy sectors around the
      * dirty data if needed.  We need a bitmap to do that.
@@ -1093,6 +1106,8 @@ immediate_exit:
     qemu_vfree(s->buf);
     g_free(s->cow_bitmap);
     g_free(s->in_flight_bitmap);
+    bdrv_block_status_map_free(s->status_map);
+    s->status_map = NULL;
     bdrv_dirty_iter_free(s->dbi);
 
     if (need_drain) {
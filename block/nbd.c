@@ -49,6 +49,7 @@
 
 #define EN_OPTSTR ":exportname="
 #define MAX_NBD_REQUESTS    16
+#define MAX_NBD_CONNECTIONS 16
 
 #define HANDLE_TO_INDEX(bs, handle) ((handle) ^ (uint64_t)(intptr_t)(bs))
 #define INDEX_TO_HANDLE(bs, index)  ((index)  ^ (uint64_t)(intptr_t)(bs))
@@ -142,6 +143,15 @@ typedef struct BDRVNBDState {
 
     bool wait_connect;
     NBDConnectThread *connect_thread;
+
+    /*
+     * Additional connections to the same export, opened as "nbd" child
+     * nodes when the server allows multi-conn.  Each of them has its own
+     * connection coroutine and reconnects on its own.
+     */
+    uint32_t multi_conn;
+    uint32_t nb_conns;
+    BdrvChild **conns;
 } BDRVNBDState;
 
 static int nbd_establish_connection(BlockDriverState *bs, SocketAddress *saddr,
@@ -151,6 +161,7 @@ static void nbd_co_establish_connection_cancel(BlockDriverState *bs,
                                                bool detach);
 static int nbd_client_handshake(BlockDriverState *bs, Error **errp);
 static void nbd_yank(void *opaque);
+static void nbd_close(BlockDriverState *bs);
 
 static void nbd_clear_bdrvstate(BDRVNBDState *s)
 {
@@ -1534,12 +1545,42 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
     return ret ? ret : request_ret;
 }
 
+/*
+ * Pick the connection with the fewest requests in flight, among those
+ * that are currently connected.  Returns NULL if the request should be
+ * sent on the connection of @s itself.
+ */
+static BdrvChild *nbd_pick_conn(BDRVNBDState *s)
+{
+    BdrvChild *best = NULL;
+    int best_in_flight = INT_MAX;
+    uint32_t i;
+
+    if (qatomic_load_acquire(&s->state) == NBD_CLIENT_CONNECTED) {
+        best_in_flight = s->in_flight;
+    }
+
+    for (i = 0; i < s->nb_conns; i++) {
+        BDRVNBDState *cs = s->conns[i]->bs->opaque;
+
+        if (qatomic_load_acquire(&cs->state) == NBD_CLIENT_CONNECTED &&
+            cs->in_flight < best_in_flight)
+        {
+            best = s->conns[i];
+            best_in_flight = cs->in_flight;
+        }
+    }
+
+    return best;
+}
+
 static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
                                 uint64_t bytes, QEMUIOVector *qiov, int flags)
 {
     int ret, request_ret;
     Error *local_err = NULL;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BdrvChild *conn;
     NBDRequest request = {
         .type = NBD_CMD_READ,
         .from = offset,
@@ -1552,6 +1593,11 @@ static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
     if (!bytes) {
         return 0;
     }
+
+    conn = nbd_pick_conn(s);
+    if (conn) {
+        return bdrv_co_preadv(conn, offset, bytes, qiov, flags);
+    }
     /*
      * Work around the fact that the block layer doesn't do
      * byte-accurate sizing yet - if the read exceeds the server's
@@ -1596,6 +1642,7 @@ static int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
                                  uint64_t bytes, QEMUIOVector *qiov, int flags)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BdrvChild *conn;
     NBDRequest request = {
         .type = NBD_CMD_WRITE,
         .from = offset,
@@ -1613,6 +1660,11 @@ static int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
     if (!bytes) {
         return 0;
     }
+
+    conn = nbd_pick_conn(s);
+    if (conn) {
+        return bdrv_co_pwritev(conn, offset, bytes, qiov, flags);
+    }
     return nbd_co_request(bs, &request, qiov);
 }
 
@@ -1620,6 +1672,7 @@ static int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
                                        int bytes, BdrvRequestFlags flags)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BdrvChild *conn;
     NBDRequest request = {
         .type = NBD_CMD_WRITE_ZEROES,
         .from = offset,
@@ -1646,6 +1699,11 @@ static int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
     if (!bytes) {
         return 0;
     }
+
+    conn = nbd_pick_conn(s);
+    if (conn) {
+        return bdrv_co_pwrite_zeroes(conn, offset, bytes, flags);
+    }
     return nbd_co_request(bs, &request, NULL);
 }
 
@@ -1668,6 +1726,7 @@ static int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset,
                                   int bytes)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BdrvChild *conn;
     NBDRequest request = {
         .type = NBD_CMD_TRIM,
         .from = offset,
@@ -1679,6 +1738,10 @@ static int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset,
         return 0;
     }
 
+    conn = nbd_pick_conn(s);
+    if (conn) {
+        return bdrv_co_pdiscard(conn, offset, bytes);
+    }
     return nbd_co_request(bs, &request, NULL);
 }
 
@@ -2208,6 +2271,12 @@ static QemuOptsList nbd_runtime_opts = {
                     "future requests before a successful reconnect will "
                     "immediately fail. Default 0",
         },
+        {
+            .name = "multi-conn",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to open if the server allows "
+                    "multi-conn. Default 1",
+        },
         { /* end of list */ }
     },
 };
@@ -2264,6 +2333,13 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
 
     s->reconnect_delay = qemu_opt_get_number(opts, "reconnect-delay", 0);
 
+    s->multi_conn = qemu_opt_get_number(opts, "multi-conn", 1);
+    if (s->multi_conn < 1 || s->multi_conn > MAX_NBD_CONNECTIONS) {
+        error_setg(errp, "multi-conn must be between 1 and %d",
+                   MAX_NBD_CONNECTIONS);
+        goto error;
+    }
+
     ret = 0;
 
  error:
@@ -2274,15 +2350,74 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
     return ret;
 }
 
+/*
+ * Open @s->multi_conn - 1 additional connections with the same options
+ * as the node itself.  They never need to flush: with
+ * NBD_FLAG_CAN_MULTI_CONN, a flush on the first connection also covers
+ * writes that were completed on the others.
+ */
+static int nbd_open_multi_conn(BlockDriverState *bs, QDict *conn_options,
+                               Error **errp)
+{
+    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    uint32_t i;
+
+    if (s->multi_conn == 1) {
+        return 0;
+    }
+    if (!(s->info.flags & NBD_FLAG_CAN_MULTI_CONN)) {
+        trace_nbd_multi_conn_unsupported(bs, s->multi_conn);
+        return 0;
+    }
+
+    s->conns = g_new0(BdrvChild *, s->multi_conn - 1);
+    for (i = 0; i < s->multi_conn - 1; i++) {
+        g_autofree char *name = g_strdup_printf("conn%" PRIu32, i + 1);
+        QDict *opts = qdict_new();
+        QDict *child_opts = qdict_clone_shallow(conn_options);
+
+        qdict_put_str(child_opts, "driver", "nbd");
+        qdict_put_bool(child_opts, BDRV_OPT_CACHE_NO_FLUSH, true);
+        qdict_put(opts, name, child_opts);
+        qdict_flatten(opts);
+
+        s->conns[i] = bdrv_open_child(NULL, opts, name, bs, &child_of_bds,
+                                      BDRV_CHILD_DATA, false, errp);
+        qobject_unref(opts);
+        if (!s->conns[i]) {
+            return -EINVAL;
+        }
+        s->nb_conns++;
+    }
+
+    return 0;
+}
+
+static void nbd_close_multi_conn(BlockDriverState *bs)
+{
+    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    uint32_t i;
+
+    for (i = 0; i < s->nb_conns; i++) {
+        bdrv_unref_child(bs, s->conns[i]);
+    }
+    g_free(s->conns);
+    s->conns = NULL;
+    s->nb_conns = 0;
+}
+
 static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
                     Error **errp)
 {
     int ret;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    QDict *conn_options = qdict_clone_shallow(options);
+
+    qdict_del(conn_options, "multi-conn");
 
     ret = nbd_process_options(bs, options, errp);
     if (ret < 0) {
-        return ret;
+        goto out;
     }
 
     s->bs = bs;
@@ -2290,7 +2425,8 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     qemu_co_queue_init(&s->free_sema);
 
     if (!yank_register_instance(BLOCKDEV_YANK_INSTANCE(bs->node_name), errp)) {
-        return -EEXIST;
+        ret = -EEXIST;
+        goto out;
     }
 
     /*
@@ -2299,14 +2435,15 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
      */
     if (nbd_establish_connection(bs, s->saddr, errp) < 0) {
         yank_unregister_instance(BLOCKDEV_YANK_INSTANCE(bs->node_name));
-        return -ECONNREFUSED;
+        ret = -ECONNREFUSED;
+        goto out;
     }
 
     ret = nbd_client_handshake(bs, errp);
     if (ret < 0) {
         yank_unregister_instance(BLOCKDEV_YANK_INSTANCE(bs->node_name));
         nbd_clear_bdrvstate(s);
-        return ret;
+        goto out;
     }
     /* successfully connected */
     s->state = NBD_CLIENT_CONNECTED;
@@ -2317,7 +2454,14 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     bdrv_inc_in_flight(bs);
     aio_co_schedule(bdrv_get_aio_context(bs), s->connection_co);
 
-    return 0;
+    ret = nbd_open_multi_conn(bs, conn_options, errp);
+    if (ret < 0) {
+        nbd_close(bs);
+    }
+
+out:
+    qobject_unref(conn_options);
+    return ret;
 }
 
 static int nbd_co_flush(BlockDriverState *bs)
@@ -2363,6 +2507,7 @@ static void nbd_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
 
+    nbd_close_multi_conn(bs);
     nbd_client_close(bs);
     yank_unregister_instance(BLOCKDEV_YANK_INSTANCE(bs->node_name));
     nbd_clear_bdrvstate(s);
@@ -2437,6 +2582,12 @@ static void nbd_refresh_filename(BlockDriverState *bs)
     }
 }
 
+/* The additional connections are implied by the multi-conn option */
+static void nbd_gather_child_options(BlockDriverState *bs, QDict *target,
+                                     bool backing_overridden)
+{
+}
+
 static char *nbd_dirname(BlockDriverState *bs, Error **errp)
 {
     /* The generic bdrv_dirname() implementation is able to work out some
@@ -2483,6 +2634,7 @@ static BlockDriver bdrv_nbd = {
     .bdrv_co_pwritev            = nbd_client_co_pwritev,
     .bdrv_co_pwrite_zeroes      = nbd_client_co_pwrite_zeroes,
     .bdrv_close                 = nbd_close,
+    .bdrv_child_perm            = bdrv_default_perms,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_pdiscard           = nbd_client_co_pdiscard,
     .bdrv_refresh_limits        = nbd_refresh_limits,
@@ -2493,6 +2645,7 @@ static BlockDriver bdrv_nbd = {
     .bdrv_co_drain_begin        = nbd_client_co_drain_begin,
     .bdrv_co_drain_end          = nbd_client_co_drain_end,
     .bdrv_refresh_filename      = nbd_refresh_filename,
+    .bdrv_gather_child_options  = nbd_gather_child_options,
     .bdrv_co_block_status       = nbd_client_co_block_status,
     .bdrv_dirname               = nbd_dirname,
     .strong_runtime_opts        = nbd_strong_runtime_opts,
@@ -2512,6 +2665,7 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_co_pwritev            = nbd_client_co_pwritev,
     .bdrv_co_pwrite_zeroes      = nbd_client_co_pwrite_zeroes,
     .bdrv_close                 = nbd_close,
+    .bdrv_child_perm            = bdrv_default_perms,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_pdiscard           = nbd_client_co_pdiscard,
     .bdrv_refresh_limits        = nbd_refresh_limits,
@@ -2522,6 +2676,7 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_co_drain_begin        = nbd_client_co_drain_begin,
     .bdrv_co_drain_end          = nbd_client_co_drain_end,
     .bdrv_refresh_filename      = nbd_refresh_filename,
+    .bdrv_gather_child_options  = nbd_gather_child_options,
     .bdrv_co_block_status       = nbd_client_co_block_status,
     .bdrv_dirname               = nbd_dirname,
     .strong_runtime_opts        = nbd_strong_runtime_opts,
@@ -2541,6 +2696,7 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_co_pwritev            = nbd_client_co_pwritev,
     .bdrv_co_pwrite_zeroes      = nbd_client_co_pwrite_zeroes,
     .bdrv_close                 = nbd_close,
+    .bdrv_child_perm            = bdrv_default_perms,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_pdiscard           = nbd_client_co_pdiscard,
     .bdrv_refresh_limits        = nbd_refresh_limits,
@@ -2551,6 +2707,7 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_co_drain_begin        = nbd_client_co_drain_begin,
     .bdrv_co_drain_end          = nbd_client_co_drain_end,
     .bdrv_refresh_filename      = nbd_refresh_filename,
+    .bdrv_gather_child_options  = nbd_gather_child_options,
     .bdrv_co_block_status       = nbd_client_co_block_status,
     .bdrv_dirname               = nbd_dirname,
     .strong_runtime_opts        = nbd_strong_runtime_opts,
@@ -39,6 +39,9 @@
  */
 #define NVME_NUM_REQS (NVME_QUEUE_SIZE - 1)
 
+/* Upper limit for the num-queues option */
+#define NVME_MAX_IO_QUEUES 64
+
 typedef struct BDRVNVMeState BDRVNVMeState;
 
 /* Same index is used for queues and IRQs */
@@ -62,6 +65,7 @@ typedef struct {
 typedef struct {
     BlockCompletionFunc *cb;
     void *opaque;
+    uint32_t *result; /* if set, receives Dword 0 of the completion entry */
     int cid;
     void *prp_list_page;
     uint64_t prp_list_iova;
@@ -140,6 +144,7 @@ struct BDRVNVMeState {
 
 #define NVME_BLOCK_OPT_DEVICE "device"
 #define NVME_BLOCK_OPT_NAMESPACE "namespace"
+#define NVME_BLOCK_OPT_NUM_QUEUES "num-queues"
 
 static void nvme_process_completion_bh(void *opaque);
 
@@ -157,6 +162,11 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "NVMe namespace",
         },
+        {
+            .name = NVME_BLOCK_OPT_NUM_QUEUES,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of I/O queue pairs",
+        },
         { /* end of list */ }
     },
 };
@@ -412,8 +422,12 @@ static bool nvme_process_completion(NVMeQueuePair *q)
         req = *preq;
         assert(req.cid == cid);
         assert(req.cb);
+        if (req.result) {
+            *req.result = le32_to_cpu(c->result);
+        }
         nvme_put_free_req_locked(q, preq);
         preq->cb = preq->opaque = NULL;
+        preq->result = NULL;
         q->inflight--;
         qemu_mutex_unlock(&q->lock);
         req.cb(req.opaque, ret);
@@ -490,7 +504,9 @@ static void nvme_admin_cmd_sync_cb(void *opaque, int ret)
     aio_wait_kick();
 }
 
-static int nvme_admin_cmd_sync(BlockDriverState *bs, NvmeCmd *cmd)
+/* If @result is not NULL, it receives Dword 0 of the completion entry */
+static int nvme_admin_cmd_sync_result(BlockDriverState *bs, NvmeCmd *cmd,
+                                      uint32_t *result)
 {
     BDRVNVMeState *s = bs->opaque;
     NVMeQueuePair *q = s->queues[INDEX_ADMIN];
@@ -501,12 +517,18 @@ static int nvme_admin_cmd_sync(BlockDriverState *bs, NvmeCmd *cmd)
     if (!req) {
         return -EBUSY;
     }
+    req->result = result;
     nvme_submit_command(q, req, cmd, nvme_admin_cmd_sync_cb, &ret);
 
     AIO_WAIT_WHILE(aio_context, ret == -EINPROGRESS);
     return ret;
 }
 
+static int nvme_admin_cmd_sync(BlockDriverState *bs, NvmeCmd *cmd)
+{
+    return nvme_admin_cmd_sync_result(bs, cmd, NULL);
+}
+
 /* Returns true on success, false on failure. */
 static bool nvme_identify(BlockDriverState *bs, int namespace, Error **errp)
 {
@@ -605,12 +627,17 @@ static bool nvme_poll_queue(NVMeQueuePair *q)
     const size_t cqe_offset = q->cq.head * NVME_CQ_ENTRY_BYTES;
     NvmeCqe *cqe = (NvmeCqe *)&q->cq.queue[cqe_offset];
 
-    trace_nvme_poll_queue(q->s, q->index);
     /*
      * Do an early check for completions. q->lock isn't needed because
      * nvme_process_completion() only runs in the event loop thread and
-     * cannot race with itself.
+     * cannot race with itself.  Idle queues are skipped without touching
+     * their completion queue, so that polling cost does not grow with the
+     * number of queues.
      */
+    if (!q->inflight) {
+        return false;
+    }
+    trace_nvme_poll_queue(q->s, q->index);
     if ((le16_to_cpu(cqe->status) & 0x1) == q->cq_phase) {
         return false;
     }
@@ -691,6 +718,57 @@ out_error:
     return false;
 }
 
+/*
+ * Request the controller to allocate *@count I/O queue pairs.  The
+ * controller may allocate fewer than requested, in which case *@count is
+ * lowered to the number of queue pairs that can actually be created.
+ */
+static bool nvme_set_num_queues(BlockDriverState *bs, unsigned *count,
+                                Error **errp)
+{
+    NvmeCmd cmd = {
+        .opcode = NVME_ADM_CMD_SET_FEATURES,
+        .cdw10 = cpu_to_le32(NVME_NUMBER_OF_QUEUES),
+        .cdw11 = cpu_to_le32(((*count - 1) << 16) | (*count - 1)),
+    };
+    uint32_t result;
+    unsigned allocated;
+
+    if (nvme_admin_cmd_sync_result(bs, &cmd, &result)) {
+        error_setg(errp, "Failed to allocate %u I/O queues", *count);
+        return false;
+    }
+
+    /* NSQA and NCQA are zero-based */
+    allocated = MIN(extract32(result, 0, 16), extract32(result, 16, 16)) + 1;
+    if (allocated < *count) {
+        warn_report("NVMe controller only allocated %u of %u requested I/O "
+                    "queues", allocated, *count);
+        *count = allocated;
+    }
+    return true;
+}
+
+/*
+ * Pick the I/O queue with the fewest outstanding commands.  All queues are
+ * only submitted to from the BDS's AioContext, so the unlocked reads are
+ * merely a heuristic and cannot race with a submission.
+ */
+static NVMeQueuePair *nvme_get_io_queue(BDRVNVMeState *s)
+{
+    NVMeQueuePair *best = s->queues[INDEX_IO(0)];
+    unsigned i;
+
+    for (i = INDEX_IO(1); i < s->queue_count; i++) {
+        NVMeQueuePair *q = s->queues[i];
+
+        if (q->inflight + q->need_kick < best->inflight + best->need_kick) {
+            best = q;
+        }
+    }
+    return best;
+}
+
 static bool nvme_poll_cb(void *opaque)
 {
     EventNotifier *e = opaque;
@@ -701,7 +779,7 @@ static bool nvme_poll_cb(void *opaque)
 }
 
 static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
-                     Error **errp)
+                     unsigned num_queues, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
     NVMeQueuePair *q;
@@ -712,6 +790,7 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     uint64_t timeout_ms;
     uint64_t deadline, now;
     volatile NvmeBar *regs = NULL;
+    unsigned i;
 
     qemu_co_mutex_init(&s->dma_map_lock);
     qemu_co_queue_init(&s->dma_flush_queue);
@@ -840,8 +919,15 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     }
 
     /* Set up command queues. */
-    if (!nvme_add_io_queue(bs, errp)) {
+    if (num_queues > 1 && !nvme_set_num_queues(bs, &num_queues, errp)) {
         ret = -EIO;
+        goto out;
+    }
+    for (i = 0; i < num_queues; i++) {
+        if (!nvme_add_io_queue(bs, errp)) {
+            ret = -EIO;
+            goto out;
+        }
     }
 out:
     if (regs) {
@@ -932,6 +1018,7 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     const char *device;
     QemuOpts *opts;
     int namespace;
+    uint64_t num_queues;
     int ret;
     BDRVNVMeState *s = bs->opaque;
 
@@ -947,7 +1034,14 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     namespace = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NAMESPACE, 1);
-    ret = nvme_init(bs, device, namespace, errp);
+    num_queues = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NUM_QUEUES, 1);
+    if (num_queues < 1 || num_queues > NVME_MAX_IO_QUEUES) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_NUM_QUEUES "' must be between "
+                   "1 and %d", NVME_MAX_IO_QUEUES);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    ret = nvme_init(bs, device, namespace, num_queues, errp);
     qemu_opts_del(opts);
     if (ret) {
         goto fail;
@@ -1119,7 +1213,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
 {
     int r;
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
 
     uint32_t cdw12 = (((bytes >> s->blkshift) - 1) & 0xFFFF) |
@@ -1237,7 +1331,7 @@ static coroutine_fn int nvme_co_pwritev(BlockDriverState *bs,
 static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
     NvmeCmd cmd = {
         .opcode = NVME_CMD_FLUSH,
@@ -1268,7 +1362,7 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
                                               BdrvRequestFlags flags)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
 
     uint32_t cdw12 = ((bytes >> s->blkshift) - 1) & 0xFFFF;
@@ -1321,7 +1415,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
                                          int bytes)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
     NvmeDsmRange *buf;
     QEMUIOVector local_qiov;
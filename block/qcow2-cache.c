@@ -31,8 +31,20 @@ typedef struct Qcow2CachedTable {
     uint64_t lru_counter;
     int      ref;
     bool     dirty;
+    /* The table is being read from disk into this entry */
+    bool     loading;
+    /* The table was discarded while loading and must not be used */
+    bool     stale;
+    QTAILQ_ENTRY(Qcow2CachedTable) lru_entry;
 } Qcow2CachedTable;
 
+/*
+ * The cache is only accessed from the node's AioContext.  Most accesses are
+ * made under s->lock, but qcow2_cache_preload() loads tables without it, so
+ * code that requires all entries to be unreferenced must first block new
+ * preloads and wait for the running ones to complete (see
+ * qcow2_cache_empty()).
+ */
 struct Qcow2Cache {
     Qcow2CachedTable       *entries;
     struct Qcow2Cache      *depends;
@@ -42,6 +54,34 @@ struct Qcow2Cache {
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+
+    /* Maps the offset of each cached table to its Qcow2CachedTable */
+    GHashTable             *table_hash;
+
+    /*
+     * Unreferenced entries, least recently used first. Free entries are
+     * kept at the head so that they are always reused before evicting a
+     * cached table.
+     */
+    QTAILQ_HEAD(, Qcow2CachedTable) lru_list;
+
+    /* Offset of the last table that was looked up, for prefetching */
+    uint64_t                last_offset;
+
+    /* Coroutines waiting for a table that is being loaded */
+    CoQueue                 loading_queue;
+    /* Number of qcow2_cache_preload() calls in flight */
+    int                     preloads_in_flight;
+    /* Coroutines waiting for preloads_in_flight to drop to zero */
+    CoQueue                 preload_queue;
+    /* Number of qcow2_cache_empty() calls that keep preloads from starting */
+    int                     preloads_blocked;
+
+    /*
+     * Buffered read-only fd of the image file, or -1.  Tables are copied
+     * from the host page cache through it when they are resident there.
+     */
+    int                     shared_fd;
 };
 
 static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int table)
@@ -57,6 +97,37 @@ static inline int qcow2_cache_get_table_idx(Qcow2Cache *c, void *table)
     return idx;
 }
 
+/*
+ * Copy the table at @offset from the host page cache into @buf without
+ * blocking on the disk.  If it is not resident there, ask the kernel to
+ * read it in the background so that the next lookup, in this or any other
+ * process that opens the same image, finds it there.
+ *
+ * Returns true if the table was copied.
+ */
+static bool qcow2_cache_read_shared(Qcow2Cache *c, uint64_t offset, void *buf)
+{
+#ifdef RWF_NOWAIT
+    struct iovec iov = { .iov_base = buf, .iov_len = c->table_size };
+    ssize_t ret;
+
+    if (c->shared_fd < 0) {
+        return false;
+    }
+
+    do {
+        ret = preadv2(c->shared_fd, &iov, 1, offset, RWF_NOWAIT);
+    } while (ret < 0 && errno == EINTR);
+    if (ret == c->table_size) {
+        return true;
+    }
+
+    /* Short reads (e.g. a truncated file) also go through the normal path */
+    posix_fadvise(c->shared_fd, offset, c->table_size, POSIX_FADV_WILLNEED);
+#endif
+    return false;
+}
+
 static inline const char *qcow2_cache_get_name(BDRVQcow2State *s, Qcow2Cache *c)
 {
     if (c == s->refcount_block_cache) {
@@ -84,6 +155,26 @@ static void qcow2_cache_table_release(Qcow2Cache *c, int i, int num_tables)
 #endif
 }
 
+/*
+ * Forget the table cached in entry @i and move the entry to the head of the
+ * LRU list so it is reused first. The entry must not be referenced.
+ */
+static void qcow2_cache_entry_drop(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    assert(t->ref == 0);
+
+    if (t->offset) {
+        g_hash_table_remove(c->table_hash, &t->offset);
+    }
+    t->offset = 0;
+    t->lru_counter = 0;
+
+    QTAILQ_REMOVE(&c->lru_list, t, lru_entry);
+    QTAILQ_INSERT_HEAD(&c->lru_list, t, lru_entry);
+}
+
 static inline bool can_clean_entry(Qcow2Cache *c, int i)
 {
     Qcow2CachedTable *t = &c->entries[i];
@@ -104,8 +195,7 @@ void qcow2_cache_clean_unused(Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
-            c->entries[i].lru_counter = 0;
+            qcow2_cache_entry_drop(c, i);
             i++;
             to_clean++;
         }
@@ -123,6 +213,7 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
 {
     BDRVQcow2State *s = bs->opaque;
     Qcow2Cache *c;
+    int i;
 
     assert(num_tables > 0);
     assert(is_power_of_2(table_size));
@@ -132,6 +223,7 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
     c->table_size = table_size;
+    c->shared_fd = -1;
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
     c->table_array = qemu_try_blockalign(bs->file->bs,
                                          (size_t) num_tables * c->table_size);
@@ -140,7 +232,15 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
         qemu_vfree(c->table_array);
         g_free(c->entries);
         g_free(c);
-        c = NULL;
+        return NULL;
+    }
+
+    c->table_hash = g_hash_table_new(g_int64_hash, g_int64_equal);
+    qemu_co_queue_init(&c->loading_queue);
+    qemu_co_queue_init(&c->preload_queue);
+    QTAILQ_INIT(&c->lru_list);
+    for (i = 0; i < num_tables; i++) {
+        QTAILQ_INSERT_TAIL(&c->lru_list, &c->entries[i], lru_entry);
     }
 
     return c;
@@ -154,6 +254,7 @@ int qcow2_cache_destroy(Qcow2Cache *c)
         assert(c->entries[i].ref == 0);
     }
 
+    g_hash_table_destroy(c->table_hash);
     qemu_vfree(c->table_array);
     g_free(c->entries);
     g_free(c);
@@ -161,6 +262,17 @@ int qcow2_cache_destroy(Qcow2Cache *c)
     return 0;
 }
 
+/*
+ * Read tables that are in the host page cache through @fd, a buffered
+ * read-only fd of the image file, which must stay open until the cache is
+ * destroyed or the fd is removed again by passing -1.  Only tables that are
+ * never written may be looked up while an fd is set.
+ */
+void qcow2_cache_set_shared_fd(Qcow2Cache *c, int fd)
+{
+    c->shared_fd = fd;
+}
+
 static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret;
@@ -294,37 +406,120 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
     c->depends_on_flush = true;
 }
 
+/* Wait until no entry is referenced by qcow2_cache_preload() any more */
+static void qcow2_cache_wait_preloads(BlockDriverState *bs, Qcow2Cache *c)
+{
+    if (qemu_in_coroutine()) {
+        while (c->preloads_in_flight) {
+            qemu_co_queue_wait(&c->preload_queue, NULL);
+        }
+    } else {
+        BDRV_POLL_WHILE(bs, c->preloads_in_flight > 0);
+    }
+}
+
 int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret, i;
 
+    /*
+     * The flush may yield, so keep preloads from taking entries again
+     * until the cache is empty.
+     */
+    c->preloads_blocked++;
+    qcow2_cache_wait_preloads(bs, c);
+
     ret = qcow2_cache_flush(bs, c);
     if (ret < 0) {
+        c->preloads_blocked--;
         return ret;
     }
 
+    g_hash_table_remove_all(c->table_hash);
+    QTAILQ_INIT(&c->lru_list);
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
         c->entries[i].offset = 0;
         c->entries[i].lru_counter = 0;
+        QTAILQ_INSERT_TAIL(&c->lru_list, &c->entries[i], lru_entry);
     }
 
     qcow2_cache_table_release(c, 0, c->size);
 
     c->lru_counter = 0;
+    c->last_offset = 0;
+    c->preloads_blocked--;
 
     return 0;
 }
 
+/*
+ * Takes the least recently used entry off the LRU list and starts loading
+ * the table at @offset into it. The caller holds a reference to the entry
+ * until qcow2_cache_load_done() is called.
+ *
+ * Only clean entries are taken, so that no table has to be written back.
+ * Returns NULL if no such entry is available.
+ */
+static Qcow2CachedTable *qcow2_cache_load_start(Qcow2Cache *c,
+                                                uint64_t offset)
+{
+    Qcow2CachedTable *t = QTAILQ_FIRST(&c->lru_list);
+
+    if (!t || t->dirty) {
+        return NULL;
+    }
+
+    qcow2_cache_entry_drop(c, t - c->entries);
+    QTAILQ_REMOVE(&c->lru_list, t, lru_entry);
+
+    t->ref++;
+    t->loading = true;
+    t->offset = offset;
+    g_hash_table_insert(c->table_hash, &t->offset, t);
+
+    return t;
+}
+
+/*
+ * Finishes loading a table started with qcow2_cache_load_start(). If
+ * @keep_ref is false, the reference taken for the load is dropped.
+ *
+ * Returns false if the table could not be loaded; the entry is then
+ * freed (and @keep_ref ignored).
+ */
+static bool qcow2_cache_load_done(Qcow2Cache *c, Qcow2CachedTable *t,
+                                  bool success, bool keep_ref)
+{
+    t->loading = false;
+
+    if (!success || t->stale) {
+        g_hash_table_remove(c->table_hash, &t->offset);
+        t->offset = 0;
+        t->stale = false;
+        t->ref--;
+        QTAILQ_INSERT_HEAD(&c->lru_list, t, lru_entry);
+        return false;
+    }
+
+    if (!keep_ref) {
+        t->ref--;
+        t->lru_counter = ++c->lru_counter;
+        QTAILQ_INSERT_TAIL(&c->lru_list, t, lru_entry);
+    }
+    return true;
+}
+
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2CachedTable *t, *prefetch = NULL;
+    QEMUIOVector qiov;
+    uint64_t prefetch_offset;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
+    bool sequential;
 
     assert(offset != 0);
 
@@ -338,30 +533,32 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
         return -EIO;
     }
 
+    sequential = offset == c->last_offset + c->table_size;
+    c->last_offset = offset;
+
+retry:
     /* Check if the table is already cached */
-    i = lookup_index = (offset / c->table_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
+    t = g_hash_table_lookup(c->table_hash, &offset);
+    if (t) {
+        if (t->loading) {
+            /* Somebody else is reading this table, wait for it */
+            assert(qemu_in_coroutine());
+            qemu_co_queue_wait(&c->loading_queue, NULL);
+            goto retry;
         }
-        if (++i == c->size) {
-            i = 0;
-        }
-    } while (i != lookup_index);
+        i = t - c->entries;
+        goto found;
+    }
 
-    if (min_lru_index == -1) {
+    t = QTAILQ_FIRST(&c->lru_list);
+    if (!t) {
         /* This can't happen in current synchronous code, but leave the check
          * here as a reminder for whoever starts using AIO with the cache */
         abort();
     }
 
-    /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
+    /* Cache miss: write the least recently used table back and replace it */
+    i = t - c->entries;
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
 
@@ -370,27 +567,83 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
         return ret;
     }
 
+    /* The table may have been preloaded while we were writing back */
+    if (g_hash_table_contains(c->table_hash, &offset) ||
+        t != QTAILQ_FIRST(&c->lru_list) || t->dirty) {
+        goto retry;
+    }
+
+    t = qcow2_cache_load_start(c, offset);
+    assert(t == &c->entries[i]);
+
+    if (!read_from_disk) {
+        qcow2_cache_load_done(c, t, true, true);
+        goto done;
+    }
+
+    if (qcow2_cache_read_shared(c, offset, qcow2_cache_get_table_addr(c, i))) {
+        trace_qcow2_cache_get_shared(qemu_coroutine_self(),
+                                     c == s->l2_table_cache, offset);
+        qcow2_cache_load_done(c, t, true, true);
+        goto done;
+    }
+
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
-    if (read_from_disk) {
-        if (c == s->l2_table_cache) {
-            BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
-        }
 
-        ret = bdrv_pread(bs->file, offset,
-                         qcow2_cache_get_table_addr(c, i),
+    /*
+     * On sequential access, read the next slice of the same table along
+     * with this one so that the next lookup is a cache hit.  This is only
+     * done in coroutine context, where a vectored read can be issued.
+     */
+    prefetch_offset = offset + c->table_size;
+    if (qemu_in_coroutine() && sequential &&
+        offset_into_cluster(s, prefetch_offset) != 0 &&
+        !g_hash_table_contains(c->table_hash, &prefetch_offset))
+    {
+        prefetch = qcow2_cache_load_start(c, prefetch_offset);
+    }
+
+    if (c == s->l2_table_cache) {
+        BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
+    }
+
+    if (prefetch) {
+        trace_qcow2_cache_get_prefetch(qemu_coroutine_self(),
+                                       c == s->l2_table_cache,
+                                       prefetch - c->entries);
+        qemu_iovec_init(&qiov, 2);
+        qemu_iovec_add(&qiov, qcow2_cache_get_table_addr(c, i),
+                       c->table_size);
+        qemu_iovec_add(&qiov,
+                       qcow2_cache_get_table_addr(c, prefetch - c->entries),
+                       c->table_size);
+        ret = bdrv_co_preadv(bs->file, offset, qiov.size, &qiov, 0);
+        qemu_iovec_destroy(&qiov);
+    } else {
+        ret = bdrv_pread(bs->file, offset, qcow2_cache_get_table_addr(c, i),
                          c->table_size);
-        if (ret < 0) {
-            return ret;
-        }
     }
 
-    c->entries[i].offset = offset;
+    if (prefetch) {
+        qcow2_cache_load_done(c, prefetch, ret >= 0, false);
+    }
+    if (!qcow2_cache_load_done(c, t, ret >= 0, true) && ret >= 0) {
+        ret = -EIO;
+    }
+    qemu_co_queue_restart_all(&c->loading_queue);
+    if (ret < 0) {
+        return ret;
+    }
+    goto done;
 
     /* And return the right table */
 found:
-    c->entries[i].ref++;
+    if (c->entries[i].ref++ == 0) {
+        QTAILQ_REMOVE(&c->lru_list, &c->entries[i], lru_entry);
+    }
+
+done:
     *table = qcow2_cache_get_table_addr(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
@@ -411,15 +664,76 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     return qcow2_cache_do_get(bs, c, offset, table, false);
 }
 
+/*
+ * Reads the table at @offset into the cache without requiring the caller to
+ * hold s->lock, so that a subsequent qcow2_cache_get() for it is a hit.
+ *
+ * This is only a hint: nothing is done if the table is already cached or if
+ * no clean entry is available. Concurrent qcow2_cache_get() calls for the
+ * same table wait until the load has completed.
+ */
+void coroutine_fn qcow2_cache_preload(BlockDriverState *bs, Qcow2Cache *c,
+                                      uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CachedTable *t;
+    int ret;
+
+    if (c->preloads_blocked || offset == 0 ||
+        !QEMU_IS_ALIGNED(offset, c->table_size) ||
+        g_hash_table_contains(c->table_hash, &offset))
+    {
+        return;
+    }
+
+    /* Leave enough free entries for the lock holder's lookups */
+    if (c->preloads_in_flight >= c->size / 4) {
+        return;
+    }
+
+    t = qcow2_cache_load_start(c, offset);
+    if (!t) {
+        return;
+    }
+
+    trace_qcow2_cache_preload(qemu_coroutine_self(), c == s->l2_table_cache,
+                              offset, t - c->entries);
+
+    c->preloads_in_flight++;
+    if (c == s->l2_table_cache) {
+        BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
+    }
+    if (qcow2_cache_read_shared(c, offset,
+                                qcow2_cache_get_table_addr(c, t - c->entries)))
+    {
+        ret = 0;
+    } else {
+        ret = bdrv_co_pread(bs->file, offset, c->table_size,
+                            qcow2_cache_get_table_addr(c, t - c->entries), 0);
+    }
+
+    qcow2_cache_load_done(c, t, ret >= 0, false);
+    qemu_co_queue_restart_all(&c->loading_queue);
+
+    /* Only now that the reference is dropped, the cache may be emptied */
+    if (--c->preloads_in_flight == 0) {
+        qemu_co_queue_restart_all(&c->preload_queue);
+        aio_wait_kick();
+    }
+}
+
 void qcow2_cache_put(Qcow2Cache *c, void **table)
 {
-    int i = qcow2_cache_get_table_idx(c, *table);
+    int i;
+
+    i = qcow2_cache_get_table_idx(c, *table);
 
     c->entries[i].ref--;
     *table = NULL;
 
     if (c->entries[i].ref == 0) {
         c->entries[i].lru_counter = ++c->lru_counter;
+        QTAILQ_INSERT_TAIL(&c->lru_list, &c->entries[i], lru_entry);
     }
 
     assert(c->entries[i].ref >= 0);
@@ -432,14 +746,22 @@ void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
     c->entries[i].dirty = true;
 }
 
+/*
+ * Returns the cached table at @offset, or NULL if it is not cached. A table
+ * that is still being loaded is not returned; as this is only used before
+ * discarding the table, it is marked stale so that it is dropped as soon as
+ * the load completes.
+ */
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset)
 {
-    int i;
+    Qcow2CachedTable *t = g_hash_table_lookup(c->table_hash, &offset);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            return qcow2_cache_get_table_addr(c, i);
-        }
+    if (t && t->loading) {
+        t->stale = true;
+        return NULL;
+    }
+    if (t) {
+        return qcow2_cache_get_table_addr(c, t - c->entries);
     }
     return NULL;
 }
@@ -450,8 +772,7 @@ void qcow2_cache_discard(Qcow2Cache *c, void *table)
 
     assert(c->entries[i].ref == 0);
 
-    c->entries[i].offset = 0;
-    c->entries[i].lru_counter = 0;
+    qcow2_cache_entry_drop(c, i);
     c->entries[i].dirty = false;
 
     qcow2_cache_table_release(c, i, 1);
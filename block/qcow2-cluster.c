@@ -215,6 +215,35 @@ static int l2_load(BlockDriverState *bs, uint64_t offset,
                            (void **)l2_slice);
 }
 
+/*
+ * Loads the L2 slice that contains the mapping of guest @offset into the L2
+ * cache. Unlike l2_load(), this may be called without holding s->lock: the
+ * slice is read while other requests keep running, and the lookup done
+ * afterwards under the lock is a cache hit.
+ */
+void coroutine_fn qcow2_co_preload_l2_slice(BlockDriverState *bs,
+                                            uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l1_index, l2_offset;
+    int start_of_slice;
+
+    l1_index = offset_to_l1_index(s, offset);
+    if (l1_index >= s->l1_size) {
+        return;
+    }
+
+    /* Corrupted offsets are reported by the locked lookup */
+    l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    if (!l2_offset || offset_into_cluster(s, l2_offset)) {
+        return;
+    }
+
+    start_of_slice = l2_entry_size(s) *
+        (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
+    qcow2_cache_preload(bs, s->l2_table_cache, l2_offset + start_of_slice);
+}
+
 /*
  * Writes an L1 entry to disk (note that depending on the alignment
  * requirements this function may write more that just one entry in
@@ -37,15 +37,22 @@
 #include "block/thread-pool.h"
 #include "crypto.h"
 
+/*
+ * Run @func in the thread pool, with at most @max_threads tasks of this
+ * image in flight.  The limit differs between callers (encryption is
+ * bound by the number of ciphers), so waiters are all woken up and
+ * recheck their own limit.
+ */
 static int coroutine_fn
-qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
+qcow2_co_process(BlockDriverState *bs, int max_threads,
+                 ThreadPoolFunc *func, void *arg)
 {
     int ret;
     BDRVQcow2State *s = bs->opaque;
     ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
 
     qemu_co_mutex_lock(&s->lock);
-    while (s->nb_threads >= QCOW2_MAX_THREADS) {
+    while (s->nb_threads >= max_threads) {
         qemu_co_queue_wait(&s->thread_task_queue, &s->lock);
     }
     s->nb_threads++;
@@ -55,7 +62,7 @@ qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
 
     qemu_co_mutex_lock(&s->lock);
     s->nb_threads--;
-    qemu_co_queue_next(&s->thread_task_queue);
+    qemu_co_queue_restart_all(&s->thread_task_queue);
     qemu_co_mutex_unlock(&s->lock);
 
     return ret;
@@ -339,6 +346,7 @@ static ssize_t coroutine_fn
 qcow2_co_do_compress(BlockDriverState *bs, void *dest, size_t dest_size,
                      const void *src, size_t src_size, Qcow2CompressFunc func)
 {
+    BDRVQcow2State *s = bs->opaque;
     Qcow2CompressData arg = {
         .dest = dest,
         .dest_size = dest_size,
@@ -347,7 +355,8 @@ qcow2_co_do_compress(BlockDriverState *bs, void *dest, size_t dest_size,
         .func = func,
     };
 
-    qcow2_co_process(bs, qcow2_compress_pool_func, &arg);
+    qcow2_co_process(bs, s->max_compress_threads, qcow2_compress_pool_func,
+                     &arg);
 
     return arg.ret;
 }
@@ -475,7 +484,8 @@ qcow2_co_encdec(BlockDriverState *bs, uint64_t host_offset,
     assert(QEMU_IS_ALIGNED(host_offset, sector_size));
     assert(QEMU_IS_ALIGNED(len, sector_size));
 
-    return len == 0 ? 0 : qcow2_co_process(bs, qcow2_encdec_pool_func, &arg);
+    return len == 0 ? 0 : qcow2_co_process(bs, QCOW2_MAX_THREADS,
+                                           qcow2_encdec_pool_func, &arg);
 }
 
 /*
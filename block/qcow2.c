@@ -697,6 +697,7 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_L2_CACHE_SHARED,
     NULL
 };
 
@@ -808,6 +809,12 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_L2_CACHE_SHARED,
+            .type = QEMU_OPT_BOOL,
+            .help = "Read L2 tables from the host page cache while the "
+                    "image is read-only",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -958,9 +965,65 @@ static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
     }
 }
 
+/*
+ * Open a buffered read-only fd of the image file for L2 lookups.  All
+ * processes that open the same read-only image read its L2 tables from
+ * the same host page cache pages, even if the image itself is opened with
+ * cache.direct=on, and a table only has to come from the disk once per
+ * host.
+ */
+static int qcow2_l2_shared_fd_open(BlockDriverState *bs, Error **errp)
+{
+#ifdef RWF_NOWAIT
+    BlockDriverState *file = bs->file->bs;
+    struct stat file_st, fd_st;
+    int fd, ret;
+
+    if (strcmp(file->drv->format_name, "file")) {
+        error_setg(errp, QCOW2_OPT_L2_CACHE_SHARED " requires the image to "
+                   "be stored in a local file");
+        return -1;
+    }
+
+    ret = bdrv_fstat(file, &file_st);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not stat the image file");
+        return -1;
+    }
+
+    fd = qemu_open(file->filename, O_RDONLY, errp);
+    if (fd < 0) {
+        return -1;
+    }
+
+    /* The path may name a different file by now */
+    if (fstat(fd, &fd_st) < 0 || fd_st.st_dev != file_st.st_dev ||
+        fd_st.st_ino != file_st.st_ino)
+    {
+        error_setg(errp, QCOW2_OPT_L2_CACHE_SHARED ": '%s' is no longer the "
+                   "image file", file->filename);
+        qemu_close(fd);
+        return -1;
+    }
+
+    return fd;
+#else
+    error_setg(errp, QCOW2_OPT_L2_CACHE_SHARED " not supported on this host");
+    return -1;
+#endif
+}
+
+static void qcow2_l2_shared_fd_close(int fd)
+{
+    if (fd >= 0) {
+        qemu_close(fd);
+    }
+}
+
 typedef struct Qcow2ReopenState {
     Qcow2Cache *l2_table_cache;
     Qcow2Cache *refcount_block_cache;
+    int l2_shared_fd;
     int l2_slice_size; /* Number of entries in a slice of the L2 table */
     bool use_lazy_refcounts;
     int overlap_check;
@@ -985,6 +1048,8 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
     Error *local_err = NULL;
     int ret;
 
+    r->l2_shared_fd = -1;
+
     qdict_extract_subqdict(options, &encryptopts, "encrypt.");
     encryptfmt = qdict_get_try_str(encryptopts, "format");
 
@@ -1052,6 +1117,17 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    /* The shared fd is only used while the image cannot be written */
+    if (qemu_opt_get_bool(opts, QCOW2_OPT_L2_CACHE_SHARED, false) &&
+        !(flags & BDRV_O_RDWR))
+    {
+        r->l2_shared_fd = qcow2_l2_shared_fd_open(bs, errp);
+        if (r->l2_shared_fd < 0) {
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+
     /* New interval for cache cleanup timer */
     r->cache_clean_interval =
         qemu_opt_get_number(opts, QCOW2_OPT_CACHE_CLEAN_INTERVAL,
@@ -1207,6 +1283,10 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
     s->refcount_block_cache = r->refcount_block_cache;
     s->l2_slice_size = r->l2_slice_size;
 
+    qcow2_l2_shared_fd_close(s->l2_shared_fd);
+    s->l2_shared_fd = r->l2_shared_fd;
+    qcow2_cache_set_shared_fd(s->l2_table_cache, s->l2_shared_fd);
+
     s->overlap_check = r->overlap_check;
     s->use_lazy_refcounts = r->use_lazy_refcounts;
 
@@ -1233,6 +1313,7 @@ static void qcow2_update_options_abort(BlockDriverState *bs,
     if (r->refcount_block_cache) {
         qcow2_cache_destroy(r->refcount_block_cache);
     }
+    qcow2_l2_shared_fd_close(r->l2_shared_fd);
     qapi_free_QCryptoBlockOpenOptions(r->crypto_opts);
 }
 
@@ -1301,6 +1382,8 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
     uint64_t l1_vm_state_index;
     bool update_header = false;
 
+    s->l2_shared_fd = -1;
+
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
         error_setg_errno(errp, -ret, "Could not read qcow2 header");
@@ -1831,6 +1914,7 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
 #endif
 
     qemu_co_queue_init(&s->thread_task_queue);
+    s->max_compress_threads = MAX(QCOW2_MAX_THREADS, g_get_num_processors());
 
     return ret;
 
@@ -1854,6 +1938,8 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
     if (s->refcount_block_cache) {
         qcow2_cache_destroy(s->refcount_block_cache);
     }
+    qcow2_l2_shared_fd_close(s->l2_shared_fd);
+    s->l2_shared_fd = -1;
     qcrypto_block_free(s->crypto);
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     return ret;
@@ -2298,6 +2384,8 @@ static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
                             QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
         }
 
+        qcow2_co_preload_l2_slice(bs, offset);
+
         qemu_co_mutex_lock(&s->lock);
         ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
                                     &host_offset, &type);
@@ -2591,6 +2679,8 @@ static coroutine_fn int qcow2_co_pwritev_part(
                             - offset_in_cluster);
         }
 
+        qcow2_co_preload_l2_slice(bs, offset);
+
         qemu_co_mutex_lock(&s->lock);
 
         ret = qcow2_alloc_host_offset(bs, offset, &cur_bytes,
@@ -2695,6 +2785,8 @@ static void qcow2_close(BlockDriverState *bs)
     cache_clean_timer_del(bs);
     qcow2_cache_destroy(s->l2_table_cache);
     qcow2_cache_destroy(s->refcount_block_cache);
+    qcow2_l2_shared_fd_close(s->l2_shared_fd);
+    s->l2_shared_fd = -1;
 
     qcrypto_block_free(s->crypto);
     s->crypto = NULL;
@@ -4490,8 +4582,60 @@ fail:
     return ret;
 }
 
+/*
+ * The clusters of a compressed write request are compressed in parallel,
+ * but their host space is allocated in guest offset order, so that the
+ * image layout does not depend on which compression finishes first.
+ */
+typedef struct Qcow2CompressedWrite {
+    /* guest offset of the next cluster that may allocate host space */
+    uint64_t next_offset;
+    /* tasks waiting for their turn to allocate */
+    CoQueue queue;
+    /* set once a task fails, so that the tasks behind it give up */
+    int ret;
+} Qcow2CompressedWrite;
+
+typedef struct Qcow2CompressedTask {
+    AioTask task;
+
+    BlockDriverState *bs;
+    Qcow2CompressedWrite *cw;
+    uint64_t offset;
+    uint64_t bytes;
+    QEMUIOVector *qiov;
+    size_t qiov_offset;
+} Qcow2CompressedTask;
+
+/* Wait until all clusters before @offset have allocated host space */
+static coroutine_fn int
+qcow2_compressed_write_wait(Qcow2CompressedWrite *cw, uint64_t offset)
+{
+    while (cw->next_offset != offset && !cw->ret) {
+        qemu_co_queue_wait(&cw->queue, NULL);
+    }
+    return cw->ret;
+}
+
+/* Pass the turn to the cluster after @offset, or make all waiters fail */
+static void qcow2_compressed_write_done(Qcow2CompressedWrite *cw,
+                                        uint64_t offset, uint64_t bytes,
+                                        int ret)
+{
+    if (ret < 0) {
+        if (!cw->ret) {
+            cw->ret = ret;
+        }
+    } else {
+        assert(cw->next_offset == offset);
+        cw->next_offset = offset + bytes;
+    }
+    qemu_co_queue_restart_all(&cw->queue);
+}
+
 static coroutine_fn int
 qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
+                                 Qcow2CompressedWrite *cw,
                                  uint64_t offset, uint64_t bytes,
                                  QEMUIOVector *qiov, size_t qiov_offset)
 {
@@ -4515,16 +4659,25 @@ qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
 
     out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
                                 buf, s->cluster_size);
+    if (out_len < 0 && out_len != -ENOMEM) {
+        ret = -EINVAL;
+        qcow2_compressed_write_done(cw, offset, bytes, ret);
+        goto fail;
+    }
+
+    ret = qcow2_compressed_write_wait(cw, offset);
+    if (ret < 0) {
+        goto fail;
+    }
+
     if (out_len == -ENOMEM) {
         /* could not compress: write normal cluster */
         ret = qcow2_co_pwritev_part(bs, offset, bytes, qiov, qiov_offset, 0);
+        qcow2_compressed_write_done(cw, offset, bytes, ret);
         if (ret < 0) {
             goto fail;
         }
         goto success;
-    } else if (out_len < 0) {
-        ret = -EINVAL;
-        goto fail;
     }
 
     qemu_co_mutex_lock(&s->lock);
@@ -4532,11 +4685,13 @@ qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
                                                 &cluster_offset);
     if (ret < 0) {
         qemu_co_mutex_unlock(&s->lock);
+        qcow2_compressed_write_done(cw, offset, bytes, ret);
         goto fail;
     }
 
     ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len, true);
     qemu_co_mutex_unlock(&s->lock);
+    qcow2_compressed_write_done(cw, offset, bytes, ret);
     if (ret < 0) {
         goto fail;
     }
@@ -4556,12 +4711,10 @@ fail:
 
 static coroutine_fn int qcow2_co_pwritev_compressed_task_entry(AioTask *task)
 {
-    Qcow2AioTask *t = container_of(task, Qcow2AioTask, task);
-
-    assert(!t->subcluster_type && !t->l2meta);
+    Qcow2CompressedTask *t = container_of(task, Qcow2CompressedTask, task);
 
-    return qcow2_co_pwritev_compressed_task(t->bs, t->offset, t->bytes, t->qiov,
-                                            t->qiov_offset);
+    return qcow2_co_pwritev_compressed_task(t->bs, t->cw, t->offset, t->bytes,
+                                            t->qiov, t->qiov_offset);
 }
 
 /*
@@ -4575,6 +4728,7 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
 {
     BDRVQcow2State *s = bs->opaque;
     AioTaskPool *aio = NULL;
+    Qcow2CompressedWrite cw = { .next_offset = offset };
     int ret = 0;
 
     if (has_data_file(bs)) {
@@ -4603,17 +4757,37 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
         return -EINVAL;
     }
 
+    qemu_co_queue_init(&cw.queue);
+
     while (bytes && aio_task_pool_status(aio) == 0) {
         uint64_t chunk_size = MIN(bytes, s->cluster_size);
+        Qcow2CompressedTask local_task;
+        Qcow2CompressedTask *task;
 
         if (!aio && chunk_size != bytes) {
-            aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
-        }
+            /* keep enough clusters in flight for all compression threads */
+            aio = aio_task_pool_new(MAX(QCOW2_MAX_WORKERS,
+                                        s->max_compress_threads));
+        }
+
+        task = aio ? g_new(Qcow2CompressedTask, 1) : &local_task;
+        *task = (Qcow2CompressedTask) {
+            .task.func = qcow2_co_pwritev_compressed_task_entry,
+            .bs = bs,
+            .cw = &cw,
+            .offset = offset,
+            .bytes = chunk_size,
+            .qiov = qiov,
+            .qiov_offset = qiov_offset,
+        };
 
-        ret = qcow2_add_task(bs, aio, qcow2_co_pwritev_compressed_task_entry,
-                             0, 0, offset, chunk_size, qiov, qiov_offset, NULL);
-        if (ret < 0) {
-            break;
+        if (aio) {
+            aio_task_pool_start_task(aio, &task->task);
+        } else {
+            ret = task->task.func(&task->task);
+            if (ret < 0) {
+                break;
+            }
         }
         qiov_offset += chunk_size;
         offset += chunk_size;
@@ -5057,6 +5231,7 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     BDRVQcow2State *s = bs->opaque;
     bdi->cluster_size = s->cluster_size;
     bdi->vm_state_offset = qcow2_vm_state_offset(s);
+    bdi->ordered_compressed_writes = true;
     return 0;
 }
 
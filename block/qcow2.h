@@ -150,6 +150,7 @@
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_L2_CACHE_SHARED "l2-cache-shared"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -347,6 +348,8 @@ typedef struct BDRVQcow2State {
     Qcow2Cache *refcount_block_cache;
     QEMUTimer *cache_clean_timer;
     unsigned cache_clean_interval;
+    /* Buffered read-only fd of bs->file for L2 lookups, or -1 */
+    int l2_shared_fd;
 
     QLIST_HEAD(, QCowL2Meta) cluster_allocs;
 
@@ -408,6 +411,11 @@ typedef struct BDRVQcow2State {
 
     CoQueue thread_task_queue;
     int nb_threads;
+    /*
+     * Limit of nb_threads for compression and decompression, which scale
+     * with the number of host CPUs (encryption uses QCOW2_MAX_THREADS)
+     */
+    int max_compress_threads;
 
     BdrvChild *data_file;
 
@@ -904,6 +912,8 @@ int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index);
 int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
                           uint8_t *buf, int nb_sectors, bool enc, Error **errp);
 
+void coroutine_fn qcow2_co_preload_l2_slice(BlockDriverState *bs,
+                                             uint64_t offset);
 int qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
                           unsigned int *bytes, uint64_t *host_offset,
                           QCow2SubclusterType *subcluster_type);
@@ -955,6 +965,7 @@ int coroutine_fn qcow2_check_fix_snapshot_table(BlockDriverState *bs,
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
                                unsigned table_size);
 int qcow2_cache_destroy(Qcow2Cache *c);
+void qcow2_cache_set_shared_fd(Qcow2Cache *c, int fd);
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table);
 int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c);
@@ -970,6 +981,8 @@ int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
+void coroutine_fn qcow2_cache_preload(BlockDriverState *bs, Qcow2Cache *c,
+                                      uint64_t offset);
 void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
@@ -0,0 +1,607 @@
+/*
+ * readahead filter driver
+ *
+ * The driver detects sequential read streams and reads ahead of them in
+ * the background, so that each guest request does not have to wait for
+ * a round trip to a high-latency child such as nbd or curl.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+
+#include "qapi/error.h"
+#include "qapi/qapi-types-block-core.h"
+#include "qemu/coroutine.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "block/block_int.h"
+#include "trace.h"
+
+/* Number of sequential streams that are tracked at the same time */
+#define READAHEAD_STREAMS 4
+
+typedef struct ReadaheadOpts {
+    int64_t min_window;
+    int64_t max_window;
+} ReadaheadOpts;
+
+/*
+ * A range that is read ahead of a stream.  Guest requests that find it
+ * still in flight wait for it.  Windows are reference counted, because
+ * the stream may drop them while a prefetch or a waiting request still
+ * uses them.
+ */
+typedef struct ReadaheadWindow {
+    BlockDriverState *bs;
+    int refcnt;
+
+    uint64_t offset;
+    uint64_t bytes;
+    uint8_t *buf;
+
+    bool in_flight;
+    /* Set if the window overlaps a write that was issued after it */
+    bool stale;
+    int ret;
+    CoQueue waiters;
+} ReadaheadWindow;
+
+typedef struct ReadaheadStream {
+    /* Offset at which the next request of a sequential stream starts */
+    uint64_t next_offset;
+
+    /*
+     * Size of the next window.  0 until the stream turned out to be
+     * sequential, then doubled every time a window is used up.
+     */
+    uint64_t window_size;
+
+    /*
+     * @cur is the window the guest reads from.  @next immediately
+     * follows it and is read once the guest is halfway through @cur.
+     */
+    ReadaheadWindow *cur;
+    ReadaheadWindow *next;
+
+    /* For replacing the least recently used stream */
+    unsigned last_used;
+} ReadaheadStream;
+
+typedef struct BDRVReadaheadState {
+    ReadaheadOpts opts;
+
+    ReadaheadStream streams[READAHEAD_STREAMS];
+    unsigned clock;
+
+    /* Requests that were and were not served from read-ahead data */
+    uint64_t hits;
+    uint64_t misses;
+} BDRVReadaheadState;
+
+#define READAHEAD_OPT_MIN_WINDOW "min-window"
+#define READAHEAD_OPT_MAX_WINDOW "max-window"
+static QemuOptsList runtime_opts = {
+    .name = "readahead",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = READAHEAD_OPT_MIN_WINDOW,
+            .type = QEMU_OPT_SIZE,
+            .help = "initial read-ahead window of a stream, default 128K",
+        },
+        {
+            .name = READAHEAD_OPT_MAX_WINDOW,
+            .type = QEMU_OPT_SIZE,
+            .help = "maximum read-ahead window of a stream, default 4M",
+        },
+        { /* end of list */ }
+    },
+};
+
+static bool readahead_absorb_opts(ReadaheadOpts *dest, QDict *options,
+                                  Error **errp)
+{
+    QemuOpts *opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        qemu_opts_del(opts);
+        return false;
+    }
+
+    dest->min_window =
+        qemu_opt_get_size(opts, READAHEAD_OPT_MIN_WINDOW, 128 * KiB);
+    dest->max_window =
+        qemu_opt_get_size(opts, READAHEAD_OPT_MAX_WINDOW, 4 * MiB);
+
+    qemu_opts_del(opts);
+
+    if (dest->min_window == 0 || dest->min_window > dest->max_window ||
+        dest->max_window > BDRV_REQUEST_MAX_BYTES)
+    {
+        error_setg(errp, "readahead filter requires "
+                   "0 < min-window <= max-window <= %" PRId64,
+                   (int64_t)BDRV_REQUEST_MAX_BYTES);
+        return false;
+    }
+
+    return true;
+}
+
+static int readahead_open(BlockDriverState *bs, QDict *options, int flags,
+                          Error **errp)
+{
+    BDRVReadaheadState *s = bs->opaque;
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_of_bds,
+                               BDRV_CHILD_FILTERED | BDRV_CHILD_PRIMARY,
+                               false, errp);
+    if (!bs->file) {
+        return -EINVAL;
+    }
+
+    if (!readahead_absorb_opts(&s->opts, options, errp)) {
+        return -EINVAL;
+    }
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    return 0;
+}
+
+static void readahead_window_unref(ReadaheadWindow *w)
+{
+    if (w && --w->refcnt == 0) {
+        qemu_vfree(w->buf);
+        g_free(w);
+    }
+}
+
+static void readahead_stream_reset(ReadaheadStream *stream)
+{
+    readahead_window_unref(stream->cur);
+    readahead_window_unref(stream->next);
+    stream->cur = stream->next = NULL;
+    stream->window_size = 0;
+}
+
+static void readahead_close(BlockDriverState *bs)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < READAHEAD_STREAMS; i++) {
+        readahead_stream_reset(&s->streams[i]);
+    }
+}
+
+static int readahead_reopen_prepare(BDRVReopenState *reopen_state,
+                                    BlockReopenQueue *queue, Error **errp)
+{
+    ReadaheadOpts *opts = g_new0(ReadaheadOpts, 1);
+
+    if (!readahead_absorb_opts(opts, reopen_state->options, errp)) {
+        g_free(opts);
+        return -EINVAL;
+    }
+
+    reopen_state->opaque = opts;
+
+    return 0;
+}
+
+static void readahead_reopen_commit(BDRVReopenState *state)
+{
+    BDRVReadaheadState *s = state->bs->opaque;
+
+    s->opts = *(ReadaheadOpts *)state->opaque;
+
+    g_free(state->opaque);
+    state->opaque = NULL;
+}
+
+static void readahead_reopen_abort(BDRVReopenState *state)
+{
+    g_free(state->opaque);
+    state->opaque = NULL;
+}
+
+static void coroutine_fn readahead_prefetch_entry(void *opaque)
+{
+    ReadaheadWindow *w = opaque;
+    BlockDriverState *bs = w->bs;
+
+    w->ret = bdrv_co_pread(bs->file, w->offset, w->bytes, w->buf, 0);
+    trace_readahead_prefetch_done(bs, w->offset, w->bytes, w->ret);
+
+    w->in_flight = false;
+    qemu_co_queue_restart_all(&w->waiters);
+    readahead_window_unref(w);
+    bdrv_dec_in_flight(bs);
+}
+
+/* Start reading @bytes at @offset in the background */
+static ReadaheadWindow *readahead_prefetch(BlockDriverState *bs,
+                                           uint64_t offset, uint64_t bytes)
+{
+    ReadaheadWindow *w;
+    Coroutine *co;
+    int64_t len;
+    uint8_t *buf;
+
+    len = bdrv_getlength(bs->file->bs);
+    if (len < 0 || offset >= len) {
+        return NULL;
+    }
+    bytes = MIN(bytes, len - offset);
+
+    buf = qemu_try_blockalign(bs->file->bs, bytes);
+    if (!buf) {
+        return NULL;
+    }
+
+    w = g_new(ReadaheadWindow, 1);
+    *w = (ReadaheadWindow) {
+        .bs = bs,
+        /* One reference for the stream, one for the prefetch */
+        .refcnt = 2,
+        .offset = offset,
+        .bytes = bytes,
+        .buf = buf,
+        .in_flight = true,
+    };
+    qemu_co_queue_init(&w->waiters);
+
+    trace_readahead_prefetch(bs, offset, bytes);
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(readahead_prefetch_entry, w);
+    aio_co_enter(bdrv_get_aio_context(bs), co);
+
+    return w;
+}
+
+static uint64_t readahead_window_end(ReadaheadWindow *w)
+{
+    return w->offset + w->bytes;
+}
+
+/*
+ * Find the stream that a request at @offset continues, or replace the
+ * least recently used one.  Returns whether the request continues the
+ * stream.
+ */
+static bool readahead_find_stream(BDRVReadaheadState *s, uint64_t offset,
+                                  ReadaheadStream **pstream)
+{
+    ReadaheadStream *stream, *lru = &s->streams[0];
+    int i;
+
+    for (i = 0; i < READAHEAD_STREAMS; i++) {
+        stream = &s->streams[i];
+        if (stream->last_used &&
+            (offset == stream->next_offset ||
+             (stream->cur && offset >= stream->cur->offset &&
+              offset < readahead_window_end(stream->next ?: stream->cur))))
+        {
+            *pstream = stream;
+            return true;
+        }
+        if (stream->last_used < lru->last_used) {
+            lru = stream;
+        }
+    }
+
+    readahead_stream_reset(lru);
+    *pstream = lru;
+    return false;
+}
+
+/*
+ * Copy the part of @w that overlaps the request to @qiov, waiting for @w
+ * to be read first if necessary.  Returns false if the data in @w cannot
+ * be used.
+ */
+static bool coroutine_fn readahead_copy(ReadaheadWindow *w, uint64_t offset,
+                                        uint64_t bytes, QEMUIOVector *qiov,
+                                        size_t qiov_offset)
+{
+    uint64_t start = MAX(offset, w->offset);
+    uint64_t end = MIN(offset + bytes, readahead_window_end(w));
+    bool ok;
+
+    if (start >= end) {
+        return true;
+    }
+
+    w->refcnt++;
+    while (w->in_flight) {
+        qemu_co_queue_wait(&w->waiters, NULL);
+    }
+
+    ok = w->ret >= 0 && !w->stale;
+    if (ok) {
+        qemu_iovec_from_buf(qiov, qiov_offset + (start - offset),
+                            w->buf + (start - w->offset), end - start);
+    }
+    readahead_window_unref(w);
+
+    return ok;
+}
+
+/* Try to serve the request from the windows of @stream */
+static bool coroutine_fn readahead_read(ReadaheadStream *stream,
+                                        uint64_t offset, uint64_t bytes,
+                                        QEMUIOVector *qiov, size_t qiov_offset)
+{
+    ReadaheadWindow *cur = stream->cur;
+    ReadaheadWindow *next = stream->next;
+
+    if (!cur || offset < cur->offset ||
+        offset + bytes > readahead_window_end(next ?: cur))
+    {
+        return false;
+    }
+
+    /* Hold references so that the stream can be reset while we wait */
+    cur->refcnt++;
+    if (next) {
+        next->refcnt++;
+    }
+
+    if (!readahead_copy(cur, offset, bytes, qiov, qiov_offset) ||
+        (next && !readahead_copy(next, offset, bytes, qiov, qiov_offset)))
+    {
+        readahead_window_unref(cur);
+        readahead_window_unref(next);
+        return false;
+    }
+
+    readahead_window_unref(cur);
+    readahead_window_unref(next);
+    return true;
+}
+
+/* Move the windows of @stream along after the guest read up to @pos */
+static void readahead_advance(BlockDriverState *bs, ReadaheadStream *stream,
+                              uint64_t pos)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    ReadaheadWindow *cur = stream->cur;
+
+    if (!cur) {
+        return;
+    }
+
+    if (stream->next && pos >= stream->next->offset) {
+        /* The guest keeps up with us, so read further ahead */
+        readahead_window_unref(cur);
+        cur = stream->cur = stream->next;
+        stream->next = NULL;
+        stream->window_size = MIN(stream->window_size * 2, s->opts.max_window);
+    }
+
+    if (!stream->next && pos >= cur->offset + cur->bytes / 2) {
+        stream->next = readahead_prefetch(bs, readahead_window_end(cur),
+                                          stream->window_size);
+    }
+}
+
+static int coroutine_fn readahead_co_preadv_part(BlockDriverState *bs,
+                                                 uint64_t offset,
+                                                 uint64_t bytes,
+                                                 QEMUIOVector *qiov,
+                                                 size_t qiov_offset,
+                                                 int flags)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    ReadaheadStream *stream;
+    bool sequential;
+
+    sequential = readahead_find_stream(s, offset, &stream);
+    stream->last_used = ++s->clock;
+
+    if (readahead_read(stream, offset, bytes, qiov, qiov_offset)) {
+        s->hits++;
+        stream->next_offset = offset + bytes;
+        readahead_advance(bs, stream, offset + bytes);
+        return 0;
+    }
+
+    s->misses++;
+    if (sequential && offset == stream->next_offset) {
+        /*
+         * The stream is sequential, but either it was just detected or
+         * the guest got ahead of the windows.  Start over behind this
+         * request with at least the minimum window.
+         */
+        uint64_t window = MAX(stream->window_size, s->opts.min_window);
+
+        readahead_stream_reset(stream);
+        stream->window_size = window;
+        stream->cur = readahead_prefetch(bs, offset + bytes, window);
+    } else {
+        readahead_stream_reset(stream);
+    }
+    stream->next_offset = offset + bytes;
+
+    return bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset,
+                               flags);
+}
+
+/*
+ * Drop all windows that overlap [@offset, @offset + @bytes).  Called both
+ * before and after a write, because windows that are read while the write
+ * is in flight may or may not contain the new data.
+ */
+static void readahead_invalidate(BlockDriverState *bs, uint64_t offset,
+                                 uint64_t bytes)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < READAHEAD_STREAMS; i++) {
+        ReadaheadStream *stream = &s->streams[i];
+        ReadaheadWindow *windows[] = { stream->cur, stream->next };
+        bool overlap = false;
+        int j;
+
+        for (j = 0; j < ARRAY_SIZE(windows); j++) {
+            ReadaheadWindow *w = windows[j];
+
+            if (w && offset < readahead_window_end(w) &&
+                w->offset < offset + bytes)
+            {
+                /* Requests that wait for it must not use it either */
+                w->stale = true;
+                overlap = true;
+            }
+        }
+
+        if (overlap) {
+            readahead_stream_reset(stream);
+        }
+    }
+}
+
+static int coroutine_fn readahead_co_pwritev_part(BlockDriverState *bs,
+                                                  uint64_t offset,
+                                                  uint64_t bytes,
+                                                  QEMUIOVector *qiov,
+                                                  size_t qiov_offset,
+                                                  int flags)
+{
+    int ret;
+
+    readahead_invalidate(bs, offset, bytes);
+    ret = bdrv_co_pwritev_part(bs->file, offset, bytes, qiov, qiov_offset,
+                               flags);
+    readahead_invalidate(bs, offset, bytes);
+
+    return ret;
+}
+
+static int coroutine_fn readahead_co_pwrite_zeroes(BlockDriverState *bs,
+                                                   int64_t offset, int bytes,
+                                                   BdrvRequestFlags flags)
+{
+    int ret;
+
+    readahead_invalidate(bs, offset, bytes);
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    readahead_invalidate(bs, offset, bytes);
+
+    return ret;
+}
+
+static int coroutine_fn readahead_co_pdiscard(BlockDriverState *bs,
+                                              int64_t offset, int bytes)
+{
+    int ret;
+
+    readahead_invalidate(bs, offset, bytes);
+    ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+    readahead_invalidate(bs, offset, bytes);
+
+    return ret;
+}
+
+static int coroutine_fn
+readahead_co_truncate(BlockDriverState *bs, int64_t offset,
+                      bool exact, PreallocMode prealloc,
+                      BdrvRequestFlags flags, Error **errp)
+{
+    int ret;
+
+    readahead_invalidate(bs, 0, INT64_MAX);
+    ret = bdrv_co_truncate(bs->file, offset, exact, prealloc, flags, errp);
+    readahead_invalidate(bs, 0, INT64_MAX);
+
+    return ret;
+}
+
+static int coroutine_fn readahead_co_flush(BlockDriverState *bs)
+{
+    return bdrv_co_flush(bs->file->bs);
+}
+
+static int64_t readahead_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static void readahead_child_perm(BlockDriverState *bs, BdrvChild *c,
+    BdrvChildRole role, BlockReopenQueue *reopen_queue,
+    uint64_t perm, uint64_t shared, uint64_t *nperm, uint64_t *nshared)
+{
+    bdrv_default_perms(bs, c, role, reopen_queue, perm, shared, nperm, nshared);
+
+    /*
+     * Writes that bypass the filter would not invalidate the windows, so
+     * don't share.
+     */
+    *nshared &= ~BLK_PERM_WRITE;
+}
+
+static BlockStatsSpecific *readahead_get_specific_stats(BlockDriverState *bs)
+{
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+    BDRVReadaheadState *s = bs->opaque;
+
+    stats->driver = BLOCKDEV_DRIVER_READAHEAD;
+    stats->u.readahead = (BlockStatsSpecificReadahead) {
+        .hits = s->hits,
+        .misses = s->misses,
+    };
+
+    return stats;
+}
+
+BlockDriver bdrv_readahead_filter = {
+    .format_name = "readahead",
+    .instance_size = sizeof(BDRVReadaheadState),
+
+    .bdrv_getlength = readahead_getlength,
+    .bdrv_open = readahead_open,
+    .bdrv_close = readahead_close,
+
+    .bdrv_reopen_prepare  = readahead_reopen_prepare,
+    .bdrv_reopen_commit   = readahead_reopen_commit,
+    .bdrv_reopen_abort    = readahead_reopen_abort,
+
+    .bdrv_co_preadv_part = readahead_co_preadv_part,
+    .bdrv_co_pwritev_part = readahead_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes = readahead_co_pwrite_zeroes,
+    .bdrv_co_pdiscard = readahead_co_pdiscard,
+    .bdrv_co_flush = readahead_co_flush,
+    .bdrv_co_truncate = readahead_co_truncate,
+
+    .bdrv_child_perm = readahead_child_perm,
+    .bdrv_get_specific_stats = readahead_get_specific_stats,
+
+    .has_variable_length = true,
+    .is_filter = true,
+};
+
+static void bdrv_readahead_init(void)
+{
+    bdrv_register(&bdrv_readahead_filter);
+}
+
+block_init(bdrv_readahead_init);
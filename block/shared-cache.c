@@ -0,0 +1,648 @@
+/*
+ * Shared cache filter block driver
+ *
+ * Keeps clusters read from a read-only node in a memory-mapped cache file
+ * that all QEMU processes on the host can map, so that many VMs started
+ * from the same base image only read each cluster from storage once.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+
+#include "qapi/error.h"
+#include "qemu/cutils.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/seqlock.h"
+#include "qemu/units.h"
+#include "qemu/xxhash.h"
+#include "crypto/hash.h"
+#include "block/block_int.h"
+#include "trace.h"
+
+#define SHARED_CACHE_MAGIC 0x51534843u /* "QSHC" */
+
+/* Number of slots a cluster can be stored in */
+#define SHARED_CACHE_WAYS 4
+
+/* Maximum number of bytes read from the child at once on a miss */
+#define SHARED_CACHE_MAX_READ (1 * MiB)
+
+/*
+ * The cache file starts with a SharedCacheHeader, followed by the
+ * SharedCacheSlots and, at the next cluster boundary, the data of each
+ * slot.  All fields are zero in a new file, which is an empty cache.
+ *
+ * Only the writer, a trusted process opened with writer=on, maps the
+ * file writable and fills it; every other process maps it read-only, so
+ * a compromised QEMU cannot change the data that other QEMUs read.  Each
+ * slot is protected by a seqlock: the writer takes a slot by making the
+ * sequence odd with a cmpxchg, and readers that see the sequence change
+ * while they copy the data treat the slot as a miss.  If the writer dies
+ * while filling a slot, the slot stays unused until the cache file is
+ * recreated.
+ */
+typedef struct SharedCacheHeader {
+    uint32_t magic;
+    uint32_t cluster_bits;
+    uint32_t nb_slots;
+    uint32_t reserved;
+} SharedCacheHeader;
+
+typedef struct SharedCacheSlot {
+    QemuSeqLock lock;
+    uint32_t reserved;
+    /* Image the cluster belongs to, 0 for an empty slot */
+    uint64_t image;
+    /* Offset of the cluster in the image */
+    uint64_t offset;
+    uint64_t reserved2;
+} SharedCacheSlot;
+
+QEMU_BUILD_BUG_ON(sizeof(SharedCacheSlot) != 32);
+
+typedef struct BDRVSharedCacheState {
+    uint8_t *mapping;
+    size_t mapping_size;
+
+    SharedCacheSlot *slots;
+    uint8_t *data;
+    uint32_t nb_sets;
+    uint64_t cluster_size;
+
+    /* Identifies the image in the cache, derived from image-id */
+    uint64_t image;
+    /* Length of the child, which cannot change as it is not writable */
+    int64_t length;
+    /* Picks the slot to evict when a set is full */
+    unsigned victim;
+    /* Whether this process fills the cache, or only reads from it */
+    bool writer;
+} BDRVSharedCacheState;
+
+#define SHARED_CACHE_OPT_PATH "path"
+#define SHARED_CACHE_OPT_SIZE "size"
+#define SHARED_CACHE_OPT_CLUSTER_SIZE "cluster-size"
+#define SHARED_CACHE_OPT_IMAGE_ID "image-id"
+#define SHARED_CACHE_OPT_WRITER "writer"
+static QemuOptsList runtime_opts = {
+    .name = "shared-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = SHARED_CACHE_OPT_PATH,
+            .type = QEMU_OPT_STRING,
+            .help = "cache file shared between processes, e.g. on a tmpfs",
+        },
+        {
+            .name = SHARED_CACHE_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the cached data, default 1G",
+        },
+        {
+            .name = SHARED_CACHE_OPT_CLUSTER_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "unit in which data is cached, default 64k",
+        },
+        {
+            .name = SHARED_CACHE_OPT_IMAGE_ID,
+            .type = QEMU_OPT_STRING,
+            .help = "identifies the image in the cache together with the "
+                    "local files it is stored in",
+        },
+        {
+            .name = SHARED_CACHE_OPT_WRITER,
+            .type = QEMU_OPT_BOOL,
+            .help = "create and fill the cache file instead of only "
+                    "reading from it",
+        },
+        { /* end of list */ }
+    },
+};
+
+/*
+ * Append the identity of every local file below @bs to @key: the device,
+ * inode, size and modification and change times of the open file.  A
+ * replaced or modified file therefore gets a different key.  Returns
+ * false if some of the data below @bs is not stored in a local file.
+ */
+static bool shared_cache_identify_files(BlockDriverState *bs, GString *key)
+{
+    BdrvChild *child;
+    struct stat st;
+    long mtime_nsec = 0, ctime_nsec = 0;
+    bool complete = true;
+
+    if (bdrv_fstat(bs, &st) == 0) {
+#ifdef CONFIG_LINUX
+        mtime_nsec = st.st_mtim.tv_nsec;
+        ctime_nsec = st.st_ctim.tv_nsec;
+#endif
+        g_string_append_printf(key, ":%" PRIu64 ",%" PRIu64 ",%" PRId64
+                               ",%" PRId64 ".%ld,%" PRId64 ".%ld",
+                               (uint64_t)st.st_dev, (uint64_t)st.st_ino,
+                               (int64_t)st.st_size,
+                               (int64_t)st.st_mtime, mtime_nsec,
+                               (int64_t)st.st_ctime, ctime_nsec);
+        return true;
+    }
+
+    if (QLIST_EMPTY(&bs->children)) {
+        return false;
+    }
+    QLIST_FOREACH(child, &bs->children, next) {
+        complete &= shared_cache_identify_files(child->bs, key);
+    }
+    return complete;
+}
+
+static int shared_cache_hash_image(BDRVSharedCacheState *s,
+                                   BlockDriverState *child, const char *id,
+                                   Error **errp)
+{
+    g_autoptr(GString) key = g_string_new(id ?: "");
+    g_autofree uint8_t *digest = NULL;
+    size_t digest_len;
+
+    /*
+     * The length and the identity of the files are part of the key, so
+     * that a replaced or modified image does not find stale data.  The
+     * file name alone is not trusted; data that is not in local files can
+     * only be identified by an image-id given by the user.
+     */
+    g_string_append_printf(key, ":%" PRId64, s->length);
+    if (!shared_cache_identify_files(child, key) && !id) {
+        error_setg(errp, "shared-cache requires an image-id for children "
+                   "that are not stored in local files");
+        return -EINVAL;
+    }
+
+    if (qcrypto_hash_bytes(QCRYPTO_HASH_ALG_SHA256, key->str, key->len,
+                           &digest, &digest_len, errp) < 0) {
+        return -EINVAL;
+    }
+
+    s->image = ldq_be_p(digest) ?: 1;
+    return 0;
+}
+
+static int shared_cache_map(BDRVSharedCacheState *s, const char *path,
+                            uint64_t size, Error **errp)
+{
+    SharedCacheHeader *header;
+    uint32_t cluster_bits = ctz64(s->cluster_size);
+    uint32_t nb_slots;
+    uint64_t slots_size, total;
+    struct stat st;
+    uint32_t old;
+    int fd, ret;
+
+    if (size / s->cluster_size < SHARED_CACHE_WAYS ||
+        size / s->cluster_size > UINT32_MAX) {
+        error_setg(errp, "Invalid shared-cache size %" PRIu64, size);
+        return -EINVAL;
+    }
+    nb_slots = QEMU_ALIGN_DOWN(size / s->cluster_size, SHARED_CACHE_WAYS);
+
+    slots_size = QEMU_ALIGN_UP(sizeof(*header) +
+                               nb_slots * sizeof(SharedCacheSlot),
+                               s->cluster_size);
+    total = slots_size + (uint64_t)nb_slots * s->cluster_size;
+    if (total > SIZE_MAX) {
+        error_setg(errp, "shared-cache size is too large for this host");
+        return -EINVAL;
+    }
+
+    if (s->writer) {
+        fd = qemu_create(path, O_RDWR, 0600, errp);
+    } else {
+        fd = qemu_open(path, O_RDONLY, errp);
+    }
+    if (fd < 0) {
+        return -EINVAL;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not stat '%s'", path);
+        goto out;
+    }
+    if (st.st_size < total) {
+        /* Growing the file from another writer at the same time is harmless */
+        if (!s->writer) {
+            error_setg(errp, "'%s' has not been set up by a shared-cache "
+                       "writer with this size", path);
+            ret = -EINVAL;
+            goto out;
+        }
+        if (ftruncate(fd, total) < 0) {
+            ret = -errno;
+            error_setg_errno(errp, errno, "Could not resize '%s'", path);
+            goto out;
+        }
+    }
+
+    s->mapping = mmap(NULL, total,
+                      s->writer ? PROT_READ | PROT_WRITE : PROT_READ,
+                      MAP_SHARED, fd, 0);
+    if (s->mapping == MAP_FAILED) {
+        s->mapping = NULL;
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not map '%s'", path);
+        goto out;
+    }
+    s->mapping_size = total;
+
+    /*
+     * The writer sets the geometry when it creates the file.  All other
+     * users must use the same one.
+     */
+    header = (SharedCacheHeader *)s->mapping;
+    if (s->writer) {
+        qatomic_cmpxchg(&header->magic, 0, SHARED_CACHE_MAGIC);
+        qatomic_cmpxchg(&header->cluster_bits, 0, cluster_bits);
+        qatomic_cmpxchg(&header->nb_slots, 0, nb_slots);
+    }
+
+    old = qatomic_read(&header->magic);
+    if (old != SHARED_CACHE_MAGIC) {
+        error_setg(errp, "'%s' is not a shared-cache file", path);
+        ret = -EINVAL;
+        goto out;
+    }
+    old = qatomic_read(&header->cluster_bits);
+    if (old != cluster_bits) {
+        error_setg(errp, "'%s' was created with cluster-size %" PRIu64,
+                   path, (uint64_t)1 << old);
+        ret = -EINVAL;
+        goto out;
+    }
+    old = qatomic_read(&header->nb_slots);
+    if (old != nb_slots) {
+        error_setg(errp, "'%s' was created with size %" PRIu64,
+                   path, (uint64_t)old * s->cluster_size);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    s->slots = (SharedCacheSlot *)(s->mapping + sizeof(*header));
+    s->data = s->mapping + slots_size;
+    s->nb_sets = nb_slots / SHARED_CACHE_WAYS;
+    ret = 0;
+
+out:
+    qemu_close(fd);
+    return ret;
+}
+
+static void shared_cache_unmap(BDRVSharedCacheState *s)
+{
+    if (s->mapping) {
+        munmap(s->mapping, s->mapping_size);
+        s->mapping = NULL;
+    }
+}
+
+static int shared_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                             Error **errp)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    const char *path, *id;
+    uint64_t size;
+    int ret;
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_of_bds,
+                               BDRV_CHILD_FILTERED | BDRV_CHILD_PRIMARY,
+                               false, errp);
+    if (!bs->file) {
+        return -EINVAL;
+    }
+
+    ret = bdrv_apply_auto_read_only(bs, "The shared-cache filter only "
+                                    "supports read-only nodes", errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    path = qemu_opt_get(opts, SHARED_CACHE_OPT_PATH);
+    if (!path) {
+        error_setg(errp, "shared-cache requires a path");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    s->cluster_size = qemu_opt_get_size(opts, SHARED_CACHE_OPT_CLUSTER_SIZE,
+                                        64 * KiB);
+    if (!is_power_of_2(s->cluster_size) ||
+        s->cluster_size < bs->file->bs->bl.request_alignment ||
+        s->cluster_size > SHARED_CACHE_MAX_READ)
+    {
+        error_setg(errp, "shared-cache cluster-size must be a power of two "
+                   "between the request alignment of the child and 1M");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    s->length = bdrv_getlength(bs->file->bs);
+    if (s->length < 0) {
+        error_setg_errno(errp, -s->length, "Could not get the image length");
+        ret = s->length;
+        goto out;
+    }
+
+    id = qemu_opt_get(opts, SHARED_CACHE_OPT_IMAGE_ID);
+    ret = shared_cache_hash_image(s, bs->file->bs, id, errp);
+    if (ret < 0) {
+        goto out;
+    }
+
+    s->writer = qemu_opt_get_bool(opts, SHARED_CACHE_OPT_WRITER, false);
+    size = qemu_opt_get_size(opts, SHARED_CACHE_OPT_SIZE, 1 * GiB);
+    ret = shared_cache_map(s, path, size, errp);
+    if (ret < 0) {
+        shared_cache_unmap(s);
+        goto out;
+    }
+
+    bs->supported_read_flags = BDRV_REQ_PREFETCH;
+
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void shared_cache_close(BlockDriverState *bs)
+{
+    shared_cache_unmap(bs->opaque);
+}
+
+static int shared_cache_reopen_prepare(BDRVReopenState *reopen_state,
+                                       BlockReopenQueue *queue, Error **errp)
+{
+    if (reopen_state->flags & BDRV_O_RDWR) {
+        error_setg(errp, "The shared-cache filter only supports read-only "
+                   "nodes");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static void shared_cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                    BdrvChildRole role,
+                                    BlockReopenQueue *reopen_queue,
+                                    uint64_t perm, uint64_t shared,
+                                    uint64_t *nperm, uint64_t *nshared)
+{
+    bdrv_default_perms(bs, c, role, reopen_queue, perm, shared, nperm, nshared);
+
+    /* Cached data stays valid only as long as nobody can change the child */
+    *nshared &= ~(BLK_PERM_WRITE | BLK_PERM_RESIZE);
+}
+
+static int64_t shared_cache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static SharedCacheSlot *shared_cache_set(BDRVSharedCacheState *s,
+                                         uint64_t offset)
+{
+    uint32_t set = qemu_xxhash4(s->image, offset) % s->nb_sets;
+
+    return &s->slots[set * SHARED_CACHE_WAYS];
+}
+
+static uint8_t *shared_cache_slot_data(BDRVSharedCacheState *s,
+                                       SharedCacheSlot *slot)
+{
+    return s->data + (slot - s->slots) * s->cluster_size;
+}
+
+static bool shared_cache_contains(BDRVSharedCacheState *s, uint64_t offset)
+{
+    SharedCacheSlot *slot = shared_cache_set(s, offset);
+    int i;
+
+    for (i = 0; i < SHARED_CACHE_WAYS; i++, slot++) {
+        if (slot->image == s->image && slot->offset == offset) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Copy @bytes at @offset_in_cluster of the cluster at @offset to @qiov.
+ * On a miss, @qiov may have been partially overwritten.
+ */
+static bool shared_cache_lookup(BDRVSharedCacheState *s, uint64_t offset,
+                                uint64_t offset_in_cluster, uint64_t bytes,
+                                QEMUIOVector *qiov, size_t qiov_offset)
+{
+    SharedCacheSlot *slot = shared_cache_set(s, offset);
+    unsigned seq;
+    int i;
+
+    for (i = 0; i < SHARED_CACHE_WAYS; i++, slot++) {
+        seq = seqlock_read_begin(&slot->lock);
+        if (slot->image != s->image || slot->offset != offset) {
+            continue;
+        }
+
+        qemu_iovec_from_buf(qiov, qiov_offset,
+                            shared_cache_slot_data(s, slot) + offset_in_cluster,
+                            bytes);
+        return !seqlock_read_retry(&slot->lock, seq);
+    }
+    return false;
+}
+
+static void shared_cache_insert(BDRVSharedCacheState *s, uint64_t offset,
+                                const uint8_t *buf)
+{
+    SharedCacheSlot *set = shared_cache_set(s, offset);
+    SharedCacheSlot *slot = NULL;
+    unsigned seq;
+    int i;
+
+    for (i = 0; i < SHARED_CACHE_WAYS; i++) {
+        if (set[i].image == s->image && set[i].offset == offset) {
+            /* Another process got there first */
+            return;
+        }
+        if (!slot && !set[i].image) {
+            slot = &set[i];
+        }
+    }
+    if (!slot) {
+        slot = &set[s->victim++ % SHARED_CACHE_WAYS];
+    }
+
+    seq = qatomic_read(&slot->lock.sequence);
+    if ((seq & 1) ||
+        qatomic_cmpxchg(&slot->lock.sequence, seq, seq + 1) != seq)
+    {
+        /* Somebody else is filling the slot right now */
+        return;
+    }
+
+    slot->image = s->image;
+    slot->offset = offset;
+    memcpy(shared_cache_slot_data(s, slot), buf, s->cluster_size);
+    seqlock_write_end(&slot->lock);
+}
+
+/*
+ * Read the clusters in [@offset, @offset + @bytes) from the child, add
+ * them to the cache, and copy the part of them that was requested, which
+ * starts at @offset + @skip and ends at @offset + @bytes - @tail, to @qiov.
+ */
+static int coroutine_fn shared_cache_fill(BlockDriverState *bs,
+                                          uint64_t offset, uint64_t bytes,
+                                          uint64_t skip, uint64_t tail,
+                                          QEMUIOVector *qiov,
+                                          size_t qiov_offset)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    uint8_t *buf;
+    uint64_t pos;
+    int ret;
+
+    buf = qemu_try_blockalign(bs->file->bs, bytes);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    ret = bdrv_co_pread(bs->file, offset, bytes, buf, 0);
+    if (ret < 0) {
+        goto out;
+    }
+
+    for (pos = 0; pos < bytes; pos += s->cluster_size) {
+        shared_cache_insert(s, offset + pos, buf + pos);
+    }
+    if (qiov) {
+        qemu_iovec_from_buf(qiov, qiov_offset, buf + skip, bytes - skip - tail);
+    }
+
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
+static int coroutine_fn shared_cache_co_preadv_part(BlockDriverState *bs,
+                                                    uint64_t offset,
+                                                    uint64_t bytes,
+                                                    QEMUIOVector *qiov,
+                                                    size_t qiov_offset,
+                                                    int flags)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    uint64_t end = offset + bytes;
+    bool prefetch = flags & BDRV_REQ_PREFETCH;
+    int ret;
+
+    while (offset < end) {
+        uint64_t cluster = QEMU_ALIGN_DOWN(offset, s->cluster_size);
+        uint64_t run_end = cluster + s->cluster_size;
+        uint64_t n = MIN(end, run_end) - offset;
+
+        /* A partial cluster at the end of the image is not cached */
+        if (run_end > s->length) {
+            if (prefetch) {
+                break;
+            }
+            return bdrv_co_preadv_part(bs->file, offset, end - offset, qiov,
+                                       qiov_offset, flags);
+        }
+
+        if (prefetch ? shared_cache_contains(s, cluster) :
+            shared_cache_lookup(s, cluster, offset - cluster, n, qiov,
+                                qiov_offset))
+        {
+            trace_shared_cache_hit(bs, cluster);
+            offset += n;
+            qiov_offset += n;
+            continue;
+        }
+
+        /* Read all consecutive missing clusters at once */
+        while (run_end < end && run_end + s->cluster_size <= s->length &&
+               run_end - cluster < SHARED_CACHE_MAX_READ &&
+               !shared_cache_contains(s, run_end))
+        {
+            run_end += s->cluster_size;
+        }
+        n = MIN(end, run_end) - offset;
+
+        trace_shared_cache_miss(bs, cluster, run_end - cluster);
+        if (s->writer) {
+            ret = shared_cache_fill(bs, cluster, run_end - cluster,
+                                    offset - cluster, run_end - offset - n,
+                                    prefetch ? NULL : qiov, qiov_offset);
+        } else if (!prefetch) {
+            /* Only the writer may add the clusters to the cache */
+            ret = bdrv_co_preadv_part(bs->file, offset, n, qiov,
+                                      qiov_offset, flags);
+        } else {
+            ret = 0;
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        offset += n;
+        qiov_offset += n;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn shared_cache_co_flush(BlockDriverState *bs)
+{
+    return bdrv_co_flush(bs->file->bs);
+}
+
+static BlockDriver bdrv_shared_cache = {
+    .format_name                        = "shared-cache",
+    .instance_size                      = sizeof(BDRVSharedCacheState),
+
+    .bdrv_open                          = shared_cache_open,
+    .bdrv_close                         = shared_cache_close,
+    .bdrv_reopen_prepare                = shared_cache_reopen_prepare,
+    .bdrv_child_perm                    = shared_cache_child_perm,
+
+    .bdrv_getlength                     = shared_cache_getlength,
+
+    .bdrv_co_preadv_part                = shared_cache_co_preadv_part,
+    .bdrv_co_flush                      = shared_cache_co_flush,
+
+    .is_filter                          = true,
+};
+
+static void bdrv_shared_cache_init(void)
+{
+    bdrv_register(&bdrv_shared_cache);
+}
+
+block_init(bdrv_shared_cache_init);
@@ -0,0 +1,712 @@
+/*
+ * writeback-cache filter driver
+ *
+ * The driver completes guest writes as soon as their data is copied into a
+ * bounded amount of host memory, and writes the data to its child in the
+ * background, merging adjacent writes into larger requests.  Guest flushes
+ * and FUA writes wait until the data they cover has reached the child.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+
+#include "qapi/error.h"
+#include "qemu/coroutine.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "block/block_int.h"
+#include "trace.h"
+
+typedef struct WritebackOpts {
+    int64_t max_dirty;
+    int64_t max_batch;
+} WritebackOpts;
+
+/*
+ * Data of a guest write that has not reached the child yet.
+ *
+ * Extents in the tree never overlap.  When a new write overlaps an extent,
+ * the parts of the old extent that are not overwritten are copied into new
+ * extents.  If the old extent is being written to the child at that time,
+ * it is only removed from the tree, and freed once its write completed.
+ */
+typedef struct WritebackExtent {
+    uint64_t offset;
+    uint64_t bytes;
+    uint8_t *buf;
+
+    /* Number of the guest write, for flushes */
+    uint64_t seq;
+
+    /* Part of the batch that is being written to the child */
+    bool flushing;
+    /* No longer in the tree, because newer data replaced it */
+    bool removed;
+} WritebackExtent;
+
+typedef struct BDRVWritebackState {
+    WritebackOpts opts;
+
+    /* Dirty WritebackExtents, used both as key and value */
+    GTree *extents;
+    /* Bytes in all WritebackExtents, including removed ones */
+    uint64_t dirty_bytes;
+    /* Number of the last guest write */
+    uint64_t seq;
+
+    bool flusher_running;
+    /* Where the next batch starts, so that batches go through the disk */
+    uint64_t flush_cursor;
+    /* The batch that is being written, or 0 bytes */
+    uint64_t flush_offset;
+    uint64_t flush_bytes;
+    /* Error of the last background write, until a flush reports it */
+    int error;
+
+    /* Requests waiting for the flusher to make progress */
+    CoQueue waiters;
+} BDRVWritebackState;
+
+#define WRITEBACK_OPT_MAX_DIRTY "max-dirty"
+#define WRITEBACK_OPT_MAX_BATCH "max-batch"
+static QemuOptsList runtime_opts = {
+    .name = "writeback-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = WRITEBACK_OPT_MAX_DIRTY,
+            .type = QEMU_OPT_SIZE,
+            .help = "maximum amount of data not yet written to the child, "
+                "default 64M",
+        },
+        {
+            .name = WRITEBACK_OPT_MAX_BATCH,
+            .type = QEMU_OPT_SIZE,
+            .help = "maximum size of a write to the child, default 4M",
+        },
+        { /* end of list */ }
+    },
+};
+
+static bool writeback_absorb_opts(WritebackOpts *dest, QDict *options,
+                                  Error **errp)
+{
+    QemuOpts *opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        qemu_opts_del(opts);
+        return false;
+    }
+
+    dest->max_dirty =
+        qemu_opt_get_size(opts, WRITEBACK_OPT_MAX_DIRTY, 64 * MiB);
+    dest->max_batch =
+        qemu_opt_get_size(opts, WRITEBACK_OPT_MAX_BATCH, 4 * MiB);
+
+    qemu_opts_del(opts);
+
+    if (dest->max_batch == 0 || dest->max_batch > BDRV_REQUEST_MAX_BYTES) {
+        error_setg(errp, "max-batch parameter of writeback-cache filter "
+                   "must be between 1 and %" PRId64,
+                   (int64_t)BDRV_REQUEST_MAX_BYTES);
+        return false;
+    }
+
+    return true;
+}
+
+/* Like in block-status-map.c, overlapping extents compare as equal */
+static gint extent_cmp(gconstpointer a, gconstpointer b, gpointer opaque)
+{
+    const WritebackExtent *ea = a;
+    const WritebackExtent *eb = b;
+
+    if (ea->offset + ea->bytes <= eb->offset) {
+        return -1;
+    }
+    if (eb->offset + eb->bytes <= ea->offset) {
+        return 1;
+    }
+    return 0;
+}
+
+static WritebackExtent *extent_new(BlockDriverState *bs, uint64_t offset,
+                                   uint64_t bytes, uint64_t seq)
+{
+    BDRVWritebackState *s = bs->opaque;
+    WritebackExtent *e = g_new(WritebackExtent, 1);
+
+    *e = (WritebackExtent) {
+        .offset = offset,
+        .bytes = bytes,
+        .buf = qemu_blockalign(bs->file->bs, bytes),
+        .seq = seq,
+    };
+    s->dirty_bytes += bytes;
+    return e;
+}
+
+static void extent_free(BDRVWritebackState *s, WritebackExtent *e)
+{
+    s->dirty_bytes -= e->bytes;
+    qemu_vfree(e->buf);
+    g_free(e);
+}
+
+/*
+ * Remove the data in [@offset, @offset + @bytes) from the cache, because
+ * newer data replaces it.
+ */
+static void extent_remove(BlockDriverState *bs, uint64_t offset,
+                          uint64_t bytes)
+{
+    BDRVWritebackState *s = bs->opaque;
+    WritebackExtent key = { .offset = offset, .bytes = bytes };
+    WritebackExtent *e, *part;
+
+    while ((e = g_tree_lookup(s->extents, &key))) {
+        g_tree_remove(s->extents, e);
+
+        if (e->offset < offset) {
+            part = extent_new(bs, e->offset, offset - e->offset, e->seq);
+            memcpy(part->buf, e->buf, part->bytes);
+            g_tree_insert(s->extents, part, part);
+        }
+        if (e->offset + e->bytes > offset + bytes) {
+            part = extent_new(bs, offset + bytes,
+                              e->offset + e->bytes - (offset + bytes), e->seq);
+            memcpy(part->buf, e->buf + (part->offset - e->offset),
+                   part->bytes);
+            g_tree_insert(s->extents, part, part);
+        }
+
+        if (e->flushing) {
+            e->removed = true;
+        } else {
+            extent_free(s, e);
+        }
+    }
+}
+
+typedef struct ExtentPiece {
+    uint64_t offset;
+    uint64_t bytes;
+    uint8_t *buf;
+} ExtentPiece;
+
+/* Append the cached parts of [@start, @end) to @pieces, in any order */
+static void extent_collect(BDRVWritebackState *s, uint64_t start,
+                           uint64_t end, GArray *pieces)
+{
+    WritebackExtent key = { .offset = start, .bytes = end - start };
+    WritebackExtent *e;
+    ExtentPiece p;
+
+    if (start >= end) {
+        return;
+    }
+
+    e = g_tree_lookup(s->extents, &key);
+    if (!e) {
+        return;
+    }
+
+    p.offset = MAX(start, e->offset);
+    p.bytes = MIN(end, e->offset + e->bytes) - p.offset;
+    p.buf = e->buf + (p.offset - e->offset);
+    g_array_append_val(pieces, p);
+
+    extent_collect(s, start, e->offset, pieces);
+    extent_collect(s, e->offset + e->bytes, end, pieces);
+}
+
+typedef struct WritebackBatch {
+    uint64_t cursor;
+    uint64_t max_bytes;
+    GPtrArray *extents;
+} WritebackBatch;
+
+static gboolean batch_add_extent(gpointer key, gpointer value, gpointer opaque)
+{
+    WritebackBatch *batch = opaque;
+    WritebackExtent *e = value;
+    WritebackExtent *first, *last;
+
+    if (!batch->extents->len) {
+        if (e->offset < batch->cursor || e->flushing) {
+            return FALSE;
+        }
+        g_ptr_array_add(batch->extents, e);
+        return FALSE;
+    }
+
+    first = g_ptr_array_index(batch->extents, 0);
+    last = g_ptr_array_index(batch->extents, batch->extents->len - 1);
+    if (e->flushing || e->offset != last->offset + last->bytes ||
+        e->offset + e->bytes - first->offset > batch->max_bytes ||
+        batch->extents->len == IOV_MAX)
+    {
+        return TRUE;
+    }
+    g_ptr_array_add(batch->extents, e);
+    return FALSE;
+}
+
+/*
+ * Pick the next adjacent extents to write, starting at the flush cursor
+ * and wrapping around at the end of the disk.
+ */
+static GPtrArray *writeback_next_batch(BDRVWritebackState *s)
+{
+    WritebackBatch batch = {
+        .cursor = s->flush_cursor,
+        .max_bytes = s->opts.max_batch,
+        .extents = g_ptr_array_new(),
+    };
+
+    g_tree_foreach(s->extents, batch_add_extent, &batch);
+    if (!batch.extents->len && batch.cursor) {
+        batch.cursor = 0;
+        g_tree_foreach(s->extents, batch_add_extent, &batch);
+    }
+
+    return batch.extents;
+}
+
+static void coroutine_fn writeback_flusher_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVWritebackState *s = bs->opaque;
+    GPtrArray *batch;
+    QEMUIOVector qiov;
+    WritebackExtent *e;
+    int i, ret;
+
+    while ((batch = writeback_next_batch(s))->len) {
+        qemu_iovec_init(&qiov, batch->len);
+        for (i = 0; i < batch->len; i++) {
+            e = g_ptr_array_index(batch, i);
+            e->flushing = true;
+            qemu_iovec_add(&qiov, e->buf, e->bytes);
+        }
+        e = g_ptr_array_index(batch, 0);
+        s->flush_offset = e->offset;
+        s->flush_bytes = qiov.size;
+
+        ret = bdrv_co_pwritev(bs->file, s->flush_offset, s->flush_bytes,
+                              &qiov, 0);
+        trace_writeback_cache_flush_batch(bs, s->flush_offset, s->flush_bytes,
+                                          batch->len, ret);
+        qemu_iovec_destroy(&qiov);
+        s->flush_cursor = s->flush_offset + s->flush_bytes;
+        s->flush_bytes = 0;
+
+        for (i = 0; i < batch->len; i++) {
+            e = g_ptr_array_index(batch, i);
+            e->flushing = false;
+            if (e->removed) {
+                extent_free(s, e);
+            } else if (ret >= 0) {
+                g_tree_remove(s->extents, e);
+                extent_free(s, e);
+            }
+        }
+        g_ptr_array_free(batch, true);
+
+        if (ret < 0) {
+            /* Keep the data and let the next flush report the error */
+            s->error = ret;
+            batch = NULL;
+            break;
+        }
+        qemu_co_queue_restart_all(&s->waiters);
+    }
+    if (batch) {
+        g_ptr_array_free(batch, true);
+    }
+
+    s->flusher_running = false;
+    qemu_co_queue_restart_all(&s->waiters);
+    bdrv_dec_in_flight(bs);
+}
+
+static void writeback_kick(BlockDriverState *bs)
+{
+    BDRVWritebackState *s = bs->opaque;
+    Coroutine *co;
+
+    if (s->flusher_running || !g_tree_nnodes(s->extents)) {
+        return;
+    }
+
+    s->flusher_running = true;
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(writeback_flusher_entry, bs);
+    aio_co_enter(bdrv_get_aio_context(bs), co);
+}
+
+typedef struct WritebackOlder {
+    uint64_t seq;
+    bool found;
+} WritebackOlder;
+
+static gboolean extent_is_older(gpointer key, gpointer value, gpointer opaque)
+{
+    WritebackExtent *e = value;
+    WritebackOlder *older = opaque;
+
+    older->found = e->seq <= older->seq;
+    return older->found;
+}
+
+/* Wait until all guest writes up to @seq have reached the child */
+static int coroutine_fn writeback_wait_seq(BlockDriverState *bs, uint64_t seq)
+{
+    BDRVWritebackState *s = bs->opaque;
+    WritebackOlder older = { .seq = seq };
+    int ret;
+
+    for (;;) {
+        older.found = false;
+        g_tree_foreach(s->extents, extent_is_older, &older);
+        if (!older.found) {
+            return 0;
+        }
+        if (s->error < 0) {
+            ret = s->error;
+            s->error = 0;
+            return ret;
+        }
+        writeback_kick(bs);
+        qemu_co_queue_wait(&s->waiters, NULL);
+    }
+}
+
+/*
+ * Prepare for a request that goes to the child directly: drop cached data
+ * that it replaces, and wait for writes of older data to the same area.
+ */
+static void coroutine_fn writeback_bypass(BlockDriverState *bs,
+                                          uint64_t offset, uint64_t bytes)
+{
+    BDRVWritebackState *s = bs->opaque;
+
+    extent_remove(bs, offset, bytes);
+    while (s->flush_bytes && offset < s->flush_offset + s->flush_bytes &&
+           s->flush_offset < offset + bytes)
+    {
+        qemu_co_queue_wait(&s->waiters, NULL);
+    }
+}
+
+static int writeback_open(BlockDriverState *bs, QDict *options, int flags,
+                          Error **errp)
+{
+    BDRVWritebackState *s = bs->opaque;
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_of_bds,
+                               BDRV_CHILD_FILTERED | BDRV_CHILD_PRIMARY,
+                               false, errp);
+    if (!bs->file) {
+        return -EINVAL;
+    }
+
+    if (!writeback_absorb_opts(&s->opts, options, errp)) {
+        return -EINVAL;
+    }
+
+    s->extents = g_tree_new_full(extent_cmp, NULL, NULL, NULL);
+    qemu_co_queue_init(&s->waiters);
+
+    /* FUA is implemented here, by waiting for the data to be written */
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED | BDRV_REQ_FUA;
+
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    return 0;
+}
+
+static gboolean extent_free_cb(gpointer key, gpointer value, gpointer opaque)
+{
+    extent_free(opaque, value);
+    return FALSE;
+}
+
+static void writeback_close(BlockDriverState *bs)
+{
+    BDRVWritebackState *s = bs->opaque;
+
+    /*
+     * Data is only left if the last flush failed, and the node is drained,
+     * so nothing is being written any more.
+     */
+    assert(!s->flusher_running);
+    g_tree_foreach(s->extents, extent_free_cb, s);
+    g_tree_destroy(s->extents);
+}
+
+static int writeback_reopen_prepare(BDRVReopenState *reopen_state,
+                                    BlockReopenQueue *queue, Error **errp)
+{
+    BDRVWritebackState *s = reopen_state->bs->opaque;
+    WritebackOpts *opts;
+
+    /*
+     * The node is drained, so data is only left if its write to the child
+     * failed.  It still has to be written, which a read-only node cannot.
+     */
+    if (!(reopen_state->flags & BDRV_O_RDWR) && g_tree_nnodes(s->extents)) {
+        error_setg(errp, "Cannot make the writeback-cache node read-only "
+                   "while it holds data that could not be written to its "
+                   "child; flush it first");
+        return -EBUSY;
+    }
+
+    opts = g_new0(WritebackOpts, 1);
+    if (!writeback_absorb_opts(opts, reopen_state->options, errp)) {
+        g_free(opts);
+        return -EINVAL;
+    }
+
+    reopen_state->opaque = opts;
+
+    return 0;
+}
+
+static void writeback_reopen_commit(BDRVReopenState *state)
+{
+    BDRVWritebackState *s = state->bs->opaque;
+
+    s->opts = *(WritebackOpts *)state->opaque;
+
+    g_free(state->opaque);
+    state->opaque = NULL;
+}
+
+static void writeback_reopen_abort(BDRVReopenState *state)
+{
+    g_free(state->opaque);
+    state->opaque = NULL;
+}
+
+static int coroutine_fn writeback_co_preadv_part(BlockDriverState *bs,
+                                                 uint64_t offset,
+                                                 uint64_t bytes,
+                                                 QEMUIOVector *qiov,
+                                                 size_t qiov_offset,
+                                                 int flags)
+{
+    BDRVWritebackState *s = bs->opaque;
+    g_autoptr(GArray) pieces = g_array_new(false, false, sizeof(ExtentPiece));
+    uint64_t cached = 0;
+    ExtentPiece *p;
+    int i, ret;
+
+    extent_collect(s, offset, offset + bytes, pieces);
+    for (i = 0; i < pieces->len; i++) {
+        cached += g_array_index(pieces, ExtentPiece, i).bytes;
+    }
+
+    if (cached == bytes) {
+        for (i = 0; i < pieces->len; i++) {
+            p = &g_array_index(pieces, ExtentPiece, i);
+            qemu_iovec_from_buf(qiov, qiov_offset + (p->offset - offset),
+                                p->buf, p->bytes);
+        }
+        return 0;
+    }
+
+    /*
+     * The cached data may reach the child and be dropped while we read
+     * from the child, which may then still return the old data.  Copy it
+     * now, because it is the data that the guest must see.
+     */
+    for (i = 0; i < pieces->len; i++) {
+        p = &g_array_index(pieces, ExtentPiece, i);
+        p->buf = g_memdup(p->buf, p->bytes);
+    }
+
+    ret = bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset,
+                              flags);
+
+    for (i = 0; i < pieces->len; i++) {
+        p = &g_array_index(pieces, ExtentPiece, i);
+        if (ret >= 0) {
+            qemu_iovec_from_buf(qiov, qiov_offset + (p->offset - offset),
+                                p->buf, p->bytes);
+        }
+        g_free(p->buf);
+    }
+
+    return ret;
+}
+
+static int coroutine_fn writeback_co_pwritev_part(BlockDriverState *bs,
+                                                  uint64_t offset,
+                                                  uint64_t bytes,
+                                                  QEMUIOVector *qiov,
+                                                  size_t qiov_offset,
+                                                  int flags)
+{
+    BDRVWritebackState *s = bs->opaque;
+    WritebackExtent *e;
+    uint64_t seq;
+    int ret;
+
+    while ((flags & BDRV_REQ_WRITE_UNCHANGED) ||
+           s->dirty_bytes + bytes > s->opts.max_dirty)
+    {
+        if ((flags & BDRV_REQ_WRITE_UNCHANGED) ||
+            bytes > s->opts.max_dirty / 2 || s->error < 0)
+        {
+            /*
+             * Large writes would only make the cache wait for everything
+             * else, and while the child fails, waiting may never end.
+             * Unchanging writes go through, because the background writes
+             * would need more permissions than they have.
+             */
+            writeback_bypass(bs, offset, bytes);
+            return bdrv_co_pwritev_part(bs->file, offset, bytes, qiov,
+                                        qiov_offset, flags);
+        }
+        writeback_kick(bs);
+        qemu_co_queue_wait(&s->waiters, NULL);
+    }
+
+    extent_remove(bs, offset, bytes);
+    seq = ++s->seq;
+    e = extent_new(bs, offset, bytes, seq);
+    qemu_iovec_to_buf(qiov, qiov_offset, e->buf, bytes);
+    g_tree_insert(s->extents, e, e);
+
+    if (flags & BDRV_REQ_FUA) {
+        ret = writeback_wait_seq(bs, seq);
+        if (ret < 0) {
+            return ret;
+        }
+        return bdrv_co_flush(bs->file->bs);
+    }
+
+    writeback_kick(bs);
+    return 0;
+}
+
+static int coroutine_fn writeback_co_pwrite_zeroes(BlockDriverState *bs,
+                                                   int64_t offset, int bytes,
+                                                   BdrvRequestFlags flags)
+{
+    writeback_bypass(bs, offset, bytes);
+
+    return bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+}
+
+static int coroutine_fn writeback_co_pdiscard(BlockDriverState *bs,
+                                              int64_t offset, int bytes)
+{
+    writeback_bypass(bs, offset, bytes);
+
+    return bdrv_co_pdiscard(bs->file, offset, bytes);
+}
+
+static int coroutine_fn writeback_co_flush(BlockDriverState *bs)
+{
+    BDRVWritebackState *s = bs->opaque;
+    int ret;
+
+    ret = writeback_wait_seq(bs, s->seq);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_co_flush(bs->file->bs);
+}
+
+static int coroutine_fn
+writeback_co_truncate(BlockDriverState *bs, int64_t offset,
+                      bool exact, PreallocMode prealloc,
+                      BdrvRequestFlags flags, Error **errp)
+{
+    BDRVWritebackState *s = bs->opaque;
+    int ret;
+
+    ret = writeback_wait_seq(bs, s->seq);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write back cached data");
+        return ret;
+    }
+
+    return bdrv_co_truncate(bs->file, offset, exact, prealloc, flags, errp);
+}
+
+static int64_t writeback_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static void writeback_child_perm(BlockDriverState *bs, BdrvChild *c,
+    BdrvChildRole role, BlockReopenQueue *reopen_queue,
+    uint64_t perm, uint64_t shared, uint64_t *nperm, uint64_t *nshared)
+{
+    BDRVWritebackState *s = bs->opaque;
+
+    bdrv_default_perms(bs, c, role, reopen_queue, perm, shared, nperm, nshared);
+
+    /* Writes that bypass the cache could be overwritten by older data */
+    *nshared &= ~BLK_PERM_WRITE;
+
+    /*
+     * Cached data still has to reach the child, even if the parents no
+     * longer write.  This is only the case after a background write
+     * failed, and the next flush retries it.
+     */
+    if (s->extents && (g_tree_nnodes(s->extents) || s->flusher_running)) {
+        *nperm |= BLK_PERM_WRITE;
+    }
+}
+
+BlockDriver bdrv_writeback_cache_filter = {
+    .format_name = "writeback-cache",
+    .instance_size = sizeof(BDRVWritebackState),
+
+    .bdrv_getlength = writeback_getlength,
+    .bdrv_open = writeback_open,
+    .bdrv_close = writeback_close,
+
+    .bdrv_reopen_prepare  = writeback_reopen_prepare,
+    .bdrv_reopen_commit   = writeback_reopen_commit,
+    .bdrv_reopen_abort    = writeback_reopen_abort,
+
+    .bdrv_co_preadv_part = writeback_co_preadv_part,
+    .bdrv_co_pwritev_part = writeback_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes = writeback_co_pwrite_zeroes,
+    .bdrv_co_pdiscard = writeback_co_pdiscard,
+    .bdrv_co_flush = writeback_co_flush,
+    .bdrv_co_truncate = writeback_co_truncate,
+
+    .bdrv_child_perm = writeback_child_perm,
+
+    .has_variable_length = true,
+    .is_filter = true,
+};
+
+static void bdrv_writeback_cache_init(void)
+{
+    bdrv_register(&bdrv_writeback_cache_filter);
+}
+
+block_init(bdrv_writeback_cache_init);
@@ -51,8 +51,8 @@ void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s, VirtQueue *vq)
     if (s->batch_notifications) {
         set_bit(virtio_get_queue_index(vq), s->batch_notify_vqs);
         qemu_bh_schedule(s->bh);
-    } else {
-        virtio_notify_irqfd(s->vdev, vq);
+    } else if (virtio_notify_irqfd(s->vdev, vq)) {
+        stat64_add(&VIRTIO_BLK(s->vdev)->notifications_sent, 1);
     }
 }
 
@@ -73,7 +73,9 @@ static void notify_guest_bh(void *opaque)
             unsigned i = j + ctzl(bits);
             VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
-            virtio_notify_irqfd(s->vdev, vq);
+            if (virtio_notify_irqfd(s->vdev, vq)) {
+                stat64_add(&VIRTIO_BLK(s->vdev)->notifications_sent, 1);
+            }
 
             bits &= bits - 1; /* clear right-most bit */
         }
@@ -32,6 +32,7 @@
 #include "hw/virtio/virtio-bus.h"
 #include "migration/qemu-file-types.h"
 #include "hw/virtio/virtio-access.h"
+#include "qapi/visitor.h"
 
 /* Config size before the discard support (hide associated config fields) */
 #define VIRTIO_BLK_CFG_SIZE offsetof(struct virtio_blk_config, \
@@ -72,21 +73,83 @@ static void virtio_blk_free_request(VirtIOBlockReq *req)
     g_free(req);
 }
 
+static void virtio_blk_notify(VirtIOBlock *s, VirtQueue *vq)
+{
+    if (s->dataplane_started && !s->dataplane_disabled) {
+        virtio_blk_data_plane_notify(s->dataplane, vq);
+    } else if (virtio_notify(VIRTIO_DEVICE(s), vq)) {
+        stat64_add(&s->notifications_sent, 1);
+    }
+}
+
+/* Publish the pending completions of virtqueue @n with one notification */
+static void virtio_blk_flush_completions(VirtIOBlock *s, unsigned n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    VirtQueue *vq = virtio_get_queue(vdev, n);
+    unsigned count = s->pending_completions[n];
+
+    if (!count) {
+        return;
+    }
+
+    trace_virtio_blk_flush_completions(vdev, n, count);
+    s->pending_completions[n] = 0;
+    virtqueue_flush(vq, count);
+    stat64_add(&s->completions_published, count);
+    virtio_blk_notify(s, vq);
+}
+
+static void virtio_blk_complete_bh(void *opaque)
+{
+    VirtIOBlock *s = opaque;
+    AioContext *ctx = blk_get_aio_context(s->blk);
+    unsigned i;
+
+    aio_context_acquire(ctx);
+    s->complete_bh_scheduled = false;
+    for (i = 0; i < s->conf.num_queues; i++) {
+        virtio_blk_flush_completions(s, i);
+    }
+    blk_dec_in_flight(s->blk);
+    aio_context_release(ctx);
+}
+
+/*
+ * Completions are only filled into the used ring here.  They are published
+ * to the guest by a BH once the current batch of completions has been
+ * processed, or as soon as completion-batch-size of them are pending.  The
+ * BH counts as an in-flight request, so draining the BlockBackend flushes
+ * all completions.
+ */
 static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
 {
     VirtIOBlock *s = req->dev;
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    unsigned n = virtio_get_queue_index(req->vq);
 
     trace_virtio_blk_req_complete(vdev, req, status);
 
     stb_p(&req->in->status, status);
     iov_discard_undo(&req->inhdr_undo);
     iov_discard_undo(&req->outhdr_undo);
-    virtqueue_push(req->vq, &req->elem, req->in_len);
-    if (s->dataplane_started && !s->dataplane_disabled) {
-        virtio_blk_data_plane_notify(s->dataplane, req->vq);
-    } else {
-        virtio_notify(vdev, req->vq);
+
+    if (s->conf.completion_batch_size == 1) {
+        virtqueue_push(req->vq, &req->elem, req->in_len);
+        stat64_add(&s->completions_published, 1);
+        virtio_blk_notify(s, req->vq);
+        return;
+    }
+
+    virtqueue_fill(req->vq, &req->elem, req->in_len,
+                   s->pending_completions[n]++);
+    if (s->pending_completions[n] >= s->conf.completion_batch_size) {
+        virtio_blk_flush_completions(s, n);
+    } else if (!s->complete_bh_scheduled) {
+        s->complete_bh_scheduled = true;
+        blk_inc_in_flight(s->blk);
+        aio_bh_schedule_oneshot(blk_get_aio_context(s->blk),
+                                virtio_blk_complete_bh, s);
     }
 }
 
@@ -460,8 +523,11 @@ static void virtio_blk_submit_multireq(BlockBackend *blk, MultiReqBuffer *mrb)
 
     max_transfer = blk_get_max_transfer(mrb->reqs[0]->dev->blk);
 
-    qsort(mrb->reqs, mrb->num_reqs, sizeof(*mrb->reqs),
-          &multireq_compare);
+    /* Requests from sequential streams usually arrive in order already */
+    if (!mrb->sorted) {
+        qsort(mrb->reqs, mrb->num_reqs, sizeof(*mrb->reqs),
+              &multireq_compare);
+    }
 
     for (i = 0; i < mrb->num_reqs; i++) {
         VirtIOBlockReq *req = mrb->reqs[i];
@@ -497,6 +563,43 @@ static void virtio_blk_submit_multireq(BlockBackend *blk, MultiReqBuffer *mrb)
     mrb->num_reqs = 0;
 }
 
+/*
+ * Random requests cannot be merged, so holding many of them back only adds
+ * latency.  Only grow the window beyond VIRTIO_BLK_MIN_MERGE_REQS once at
+ * least half of that many requests in the batch were sequential, so that a
+ * single adjacent pair in a random workload does not widen it.
+ */
+static unsigned int virtio_blk_merge_window(VirtIOBlock *s,
+                                            MultiReqBuffer *mrb)
+{
+    if (mrb->num_sequential < VIRTIO_BLK_MIN_MERGE_REQS / 2) {
+        return MIN(s->conf.max_merge_reqs, VIRTIO_BLK_MIN_MERGE_REQS);
+    }
+    return s->conf.max_merge_reqs;
+}
+
+static void virtio_blk_add_multireq(MultiReqBuffer *mrb, VirtIOBlockReq *req,
+                                    bool is_write)
+{
+    if (mrb->num_reqs == 0) {
+        mrb->sorted = true;
+        mrb->num_sequential = 0;
+    } else {
+        VirtIOBlockReq *prev = mrb->reqs[mrb->num_reqs - 1];
+
+        if (req->sector_num < prev->sector_num) {
+            mrb->sorted = false;
+        } else if (req->sector_num == prev->sector_num +
+                   prev->qiov.size / BDRV_SECTOR_SIZE) {
+            mrb->num_sequential++;
+        }
+    }
+
+    assert(mrb->num_reqs < VIRTIO_BLK_MAX_MERGE_REQS);
+    mrb->reqs[mrb->num_reqs++] = req;
+    mrb->is_write = is_write;
+}
+
 static void virtio_blk_handle_flush(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 {
     VirtIOBlock *s = req->dev;
@@ -685,15 +788,14 @@ static int virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 
         /* merge would exceed maximum number of requests or IO direction
          * changes */
-        if (mrb->num_reqs > 0 && (mrb->num_reqs == VIRTIO_BLK_MAX_MERGE_REQS ||
-                                  is_write != mrb->is_write ||
-                                  !s->conf.request_merging)) {
+        if (mrb->num_reqs > 0 &&
+            (mrb->num_reqs >= virtio_blk_merge_window(s, mrb) ||
+             is_write != mrb->is_write ||
+             !s->conf.request_merging)) {
             virtio_blk_submit_multireq(s->blk, mrb);
         }
 
-        assert(mrb->num_reqs < VIRTIO_BLK_MAX_MERGE_REQS);
-        mrb->reqs[mrb->num_reqs++] = req;
-        mrb->is_write = is_write;
+        virtio_blk_add_multireq(mrb, req, is_write);
         break;
     }
     case VIRTIO_BLK_T_FLUSH:
@@ -1161,6 +1263,18 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
         error_setg(errp, "num-queues property must be larger than 0");
         return;
     }
+    if (!conf->max_merge_reqs ||
+        conf->max_merge_reqs > VIRTIO_BLK_MAX_MERGE_REQS) {
+        error_setg(errp, "invalid max-merge-reqs property (%" PRIu32 "), "
+                   "must be between 1 and %d",
+                   conf->max_merge_reqs, VIRTIO_BLK_MAX_MERGE_REQS);
+        return;
+    }
+    if (!conf->completion_batch_size) {
+        error_setg(errp, "completion-batch-size property must be larger "
+                   "than 0");
+        return;
+    }
     if (conf->queue_size <= 2) {
         error_setg(errp, "invalid queue-size property (%" PRIu16 "), "
                    "must be > 2", conf->queue_size);
@@ -1214,6 +1328,7 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     s->blk = conf->conf.blk;
     s->rq = NULL;
     s->sector_mask = (s->conf.conf.logical_block_size / BDRV_SECTOR_SIZE) - 1;
+    s->pending_completions = g_new0(unsigned, conf->num_queues);
 
     for (i = 0; i < conf->num_queues; i++) {
         virtio_add_queue(vdev, conf->queue_size, virtio_blk_handle_output);
@@ -1224,6 +1339,7 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
         for (i = 0; i < conf->num_queues; i++) {
             virtio_del_queue(vdev, i);
         }
+        g_free(s->pending_completions);
         virtio_cleanup(vdev);
         return;
     }
@@ -1254,11 +1370,36 @@ static void virtio_blk_device_unrealize(DeviceState *dev)
     for (i = 0; i < conf->num_queues; i++) {
         virtio_del_queue(vdev, i);
     }
+    g_free(s->pending_completions);
     qemu_del_vm_change_state_handler(s->change);
     blockdev_mark_auto_del(s->blk);
     virtio_cleanup(vdev);
 }
 
+static void virtio_blk_get_notifications_sent(Object *obj, Visitor *v,
+                                              const char *name, void *opaque,
+                                              Error **errp)
+{
+    VirtIOBlock *s = VIRTIO_BLK(obj);
+    uint64_t value = stat64_get(&s->notifications_sent);
+
+    visit_type_uint64(v, name, &value, errp);
+}
+
+static void virtio_blk_get_notifications_suppressed(Object *obj, Visitor *v,
+                                                   const char *name,
+                                                   void *opaque, Error **errp)
+{
+    VirtIOBlock *s = VIRTIO_BLK(obj);
+    uint64_t sent, value;
+
+    /* Completions are published before they are notified */
+    sent = stat64_get(&s->notifications_sent);
+    value = stat64_get(&s->completions_published) - sent;
+
+    visit_type_uint64(v, name, &value, errp);
+}
+
 static void virtio_blk_instance_init(Object *obj)
 {
     VirtIOBlock *s = VIRTIO_BLK(obj);
@@ -1266,6 +1407,12 @@ static void virtio_blk_instance_init(Object *obj)
     device_add_bootindex_property(obj, &s->conf.conf.bootindex,
                                   "bootindex", "/disk@0,0",
                                   DEVICE(obj));
+    object_property_add(obj, "x-notifications-sent", "uint64",
+                        virtio_blk_get_notifications_sent,
+                        NULL, NULL, NULL);
+    object_property_add(obj, "x-notifications-suppressed", "uint64",
+                        virtio_blk_get_notifications_suppressed,
+                        NULL, NULL, NULL);
 }
 
 static const VMStateDescription vmstate_virtio_blk = {
@@ -1291,9 +1438,13 @@ static Property virtio_blk_properties[] = {
 #endif
     DEFINE_PROP_BIT("request-merging", VirtIOBlock, conf.request_merging, 0,
                     true),
+    DEFINE_PROP_UINT32("max-merge-reqs", VirtIOBlock, conf.max_merge_reqs,
+                       VIRTIO_BLK_MAX_MERGE_REQS),
     DEFINE_PROP_UINT16("num-queues", VirtIOBlock, conf.num_queues,
                        VIRTIO_BLK_AUTO_NUM_QUEUES),
     DEFINE_PROP_UINT16("queue-size", VirtIOBlock, conf.queue_size, 256),
+    DEFINE_PROP_UINT32("completion-batch-size", VirtIOBlock,
+                       conf.completion_batch_size, 32),
     DEFINE_PROP_BOOL("seg-max-adjust", VirtIOBlock, conf.seg_max_adjust, true),
     DEFINE_PROP_LINK("iothread", VirtIOBlock, conf.iothread, TYPE_IOTHREAD,
                      IOThread *),
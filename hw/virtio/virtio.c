@@ -2525,11 +2525,12 @@ static bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
     }
 }
 
-void virtio_notify_irqfd(VirtIODevice *vdev, VirtQueue *vq)
+/* Returns false if the guest suppressed the notification */
+bool virtio_notify_irqfd(VirtIODevice *vdev, VirtQueue *vq)
 {
     WITH_RCU_READ_LOCK_GUARD() {
         if (!virtio_should_notify(vdev, vq)) {
-            return;
+            return false;
         }
     }
 
@@ -2552,6 +2553,7 @@ void virtio_notify_irqfd(VirtIODevice *vdev, VirtQueue *vq)
      */
     virtio_set_isr(vq->vdev, 0x1);
     event_notifier_set(&vq->guest_notifier);
+    return true;
 }
 
 static void virtio_irq(VirtQueue *vq)
@@ -2560,16 +2562,18 @@ static void virtio_irq(VirtQueue *vq)
     virtio_notify_vector(vq->vdev, vq->vector);
 }
 
-void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
+/* Returns false if the guest suppressed the notification */
+bool virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
     WITH_RCU_READ_LOCK_GUARD() {
         if (!virtio_should_notify(vdev, vq)) {
-            return;
+            return false;
         }
     }
 
     trace_virtio_notify(vdev, vq);
     virtio_irq(vq);
+    return true;
 }
 
 void virtio_notify_config(VirtIODevice *vdev)
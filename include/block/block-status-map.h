@@ -0,0 +1,57 @@
+/*
+ * Block status map
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef BLOCK_STATUS_MAP_H
+#define BLOCK_STATUS_MAP_H
+
+#include "block/block.h"
+
+/*
+ * A BlockStatusMap remembers the extents returned by
+ * bdrv_block_status_above() for a node, so that repeated queries of the
+ * same area do not have to go down to the driver (and to lseek() or the
+ * qcow2 L2 tables) again.
+ *
+ * Only the BDRV_BLOCK_DATA, BDRV_BLOCK_ZERO and BDRV_BLOCK_ALLOCATED bits
+ * are kept.  Unless the map tracks writes itself, it is not updated by
+ * writes to the node: users that query a node which is being written to
+ * must call bdrv_block_status_map_invalidate() once each write has
+ * completed.
+ */
+typedef struct BlockStatusMap BlockStatusMap;
+
+/*
+ * @prefetch is the minimum number of bytes queried on a miss, so that
+ * a whole extent is usually fetched at once even if the caller only
+ * asks for a small part of it.  0 means to query exactly what the
+ * caller asks for.
+ *
+ * If @track_writes is true, writes to @bs through any of its parents are
+ * recorded in an anonymous dirty bitmap, and the areas they touched are
+ * dropped from the map before each lookup.  Writes that are still in
+ * flight are caught by the next lookup.  Creating the bitmap can fail, in
+ * which case NULL is returned and @errp is set.
+ */
+BlockStatusMap *bdrv_block_status_map_new(BlockDriverState *bs,
+                                          BlockDriverState *base,
+                                          int64_t prefetch,
+                                          bool track_writes,
+                                          Error **errp);
+void bdrv_block_status_map_free(BlockStatusMap *map);
+
+/*
+ * Like bdrv_block_status_above() on the node and base of @map, without
+ * the @map and @file outputs.
+ */
+int bdrv_block_status_map_get(BlockStatusMap *map, int64_t offset,
+                              int64_t bytes, int64_t *pnum);
+
+/* Forget the status of [@offset, @offset + @bytes) */
+void bdrv_block_status_map_invalidate(BlockStatusMap *map, int64_t offset,
+                                      int64_t bytes);
+
+#endif
@@ -35,6 +35,12 @@ typedef struct BlockDriverInfo {
      * True if this block driver only supports compressed writes
      */
     bool needs_compressed_writes;
+    /*
+     * True if a compressed write may span several clusters: they are
+     * compressed in parallel and allocated in guest offset order, so the
+     * result is the same as writing them one by one
+     */
+    bool ordered_compressed_writes;
 } BlockDriverInfo;
 
 typedef struct BlockFragInfo {
@@ -568,6 +574,7 @@ const char *bdrv_get_device_name(const BlockDriverState *bs);
 const char *bdrv_get_device_or_node_name(const BlockDriverState *bs);
 int bdrv_get_flags(BlockDriverState *bs);
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi);
+int bdrv_fstat(BlockDriverState *bs, struct stat *st);
 ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs,
                                           Error **errp);
 BlockStatsSpecific *bdrv_get_specific_stats(BlockDriverState *bs);
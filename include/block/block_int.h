@@ -444,6 +444,11 @@ struct BlockDriver {
                                   const char *name,
                                   Error **errp);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
+    /*
+     * Return the result of fstat() on the file through which the driver
+     * accesses the image.  Only for protocol drivers that use a local file.
+     */
+    int (*bdrv_fstat)(BlockDriverState *bs, struct stat *st);
     ImageInfoSpecific *(*bdrv_get_specific_info)(BlockDriverState *bs,
                                                  Error **errp);
     BlockStatsSpecific *(*bdrv_get_specific_stats)(BlockDriverState *bs);
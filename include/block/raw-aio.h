@@ -60,8 +60,17 @@ void laio_io_unplug(BlockDriverState *bs, LinuxAioState *s);
 /* io_uring.c - Linux io_uring implementation */
 #ifdef CONFIG_LINUX_IO_URING
 typedef struct LuringState LuringState;
-LuringState *luring_init(Error **errp);
+/* luring_init() flags */
+#define LURING_SQPOLL   0x1   /* poll the submission queue from the kernel */
+#define LURING_IOPOLL   0x2   /* poll the device for completions */
+LuringState *luring_init(unsigned int flags, Error **errp);
 void luring_cleanup(LuringState *s);
+LuringState *luring_get_shared(AioContext *ctx, unsigned int flags,
+                               Error **errp);
+void luring_put_shared(LuringState *s);
+void luring_enable_fixed_bufs(LuringState *s);
+int luring_register_fd(LuringState *s, int fd);
+void luring_unregister_fd(LuringState *s, int fd);
 int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
                                 uint64_t offset, QEMUIOVector *qiov, int type);
 void luring_detach_aio_context(LuringState *s, AioContext *old_context);
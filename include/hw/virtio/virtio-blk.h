@@ -19,6 +19,7 @@
 #include "hw/block/block.h"
 #include "sysemu/iothread.h"
 #include "sysemu/block-backend.h"
+#include "qemu/stats64.h"
 #include "qom/object.h"
 
 #define TYPE_VIRTIO_BLK "virtio-blk-device"
@@ -38,6 +39,8 @@ struct VirtIOBlkConf
     IOThread *iothread;
     char *serial;
     uint32_t request_merging;
+    uint32_t completion_batch_size;
+    uint32_t max_merge_reqs;
     uint16_t num_queues;
     uint16_t queue_size;
     bool seg_max_adjust;
@@ -63,6 +66,13 @@ struct VirtIOBlock {
     struct VirtIOBlockDataPlane *dataplane;
     uint64_t host_features;
     size_t config_size;
+
+    /* Completions filled into each used ring but not flushed yet */
+    unsigned *pending_completions;
+    bool complete_bh_scheduled;
+    /* Updated in the device's AioContext, read from the main loop */
+    Stat64 completions_published;
+    Stat64 notifications_sent;
 };
 
 typedef struct VirtIOBlockReq {
@@ -81,12 +91,18 @@ typedef struct VirtIOBlockReq {
     BlockAcctCookie acct;
 } VirtIOBlockReq;
 
-#define VIRTIO_BLK_MAX_MERGE_REQS 32
+#define VIRTIO_BLK_MAX_MERGE_REQS 256
+/* Merge window used until a batch contains enough sequential requests */
+#define VIRTIO_BLK_MIN_MERGE_REQS 32
 
 typedef struct MultiReqBuffer {
     VirtIOBlockReq *reqs[VIRTIO_BLK_MAX_MERGE_REQS];
     unsigned int num_reqs;
     bool is_write;
+    /* Requests were added in ascending sector order */
+    bool sorted;
+    /* Number of requests that directly follow the previously added one */
+    unsigned int num_sequential;
 } MultiReqBuffer;
 
 bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq);
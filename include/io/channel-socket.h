@@ -26,6 +26,13 @@
 #include "qemu/sockets.h"
 #include "qom/object.h"
 
+#ifdef CONFIG_LINUX
+#include <linux/errqueue.h>
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#define QEMU_MSG_ZEROCOPY
+#endif
+#endif
+
 #define TYPE_QIO_CHANNEL_SOCKET "qio-channel-socket"
 OBJECT_DECLARE_SIMPLE_TYPE(QIOChannelSocket, QIO_CHANNEL_SOCKET)
 
@@ -47,6 +54,9 @@ struct QIOChannelSocket {
     socklen_t localAddrLen;
     struct sockaddr_storage remoteAddr;
     socklen_t remoteAddrLen;
+    /* sendmsg() calls issued with MSG_ZEROCOPY, and how many completed */
+    ssize_t zero_copy_queued;
+    ssize_t zero_copy_sent;
 };
 
 
@@ -25,6 +25,7 @@ typedef struct VuFdWatch {
     int fd; /*kick fd*/
     void *pvt;
     vu_watch_cb cb;
+    AioContext *ctx;
     QTAILQ_ENTRY(VuFdWatch) next;
 } VuFdWatch;
 
@@ -48,18 +49,58 @@ typedef struct {
     QTAILQ_HEAD(, VuFdWatch) vu_fd_watches;
 
     Coroutine *co_trip; /* coroutine for processing VhostUserMsg */
+
+    /*
+     * If virtqueues are processed in their own AioContexts, queue_ctx has
+     * one entry per queue.  Each queue_lock protects the VuVirtq against
+     * the other threads; vu_client_trip() takes all of them while it
+     * processes a message, and holds them in queues_locked.
+     */
+    AioContext **queue_ctx;
+    QemuRecMutex *queue_lock;
+    bool queues_locked;
+
+    /*
+     * Requests of each queue that the device is still processing, and
+     * whether vu_client_trip() waits for them to complete.  Accessed
+     * atomically, because queues may run in different threads.
+     */
+    unsigned int *queue_in_flight;
+    bool wait_idle;
 } VuServer;
 
+/*
+ * If @queue_ctx is not NULL, it is an array of @max_queues AioContexts in
+ * which the kicks of each virtqueue are handled, and the server takes
+ * ownership of it (even on failure).  Otherwise everything runs in @ctx.
+ */
 bool vhost_user_server_start(VuServer *server,
                              SocketAddress *unix_socket,
                              AioContext *ctx,
+                             AioContext **queue_ctx,
                              uint16_t max_queues,
                              const VuDevIface *vu_iface,
                              Error **errp);
 
+/* Called with server->ctx acquired exactly once */
 void vhost_user_server_stop(VuServer *server);
 
 void vhost_user_server_attach_aio_context(VuServer *server, AioContext *ctx);
 void vhost_user_server_detach_aio_context(VuServer *server);
 
+/*
+ * Virtqueue @idx must only be accessed in vhost_user_server_queue_ctx()
+ * and with its lock held.  Queue handlers are called with the lock held.
+ */
+AioContext *vhost_user_server_queue_ctx(VuServer *server, int idx);
+void vhost_user_server_queue_lock(VuServer *server, int idx);
+void vhost_user_server_queue_unlock(VuServer *server, int idx);
+
+/*
+ * Devices count the requests that they pop from queue @idx until they are
+ * completed, so that the virtqueues and guest memory stay around for them.
+ */
+void vhost_user_server_inc_in_flight(VuServer *server, int idx);
+void vhost_user_server_dec_in_flight(VuServer *server, int idx);
+
 #endif /* VHOST_USER_SERVER_H */
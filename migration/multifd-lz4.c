@@ -0,0 +1,279 @@
+/*
+ * Multifd lz4 compression implementation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <lz4.h>
+#include "qemu/rcu.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "trace.h"
+#include "multifd.h"
+
+struct lz4_data {
+    /* stream for compression */
+    LZ4_stream_t *stream;
+    /* uncompressed pages of the packet */
+    uint8_t *buf;
+    /* size of uncompressed buffer */
+    uint32_t buf_len;
+    /* compressed buffer */
+    uint8_t *zbuff;
+    /* size of compressed buffer */
+    uint32_t zbuff_len;
+};
+
+/* Multifd lz4 compression */
+
+/**
+ * lz4_send_setup: setup send side
+ *
+ * Setup each channel with lz4 compression.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    struct lz4_data *z = g_new0(struct lz4_data, 1);
+
+    p->data = z;
+    z->stream = LZ4_createStream();
+    if (!z->stream) {
+        g_free(z);
+        error_setg(errp, "multifd %d: lz4 createStream failed", p->id);
+        return -1;
+    }
+
+    /* We will never have more than page_count pages */
+    z->buf_len = page_count * qemu_target_page_size();
+    z->zbuff_len = LZ4_compressBound(z->buf_len);
+    z->buf = g_try_malloc(z->buf_len);
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!z->buf || !z->zbuff) {
+        LZ4_freeStream(z->stream);
+        g_free(z->buf);
+        g_free(z->zbuff);
+        g_free(z);
+        error_setg(errp, "multifd %d: out of memory for zbuff", p->id);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * lz4_send_cleanup: cleanup send side
+ *
+ * Close the channel and return memory.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void lz4_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    struct lz4_data *z = p->data;
+
+    LZ4_freeStream(z->stream);
+    z->stream = NULL;
+    g_free(z->buf);
+    z->buf = NULL;
+    g_free(z->zbuff);
+    z->zbuff = NULL;
+    g_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * lz4_send_prepare: prepare date to be able to send
+ *
+ * Create a compressed buffer with all the pages that we are going to
+ * send.
+ *
+ * The pages are first copied into a contiguous buffer and compressed
+ * as a single block.  lz4 reads back previous input when it emits a
+ * match, so it must not compress straight from guest memory that the
+ * guest may be writing to at the same time.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ */
+static int lz4_send_prepare(MultiFDSendParams *p, uint32_t used, Error **errp)
+{
+    struct iovec *iov = p->pages->iov;
+    struct lz4_data *z = p->data;
+    uint32_t in_size = 0;
+    uint32_t i;
+    int ret;
+
+    for (i = 0; i < used; i++) {
+        memcpy(z->buf + in_size, iov[i].iov_base, iov[i].iov_len);
+        in_size += iov[i].iov_len;
+    }
+
+    LZ4_resetStream_fast(z->stream);
+    ret = LZ4_compress_fast_continue(z->stream, (const char *)z->buf,
+                                     (char *)z->zbuff, in_size, z->zbuff_len,
+                                     migrate_multifd_lz4_level());
+    if (ret <= 0) {
+        error_setg(errp, "multifd %d: lz4 compression failed", p->id);
+        return -1;
+    }
+    p->next_packet_size = ret;
+    p->flags |= MULTIFD_FLAG_LZ4;
+
+    return 0;
+}
+
+/**
+ * lz4_send_write: do the actual write of the data
+ *
+ * Do the actual write of the comprresed buffer.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int lz4_send_write(MultiFDSendParams *p, uint32_t used, Error **errp)
+{
+    struct lz4_data *z = p->data;
+
+    return qio_channel_write_all(p->c, (void *)z->zbuff, p->next_packet_size,
+                                 errp);
+}
+
+/**
+ * lz4_recv_setup: setup receive side
+ *
+ * Create the uncompressed and compressed buffers.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    struct lz4_data *z = g_new0(struct lz4_data, 1);
+
+    p->data = z;
+
+    /* We will never have more than page_count pages */
+    z->buf_len = page_count * qemu_target_page_size();
+    z->zbuff_len = LZ4_compressBound(z->buf_len);
+    z->buf = g_try_malloc(z->buf_len);
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!z->buf || !z->zbuff) {
+        g_free(z->buf);
+        g_free(z->zbuff);
+        g_free(z);
+        error_setg(errp, "multifd %d: out of memory for zbuff", p->id);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * lz4_recv_cleanup: cleanup receive side
+ *
+ * Return memory.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void lz4_recv_cleanup(MultiFDRecvParams *p)
+{
+    struct lz4_data *z = p->data;
+
+    g_free(z->buf);
+    z->buf = NULL;
+    g_free(z->zbuff);
+    z->zbuff = NULL;
+    g_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * lz4_recv_pages: read the data from the channel into actual pages
+ *
+ * Read the compressed buffer, and uncompress it into the actual
+ * pages.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int lz4_recv_pages(MultiFDRecvParams *p, uint32_t used, Error **errp)
+{
+    uint32_t in_size = p->next_packet_size;
+    uint32_t expected_size = used * qemu_target_page_size();
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    struct lz4_data *z = p->data;
+    uint32_t out_size = 0;
+    int ret;
+    int i;
+
+    if (flags != MULTIFD_FLAG_LZ4) {
+        error_setg(errp, "multifd %d: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_LZ4);
+        return -1;
+    }
+    if (in_size > z->zbuff_len || expected_size > z->buf_len) {
+        error_setg(errp, "multifd %d: packet size received %d too large",
+                   p->id, in_size);
+        return -1;
+    }
+    ret = qio_channel_read_all(p->c, (void *)z->zbuff, in_size, errp);
+
+    if (ret != 0) {
+        return ret;
+    }
+
+    ret = LZ4_decompress_safe((const char *)z->zbuff, (char *)z->buf,
+                              in_size, expected_size);
+    if (ret < 0) {
+        error_setg(errp, "multifd %d: lz4 decompression failed", p->id);
+        return -1;
+    }
+    if (ret != expected_size) {
+        error_setg(errp, "multifd %d: packet size received %d size expected %d",
+                   p->id, ret, expected_size);
+        return -1;
+    }
+
+    for (i = 0; i < used; i++) {
+        struct iovec *iov = &p->pages->iov[i];
+
+        memcpy(iov->iov_base, z->buf + out_size, iov->iov_len);
+        out_size += iov->iov_len;
+    }
+    return 0;
+}
+
+static MultiFDMethods multifd_lz4_ops = {
+    .send_setup = lz4_send_setup,
+    .send_cleanup = lz4_send_cleanup,
+    .send_prepare = lz4_send_prepare,
+    .send_write = lz4_send_write,
+    .recv_setup = lz4_recv_setup,
+    .recv_cleanup = lz4_recv_cleanup,
+    .recv_pages = lz4_recv_pages
+};
+
+static void multifd_lz4_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_LZ4, &multifd_lz4_ops);
+}
+
+migration_init(multifd_lz4_register);
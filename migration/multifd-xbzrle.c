@@ -0,0 +1,485 @@
+/*
+ * Multifd XBZRLE delta encoding implementation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/host-utils.h"
+#include "qemu/bswap.h"
+#include "exec/target_page.h"
+#include "exec/ramblock.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "ram.h"
+#include "page_cache.h"
+#include "xbzrle.h"
+#include "multifd.h"
+
+/*
+ * Each page of a packet is sent as a 32 bit big endian header followed
+ * by its data.  The header is either the length of the XBZRLE delta
+ * against the previous contents of the page (0 if the page did not
+ * change), or MULTIFD_XBZRLE_FULL_PAGE if the whole page follows.
+ */
+#define MULTIFD_XBZRLE_FULL_PAGE UINT32_MAX
+
+typedef struct {
+    /* Cache for the pages of this shard, protected by lock */
+    PageCache *cache;
+    QemuMutex lock;
+} XBZRLEShard;
+
+/*
+ * The cache is split in one shard per channel.  Consecutive runs of
+ * shard_pages pages go to consecutive shards, so together the shards
+ * behave like a single direct mapped cache of nr_shards * shard_pages
+ * pages, but channels encoding different parts of RAM don't contend
+ * on the same lock.
+ *
+ * Any channel can send any page, so this relies on a page being sent
+ * at most once between two multifd syncs.
+ */
+static struct {
+    XBZRLEShard *shards;
+    uint32_t nr_shards;
+    /* number of pages in each shard, a power of two */
+    uint64_t shard_pages;
+    /* a page full of zeros */
+    uint8_t *zero_page;
+    /* protects the updates of xbzrle_counters */
+    QemuMutex stats_lock;
+} multifd_xbzrle;
+
+struct xbzrle_data {
+    /* copy of the page being encoded */
+    uint8_t *current_buf;
+    /* encoded buffer */
+    uint8_t *zbuff;
+    /* size of encoded buffer */
+    uint32_t zbuff_len;
+};
+
+static XBZRLEShard *multifd_xbzrle_shard(ram_addr_t addr)
+{
+    uint64_t page = addr / qemu_target_page_size();
+
+    return &multifd_xbzrle.shards[(page / multifd_xbzrle.shard_pages) %
+                                  multifd_xbzrle.nr_shards];
+}
+
+static void multifd_xbzrle_shards_cleanup(void)
+{
+    uint32_t i;
+
+    if (!multifd_xbzrle.shards) {
+        return;
+    }
+    for (i = 0; i < multifd_xbzrle.nr_shards; i++) {
+        XBZRLEShard *shard = &multifd_xbzrle.shards[i];
+
+        if (shard->cache) {
+            cache_fini(shard->cache);
+        }
+        qemu_mutex_destroy(&shard->lock);
+    }
+    g_free(multifd_xbzrle.shards);
+    multifd_xbzrle.shards = NULL;
+    g_free(multifd_xbzrle.zero_page);
+    multifd_xbzrle.zero_page = NULL;
+    qemu_mutex_destroy(&multifd_xbzrle.stats_lock);
+}
+
+/**
+ * multifd_xbzrle_shards_setup: create the sharded cache
+ *
+ * Split xbzrle-cache-size between the channels.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @errp: pointer to an error
+ */
+static int multifd_xbzrle_shards_setup(Error **errp)
+{
+    size_t page_size = qemu_target_page_size();
+    uint32_t nr_shards = migrate_multifd_channels();
+    uint64_t cache_pages = migrate_xbzrle_cache_size() / page_size;
+    uint32_t i;
+
+    if (cache_pages < nr_shards) {
+        error_setg(errp, "multifd: xbzrle cache size is too small for "
+                   "%u channels", nr_shards);
+        return -1;
+    }
+
+    multifd_xbzrle.nr_shards = nr_shards;
+    multifd_xbzrle.shard_pages = pow2floor(cache_pages / nr_shards);
+    multifd_xbzrle.shards = g_new0(XBZRLEShard, nr_shards);
+    qemu_mutex_init(&multifd_xbzrle.stats_lock);
+    for (i = 0; i < nr_shards; i++) {
+        qemu_mutex_init(&multifd_xbzrle.shards[i].lock);
+    }
+
+    /* We prefer not to abort if there is no memory */
+    multifd_xbzrle.zero_page = g_try_malloc0(page_size);
+    if (!multifd_xbzrle.zero_page) {
+        error_setg(errp, "multifd: out of memory for xbzrle zero page");
+        goto err;
+    }
+    for (i = 0; i < nr_shards; i++) {
+        multifd_xbzrle.shards[i].cache =
+            cache_init(multifd_xbzrle.shard_pages * page_size, page_size,
+                       errp);
+        if (!multifd_xbzrle.shards[i].cache) {
+            goto err;
+        }
+    }
+    return 0;
+
+err:
+    multifd_xbzrle_shards_cleanup();
+    return -1;
+}
+
+/**
+ * multifd_xbzrle_cache_zero_page: insert a zero page in the cache
+ *
+ * Pages that are found to be zero are sent by the migration thread
+ * and never reach the channels.  Update the cache so that it doesn't
+ * keep the stale contents of the page.
+ *
+ * @addr: ram address of the page
+ */
+void multifd_xbzrle_cache_zero_page(ram_addr_t addr)
+{
+    XBZRLEShard *shard;
+
+    if (!multifd_xbzrle.shards) {
+        return;
+    }
+    shard = multifd_xbzrle_shard(addr);
+    qemu_mutex_lock(&shard->lock);
+    /* We don't care if this fails as long as it updated an old entry */
+    cache_insert(shard->cache, addr, multifd_xbzrle.zero_page,
+                 ram_counters.dirty_sync_count);
+    qemu_mutex_unlock(&shard->lock);
+}
+
+/* Multifd xbzrle encoding */
+
+/**
+ * xbzrle_send_setup: setup send side
+ *
+ * Setup each channel with xbzrle encoding.  The first channel also
+ * creates the cache shared by all of them.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int xbzrle_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    size_t page_size = qemu_target_page_size();
+    struct xbzrle_data *z;
+
+    if (p->id == 0 && multifd_xbzrle_shards_setup(errp) < 0) {
+        return -1;
+    }
+
+    z = g_new0(struct xbzrle_data, 1);
+    p->data = z;
+    /* We will never have more than page_count pages */
+    z->zbuff_len = page_count * (sizeof(uint32_t) + page_size);
+    z->current_buf = g_try_malloc(page_size);
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!z->current_buf || !z->zbuff) {
+        g_free(z->current_buf);
+        g_free(z->zbuff);
+        g_free(z);
+        p->data = NULL;
+        error_setg(errp, "multifd %d: out of memory for zbuff", p->id);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * xbzrle_send_cleanup: cleanup send side
+ *
+ * Return memory.  The first channel also frees the shared cache; all
+ * the channel threads are gone by now.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void xbzrle_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    struct xbzrle_data *z = p->data;
+
+    if (p->id == 0) {
+        multifd_xbzrle_shards_cleanup();
+    }
+    if (!z) {
+        return;
+    }
+    g_free(z->current_buf);
+    z->current_buf = NULL;
+    g_free(z->zbuff);
+    z->zbuff = NULL;
+    g_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * xbzrle_send_prepare: prepare date to be able to send
+ *
+ * Encode every page against the cached copy of what was sent last
+ * time.  Pages that are not in the cache, or whose delta would not
+ * fit in a page, are sent whole.
+ *
+ * As in save_xbzrle_page(), the page is copied first, so that the
+ * cache always holds exactly what the destination received even if
+ * the guest is writing to it.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int xbzrle_send_prepare(MultiFDSendParams *p, uint32_t used,
+                               Error **errp)
+{
+    MultiFDPages_t *pages = p->pages;
+    struct xbzrle_data *z = p->data;
+    size_t page_size = qemu_target_page_size();
+    uint64_t age = ram_counters.dirty_sync_count;
+    uint64_t cache_miss = 0, encoded = 0, overflow = 0, bytes = 0;
+    uint8_t *out = z->zbuff;
+    uint32_t i;
+
+    for (i = 0; i < used; i++) {
+        ram_addr_t addr = pages->block->offset + pages->offset[i];
+        XBZRLEShard *shard = multifd_xbzrle_shard(addr);
+        uint8_t *prev_cached_page;
+        bool hit, full;
+        int len = -1;
+
+        memcpy(z->current_buf, pages->iov[i].iov_base, page_size);
+
+        qemu_mutex_lock(&shard->lock);
+        hit = cache_is_cached(shard->cache, addr, age);
+        if (!hit) {
+            cache_insert(shard->cache, addr, z->current_buf, age);
+        } else {
+            prev_cached_page = get_cached_data(shard->cache, addr);
+            len = xbzrle_encode_buffer(prev_cached_page, z->current_buf,
+                                       page_size, out + sizeof(uint32_t),
+                                       page_size);
+            if (len != 0) {
+                memcpy(prev_cached_page, z->current_buf, page_size);
+            }
+        }
+        qemu_mutex_unlock(&shard->lock);
+
+        full = len == -1;
+        if (full) {
+            stl_be_p(out, MULTIFD_XBZRLE_FULL_PAGE);
+            memcpy(out + sizeof(uint32_t), z->current_buf, page_size);
+            len = page_size;
+        } else {
+            stl_be_p(out, len);
+        }
+        out += sizeof(uint32_t) + len;
+
+        /* Same accounting as save_xbzrle_page() */
+        if (!hit) {
+            cache_miss++;
+        } else {
+            encoded++;
+            if (full) {
+                overflow++;
+            }
+            bytes += sizeof(uint32_t) + len;
+        }
+    }
+
+    qemu_mutex_lock(&multifd_xbzrle.stats_lock);
+    xbzrle_counters.cache_miss += cache_miss;
+    xbzrle_counters.pages += encoded;
+    xbzrle_counters.overflow += overflow;
+    xbzrle_counters.bytes += bytes;
+    qemu_mutex_unlock(&multifd_xbzrle.stats_lock);
+
+    p->next_packet_size = out - z->zbuff;
+    p->flags |= MULTIFD_FLAG_XBZRLE;
+
+    return 0;
+}
+
+/**
+ * xbzrle_send_write: do the actual write of the data
+ *
+ * Do the actual write of the encoded buffer.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int xbzrle_send_write(MultiFDSendParams *p, uint32_t used, Error **errp)
+{
+    struct xbzrle_data *z = p->data;
+
+    return qio_channel_write_all(p->c, (void *)z->zbuff, p->next_packet_size,
+                                 errp);
+}
+
+/**
+ * xbzrle_recv_setup: setup receive side
+ *
+ * Create the encoded buffer.  The destination doesn't need a cache,
+ * the deltas are applied directly to guest memory.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int xbzrle_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    struct xbzrle_data *z = g_new0(struct xbzrle_data, 1);
+
+    p->data = z;
+    /* We will never have more than page_count pages */
+    z->zbuff_len = page_count * (sizeof(uint32_t) + qemu_target_page_size());
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!z->zbuff) {
+        g_free(z);
+        p->data = NULL;
+        error_setg(errp, "multifd %d: out of memory for zbuff", p->id);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * xbzrle_recv_cleanup: cleanup receive side
+ *
+ * Return memory.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void xbzrle_recv_cleanup(MultiFDRecvParams *p)
+{
+    struct xbzrle_data *z = p->data;
+
+    if (!z) {
+        return;
+    }
+    g_free(z->zbuff);
+    z->zbuff = NULL;
+    g_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * xbzrle_recv_pages: read the data from the channel into actual pages
+ *
+ * Read the encoded buffer, and apply each delta to the page it
+ * belongs to.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int xbzrle_recv_pages(MultiFDRecvParams *p, uint32_t used, Error **errp)
+{
+    uint32_t in_size = p->next_packet_size;
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    size_t page_size = qemu_target_page_size();
+    struct xbzrle_data *z = p->data;
+    uint8_t *in, *end;
+    int ret;
+    int i;
+
+    if (flags != MULTIFD_FLAG_XBZRLE) {
+        error_setg(errp, "multifd %d: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_XBZRLE);
+        return -1;
+    }
+    if (in_size > z->zbuff_len) {
+        error_setg(errp, "multifd %d: packet size received %d too large",
+                   p->id, in_size);
+        return -1;
+    }
+    ret = qio_channel_read_all(p->c, (void *)z->zbuff, in_size, errp);
+
+    if (ret != 0) {
+        return ret;
+    }
+
+    in = z->zbuff;
+    end = z->zbuff + in_size;
+    for (i = 0; i < used; i++) {
+        void *page = p->pages->iov[i].iov_base;
+        uint32_t len;
+
+        if (end - in < sizeof(uint32_t)) {
+            goto truncated;
+        }
+        len = ldl_be_p(in);
+        in += sizeof(uint32_t);
+
+        if (len == MULTIFD_XBZRLE_FULL_PAGE) {
+            if (end - in < page_size) {
+                goto truncated;
+            }
+            memcpy(page, in, page_size);
+            in += page_size;
+            continue;
+        }
+        if (len > page_size || end - in < len) {
+            goto truncated;
+        }
+        if (len && xbzrle_decode_buffer(in, len, page, page_size) == -1) {
+            error_setg(errp, "multifd %d: xbzrle decode error in page %d",
+                       p->id, i);
+            return -1;
+        }
+        in += len;
+    }
+    if (in != end) {
+        error_setg(errp, "multifd %d: %td trailing bytes in packet",
+                   p->id, end - in);
+        return -1;
+    }
+    return 0;
+
+truncated:
+    error_setg(errp, "multifd %d: packet truncated at page %d", p->id, i);
+    return -1;
+}
+
+static MultiFDMethods multifd_xbzrle_ops = {
+    .send_setup = xbzrle_send_setup,
+    .send_cleanup = xbzrle_send_cleanup,
+    .send_prepare = xbzrle_send_prepare,
+    .send_write = xbzrle_send_write,
+    .recv_setup = xbzrle_recv_setup,
+    .recv_cleanup = xbzrle_recv_cleanup,
+    .recv_pages = xbzrle_recv_pages
+};
+
+static void multifd_xbzrle_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_XBZRLE, &multifd_xbzrle_ops);
+}
+
+migration_init(multifd_xbzrle_register);
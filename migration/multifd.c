@@ -12,6 +12,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/rcu.h"
+#include "qemu/cutils.h"
 #include "exec/target_page.h"
 #include "sysemu/sysemu.h"
 #include "exec/ramblock.h"
@@ -94,7 +95,9 @@ static int nocomp_send_prepare(MultiFDSendParams *p, uint32_t used,
 /**
  * nocomp_send_write: do the actual write of the data
  *
- * For no compression we just have to write the data.
+ * For no compression we just have to write the data.  With zero copy
+ * the pages are handed to the kernel directly, and the channel is
+ * flushed before the next sync point.
  *
  * Returns 0 for success or -1 for error
  *
@@ -104,7 +107,8 @@ static int nocomp_send_prepare(MultiFDSendParams *p, uint32_t used,
  */
 static int nocomp_send_write(MultiFDSendParams *p, uint32_t used, Error **errp)
 {
-    return qio_channel_writev_all(p->c, p->pages->iov, used, errp);
+    return qio_channel_writev_full_all(p->c, p->pages->iov, used, NULL, 0,
+                                       p->write_flags, errp);
 }
 
 /**
@@ -252,6 +256,7 @@ static MultiFDPages_t *multifd_pages_init(size_t size)
 static void multifd_pages_clear(MultiFDPages_t *pages)
 {
     pages->used = 0;
+    pages->zero_num = 0;
     pages->allocated = 0;
     pages->packet_num = 0;
     pages->block = NULL;
@@ -262,6 +267,59 @@ static void multifd_pages_clear(MultiFDPages_t *pages)
     g_free(pages);
 }
 
+/**
+ * multifd_send_zero_page_detect: move zero pages to the end of @pages
+ *
+ * Pages that only contain zeros are not sent, only their offsets are.
+ * They are moved after the used pages, and @pages->used is updated to
+ * only count the pages that contain data.
+ *
+ * @pages: pages owned by the channel thread
+ */
+static void multifd_send_zero_page_detect(MultiFDPages_t *pages)
+{
+    uint32_t i = 0;
+    uint32_t normal = pages->used;
+
+    while (i < normal) {
+        if (buffer_is_zero(pages->iov[i].iov_base, pages->iov[i].iov_len)) {
+            struct iovec iov = pages->iov[i];
+            ram_addr_t offset = pages->offset[i];
+
+            normal--;
+            pages->iov[i] = pages->iov[normal];
+            pages->offset[i] = pages->offset[normal];
+            pages->iov[normal] = iov;
+            pages->offset[normal] = offset;
+        } else {
+            i++;
+        }
+    }
+
+    pages->zero_num = pages->used - normal;
+    pages->used = normal;
+}
+
+/**
+ * multifd_recv_zero_pages: clear the zero pages of a packet
+ *
+ * Pages that already read as zero are not written, so that guest
+ * memory that has never been touched on the destination stays
+ * unallocated.
+ *
+ * @pages: pages of the packet that was just received
+ */
+static void multifd_recv_zero_pages(MultiFDPages_t *pages)
+{
+    uint32_t i;
+
+    for (i = pages->used; i < pages->used + pages->zero_num; i++) {
+        if (!buffer_is_zero(pages->iov[i].iov_base, pages->iov[i].iov_len)) {
+            memset(pages->iov[i].iov_base, 0, pages->iov[i].iov_len);
+        }
+    }
+}
+
 static void multifd_send_fill_packet(MultiFDSendParams *p)
 {
     MultiFDPacket_t *packet = p->packet;
@@ -270,6 +328,7 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
     packet->flags = cpu_to_be32(p->flags);
     packet->pages_alloc = cpu_to_be32(p->pages->allocated);
     packet->pages_used = cpu_to_be32(p->pages->used);
+    packet->zero_pages = cpu_to_be32(p->pages->zero_num);
     packet->next_packet_size = cpu_to_be32(p->next_packet_size);
     packet->packet_num = cpu_to_be64(p->packet_num);
 
@@ -277,7 +336,7 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
         strncpy(packet->ramblock, p->pages->block->idstr, 256);
     }
 
-    for (i = 0; i < p->pages->used; i++) {
+    for (i = 0; i < p->pages->used + p->pages->zero_num; i++) {
         /* there are architectures where ram_addr_t is 32 bit */
         uint64_t temp = p->pages->offset[i];
 
@@ -331,17 +390,20 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     }
 
     p->pages->used = be32_to_cpu(packet->pages_used);
-    if (p->pages->used > packet->pages_alloc) {
+    p->pages->zero_num = be32_to_cpu(packet->zero_pages);
+    if (p->pages->used > packet->pages_alloc ||
+        p->pages->zero_num > packet->pages_alloc - p->pages->used) {
         error_setg(errp, "multifd: received packet "
-                   "with %d pages and expected maximum pages are %d",
-                   p->pages->used, packet->pages_alloc) ;
+                   "with %d pages and %d zero pages and expected maximum "
+                   "pages are %d", p->pages->used, p->pages->zero_num,
+                   packet->pages_alloc);
         return -1;
     }
 
     p->next_packet_size = be32_to_cpu(packet->next_packet_size);
     p->packet_num = be64_to_cpu(packet->packet_num);
 
-    if (p->pages->used == 0) {
+    if (p->pages->used + p->pages->zero_num == 0) {
         return 0;
     }
 
@@ -354,7 +416,7 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
-    for (i = 0; i < p->pages->used; i++) {
+    for (i = 0; i < p->pages->used + p->pages->zero_num; i++) {
         uint64_t offset = be64_to_cpu(packet->offset[i]);
 
         if (offset > (block->used_length - qemu_target_page_size())) {
@@ -406,6 +468,30 @@ struct {
  * false.
  */
 
+/**
+ * multifd_send_account_data: charge page data sent by a channel
+ *
+ * With zero page detection the channel only knows which pages contain
+ * data once it has scanned them.  Zero pages must not be charged to the
+ * rate limit, the same way save_zero_page() only charges its header, so
+ * the data is accounted for the next time the migration thread hands
+ * work to the channel or syncs with it.
+ *
+ * Called with @p->mutex held.
+ *
+ * @f: QEMUFile used for rate limiting
+ * @p: channel parameters
+ */
+static void multifd_send_account_data(QEMUFile *f, MultiFDSendParams *p)
+{
+    uint64_t transferred = p->unaccounted_bytes;
+
+    p->unaccounted_bytes = 0;
+    qemu_file_update_transfer(f, transferred);
+    ram_counters.multifd_bytes += transferred;
+    ram_counters.transferred += transferred;
+}
+
 static int multifd_send_pages(QEMUFile *f)
 {
     int i;
@@ -447,8 +533,14 @@ static int multifd_send_pages(QEMUFile *f)
     p->packet_num = multifd_send_state->packet_num++;
     multifd_send_state->pages = p->pages;
     p->pages = pages;
-    transferred = ((uint64_t) pages->used) * qemu_target_page_size()
-                + p->packet_len;
+    if (migrate_use_multifd_zero_page()) {
+        /* The page data is charged once the channel has scanned it */
+        multifd_send_account_data(f, p);
+        transferred = p->packet_len;
+    } else {
+        transferred = ((uint64_t) pages->used) * qemu_target_page_size()
+                    + p->packet_len;
+    }
     qemu_file_update_transfer(f, transferred);
     ram_counters.multifd_bytes += transferred;
     ram_counters.transferred += transferred;
@@ -530,7 +622,7 @@ void multifd_save_cleanup(void)
 {
     int i;
 
-    if (!migrate_use_multifd()) {
+    if (!migrate_use_multifd() || !multifd_send_state) {
         return;
     }
     multifd_send_terminate_threads(NULL);
@@ -611,9 +703,23 @@ void multifd_send_sync_main(QEMUFile *f)
     }
     for (i = 0; i < migrate_multifd_channels(); i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
+        uint64_t zero;
 
         trace_multifd_send_sync_main_wait(p->id);
         qemu_sem_wait(&p->sem_sync);
+
+        /*
+         * Zero pages found by the channel were accounted as normal
+         * pages when they were queued; fix up the counters.
+         */
+        qemu_mutex_lock(&p->mutex);
+        zero = p->num_zero_pages;
+        p->num_zero_pages = 0;
+        multifd_send_account_data(f, p);
+        qemu_mutex_unlock(&p->mutex);
+
+        ram_counters.normal -= zero;
+        ram_counters.duplicate += zero;
     }
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
 }
@@ -644,10 +750,16 @@ static void *multifd_send_thread(void *opaque)
         qemu_mutex_lock(&p->mutex);
 
         if (p->pending_job) {
-            uint32_t used = p->pages->used;
+            uint32_t used, zero;
             uint64_t packet_num = p->packet_num;
             flags = p->flags;
 
+            if (p->pages->used && migrate_use_multifd_zero_page()) {
+                multifd_send_zero_page_detect(p->pages);
+            }
+            used = p->pages->used;
+            zero = p->pages->zero_num;
+
             if (used) {
                 ret = multifd_send_state->ops->send_prepare(p, used,
                                                             &local_err);
@@ -659,12 +771,18 @@ static void *multifd_send_thread(void *opaque)
             multifd_send_fill_packet(p);
             p->flags = 0;
             p->num_packets++;
-            p->num_pages += used;
+            p->num_pages += used + zero;
+            p->num_zero_pages += zero;
+            if (migrate_use_multifd_zero_page()) {
+                p->unaccounted_bytes +=
+                    (uint64_t)used * qemu_target_page_size();
+            }
             p->pages->used = 0;
+            p->pages->zero_num = 0;
             p->pages->block = NULL;
             qemu_mutex_unlock(&p->mutex);
 
-            trace_multifd_send(p->id, packet_num, used, flags,
+            trace_multifd_send(p->id, packet_num, used, zero, flags,
                                p->next_packet_size);
 
             ret = qio_channel_write_all(p->c, (void *)p->packet,
@@ -680,6 +798,24 @@ static void *multifd_send_thread(void *opaque)
                 }
             }
 
+            /*
+             * Pages sent with zero copy are read by the kernel after
+             * sendmsg() returns.  Wait for them to be on the wire before
+             * the sync, so that nothing from this round of the dirty
+             * bitmap is still pending when the next one starts.
+             */
+            if ((flags & MULTIFD_FLAG_SYNC) &&
+                (p->write_flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY)) {
+                ret = qio_channel_flush(p->c, &local_err);
+                if (ret < 0) {
+                    break;
+                }
+                if (ret == 1) {
+                    trace_multifd_send_zero_copy_fallback(p->id);
+                }
+                ret = 0;
+            }
+
             qemu_mutex_lock(&p->mutex);
             p->pending_job--;
             qemu_mutex_unlock(&p->mutex);
@@ -802,6 +938,12 @@ static bool multifd_channel_connect(MultiFDSendParams *p,
             } else {
                 return true;
             }
+        } else if ((p->write_flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY) &&
+                   !qio_channel_has_feature(ioc,
+                                        QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+            error_setg(&error, "multifd: channel does not support zero copy "
+                       "send");
+            return true;
         } else {
             /* update for tls qio channel */
             p->c = ioc;
@@ -865,6 +1007,27 @@ int multifd_save_setup(Error **errp)
         return 0;
     }
     s = migrate_get_current();
+    if (migrate_use_zero_copy_send()) {
+        if (migrate_multifd_compression() != MULTIFD_COMPRESSION_NONE) {
+            error_setg(errp, "Zero copy send is not compatible with "
+                       "multifd compression");
+            return -1;
+        }
+        if (s->parameters.tls_creds && *s->parameters.tls_creds) {
+            error_setg(errp, "Zero copy send is not compatible with TLS");
+            return -1;
+        }
+    }
+    /*
+     * xbzrle needs to see every page to keep its cache in sync with
+     * the destination; zero pages found by the channels bypass it.
+     */
+    if (migrate_multifd_compression() == MULTIFD_COMPRESSION_XBZRLE &&
+        migrate_use_multifd_zero_page()) {
+        error_setg(errp, "multifd-zero-page is not compatible with "
+                   "xbzrle multifd compression");
+        return -1;
+    }
     thread_count = migrate_multifd_channels();
     multifd_send_state = g_malloc0(sizeof(*multifd_send_state));
     multifd_send_state->params = g_new0(MultiFDSendParams, thread_count);
@@ -890,6 +1053,8 @@ int multifd_save_setup(Error **errp)
         p->packet->version = cpu_to_be32(MULTIFD_VERSION);
         p->name = g_strdup_printf("multifdsend_%d", i);
         p->tls_hostname = g_strdup(s->hostname);
+        p->write_flags = migrate_use_zero_copy_send() ?
+                         QIO_CHANNEL_WRITE_FLAG_ZERO_COPY : 0;
         socket_send_channel_create(multifd_new_send_channel_async, p);
     }
 
@@ -1043,7 +1208,7 @@ static void *multifd_recv_thread(void *opaque)
     rcu_register_thread();
 
     while (true) {
-        uint32_t used;
+        uint32_t used, zero;
         uint32_t flags;
 
         if (p->quit) {
@@ -1067,13 +1232,14 @@ static void *multifd_recv_thread(void *opaque)
         }
 
         used = p->pages->used;
+        zero = p->pages->zero_num;
         flags = p->flags;
         /* recv methods don't know how to handle the SYNC flag */
         p->flags &= ~MULTIFD_FLAG_SYNC;
-        trace_multifd_recv(p->id, p->packet_num, used, flags,
+        trace_multifd_recv(p->id, p->packet_num, used, zero, flags,
                            p->next_packet_size);
         p->num_packets++;
-        p->num_pages += used;
+        p->num_pages += used + zero;
         qemu_mutex_unlock(&p->mutex);
 
         if (used) {
@@ -1083,6 +1249,10 @@ static void *multifd_recv_thread(void *opaque)
             }
         }
 
+        if (zero) {
+            multifd_recv_zero_pages(p->pages);
+        }
+
         if (flags & MULTIFD_FLAG_SYNC) {
             qemu_sem_post(&multifd_recv_state->sem_sync);
             qemu_sem_wait(&p->sem_sync);
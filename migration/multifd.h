@@ -22,6 +22,7 @@ bool multifd_recv_new_channel(QIOChannel *ioc, Error **errp);
 void multifd_recv_sync_main(void);
 void multifd_send_sync_main(QEMUFile *f);
 int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset);
+void multifd_xbzrle_cache_zero_page(ram_addr_t addr);
 
 /* Multifd Compression flags */
 #define MULTIFD_FLAG_SYNC (1 << 0)
@@ -32,6 +33,8 @@ int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset);
 #define MULTIFD_FLAG_NOCOMP (0 << 1)
 #define MULTIFD_FLAG_ZLIB (1 << 1)
 #define MULTIFD_FLAG_ZSTD (2 << 1)
+#define MULTIFD_FLAG_LZ4 (3 << 1)
+#define MULTIFD_FLAG_XBZRLE (4 << 1)
 
 /* This value needs to be a multiple of qemu_target_page_size() */
 #define MULTIFD_PACKET_SIZE (512 * 1024)
@@ -42,11 +45,15 @@ typedef struct {
     uint32_t flags;
     /* maximum number of allocated pages */
     uint32_t pages_alloc;
+    /* number of pages with data, their offsets come first */
     uint32_t pages_used;
     /* size of the next packet that contains pages */
     uint32_t next_packet_size;
     uint64_t packet_num;
-    uint64_t unused[4];    /* Reserved for future use */
+    /* number of zero pages, their offsets follow the ones with data */
+    uint32_t zero_pages;
+    uint32_t unused32[1];  /* Reserved for future use */
+    uint64_t unused64[3];  /* Reserved for future use */
     char ramblock[256];
     uint64_t offset[];
 } __attribute__((packed)) MultiFDPacket_t;
@@ -54,6 +61,8 @@ typedef struct {
 typedef struct {
     /* number of used pages */
     uint32_t used;
+    /* number of zero pages, stored after the used ones */
+    uint32_t zero_num;
     /* number of allocated pages */
     uint32_t allocated;
     /* global number of generated multifd packets */
@@ -73,6 +82,8 @@ typedef struct {
     char *name;
     /* tls hostname */
     char *tls_hostname;
+    /* QIO_CHANNEL_WRITE_FLAG_* used for the page data */
+    int write_flags;
     /* channel thread id */
     QemuThread thread;
     /* communication channel */
@@ -104,6 +115,13 @@ typedef struct {
     uint64_t num_packets;
     /* pages sent through this channel */
     uint64_t num_pages;
+    /* zero pages found since the last sync, protected by mutex */
+    uint64_t num_zero_pages;
+    /*
+     * bytes of page data sent since the migration thread last accounted
+     * for them, protected by mutex; only used with zero page detection
+     */
+    uint64_t unaccounted_bytes;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
     /* used for compression methods */
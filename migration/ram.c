@@ -666,7 +666,16 @@ static void mig_throttle_guest_down(uint64_t bytes_dirty_period,
  */
 static void xbzrle_cache_zero_page(RAMState *rs, ram_addr_t current_addr)
 {
-    if (rs->ram_bulk_stage || !migrate_use_xbzrle()) {
+    if (rs->ram_bulk_stage) {
+        return;
+    }
+
+    if (migrate_use_multifd_xbzrle()) {
+        multifd_xbzrle_cache_zero_page(current_addr);
+        return;
+    }
+
+    if (!migrate_use_xbzrle()) {
         return;
     }
 
@@ -907,7 +916,7 @@ static void migration_update_rates(RAMState *rs, int64_t end_time)
         return;
     }
 
-    if (migrate_use_xbzrle()) {
+    if (migrate_use_xbzrle() || migrate_use_multifd_xbzrle()) {
         double encoded_size, unencoded_size;
 
         xbzrle_counters.cache_miss_rate = (double)(xbzrle_counters.cache_miss -
@@ -1941,6 +1950,15 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         return 1;
     }
 
+    /*
+     * With multifd zero page detection the channel threads check for
+     * zero pages, so don't scan the page here.
+     */
+    if (migrate_use_multifd_zero_page() && !save_page_use_compression(rs) &&
+        migrate_use_multifd() && !migration_in_postcopy()) {
+        return ram_save_multifd_page(rs, block, offset);
+    }
+
     res = save_zero_page(rs, block, offset);
     if (res > 0) {
         /* Must let xbzrle know, otherwise a previous (now 0'd) cached
@@ -17,5 +17,15 @@
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 
+/* Portable implementation, used as the reference by the unit tests */
+int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                             uint8_t *dst, int dlen);
+
+/*
+ * Switch xbzrle_encode_buffer() to the next slower accelerated
+ * implementation.  Returns false once the portable one is in use.
+ */
+bool test_xbzrle_encode_next_accel(void);
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
 #endif
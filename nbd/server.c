@@ -19,13 +19,19 @@
 
 #include "qemu/osdep.h"
 
+#include "block/block-status-map.h"
 #include "block/export.h"
+#include "block/thread-pool.h"
 #include "qapi/error.h"
 #include "qemu/queue.h"
 #include "trace.h"
 #include "nbd-internal.h"
 #include "qemu/units.h"
 
+#ifdef CONFIG_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
 #define NBD_META_ID_BASE_ALLOCATION 0
 #define NBD_META_ID_ALLOCATION_DEPTH 1
 /* Dirty bitmaps use 'NBD_META_ID_DIRTY_BITMAP + i', so keep this id last. */
@@ -36,8 +42,16 @@
  * constant. If an increase is needed, note that the NBD protocol
  * recommends no larger than 32 mb, so that the client won't consider
  * the reply as a denial of service attack.
+ *
+ * NBD_MAX_CACHED_BLOCK_STATUS_EXTENTS: 16 MiB of extents data, used when
+ * the export caches block status.  Most of the extents then come from the
+ * cache, so a whole fragmented image can be mapped with few requests.
+ *
+ * The extent arrays only grow as far as needed.
  */
 #define NBD_MAX_BLOCK_STATUS_EXTENTS (1 * MiB / 8)
+#define NBD_MAX_CACHED_BLOCK_STATUS_EXTENTS (16 * MiB / 8)
+#define NBD_MIN_BLOCK_STATUS_EXTENTS 64
 
 static int system_errno_to_nbd_errno(int err)
 {
@@ -99,6 +113,14 @@ struct NBDExport {
     bool allocation_depth;
     BdrvDirtyBitmap **export_bitmaps;
     size_t nr_export_bitmaps;
+
+    /* Image file and a descriptor for it, if reads use sendfile() */
+    BlockDriverState *zero_copy_bs;
+    int zero_copy_fd;
+
+    /* Cached base:allocation status of status_bs, tracking its writes */
+    BlockDriverState *status_bs;
+    BlockStatusMap *status_map;
 };
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
@@ -1594,6 +1616,36 @@ void nbd_export_set_on_eject_blk(BlockExport *exp, BlockBackend *blk)
     blk_add_remove_bs_notifier(blk, &nbd_exp->eject_notifier);
 }
 
+/*
+ * Return the "file" node that holds the export's data, if reads can be
+ * served from it directly.  A raw node without offset or size is only a
+ * pass-through and can be skipped; any other node might change the data.
+ */
+static BlockDriverState *nbd_zero_copy_file(BlockDriverState *bs)
+{
+    if (bs && bs->drv && !strcmp(bs->drv->format_name, "raw") &&
+        bs->file && (bs->file->role & BDRV_CHILD_FILTERED))
+    {
+        bs = bs->file->bs;
+    }
+
+    if (!bs || !bs->drv || strcmp(bs->drv->format_name, "file")) {
+        return NULL;
+    }
+    return bs;
+}
+
+static void nbd_export_free_status_map(NBDExport *exp)
+{
+    if (!exp->status_bs) {
+        return;
+    }
+    bdrv_block_status_map_free(exp->status_map);
+    bdrv_unref(exp->status_bs);
+    exp->status_map = NULL;
+    exp->status_bs = NULL;
+}
+
 static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
                              Error **errp)
 {
@@ -1603,7 +1655,6 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
     int64_t size;
     uint64_t perm, shared_perm;
     bool readonly = !exp_args->writable;
-    bool shared = !exp_args->writable;
     strList *bitmaps;
     size_t i;
     int ret;
@@ -1650,21 +1701,83 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
     }
 
     QTAILQ_INIT(&exp->clients);
+    exp->zero_copy_fd = -1;
     exp->name = g_strdup(arg->name);
     exp->description = g_strdup(arg->description);
     exp->nbdflags = (NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH |
                      NBD_FLAG_SEND_FUA | NBD_FLAG_SEND_CACHE);
+    /*
+     * Every connection uses exp->common.blk, so a flush from any of them
+     * covers the writes that any other one has completed.
+     */
+    if (arg->multi_conn == ON_OFF_AUTO_ON ||
+        (arg->multi_conn == ON_OFF_AUTO_AUTO && readonly)) {
+        exp->nbdflags |= NBD_FLAG_CAN_MULTI_CONN;
+    }
     if (readonly) {
         exp->nbdflags |= NBD_FLAG_READ_ONLY;
-        if (shared) {
-            exp->nbdflags |= NBD_FLAG_CAN_MULTI_CONN;
-        }
     } else {
         exp->nbdflags |= (NBD_FLAG_SEND_TRIM | NBD_FLAG_SEND_WRITE_ZEROES |
                           NBD_FLAG_SEND_FAST_ZERO);
     }
     exp->size = QEMU_ALIGN_DOWN(size, BDRV_SECTOR_SIZE);
 
+    if (arg->zero_copy) {
+#ifdef CONFIG_SENDFILE
+        struct stat bs_st, fd_st;
+
+        exp->zero_copy_bs = nbd_zero_copy_file(blk_bs(blk));
+        if (!exp->zero_copy_bs) {
+            error_setg(errp, "zero-copy requires a raw image in a local file");
+            ret = -EINVAL;
+            goto fail;
+        }
+        exp->zero_copy_fd = qemu_open(exp->zero_copy_bs->filename, O_RDONLY,
+                                      errp);
+        if (exp->zero_copy_fd < 0) {
+            exp->zero_copy_bs = NULL;
+            ret = -EINVAL;
+            goto fail;
+        }
+        bdrv_ref(exp->zero_copy_bs);
+
+        /* The path may name a different file by now */
+        ret = bdrv_fstat(exp->zero_copy_bs, &bs_st);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not stat the image file");
+            goto fail;
+        }
+        if (fstat(exp->zero_copy_fd, &fd_st) < 0) {
+            ret = -errno;
+            error_setg_errno(errp, errno, "Could not stat the image file");
+            goto fail;
+        }
+        if (fd_st.st_dev != bs_st.st_dev || fd_st.st_ino != bs_st.st_ino) {
+            error_setg(errp, "zero-copy: '%s' is no longer the image file",
+                       exp->zero_copy_bs->filename);
+            ret = -EINVAL;
+            goto fail;
+        }
+#else
+        error_setg(errp, "zero-copy is not supported on this host");
+        ret = -ENOTSUP;
+        goto fail;
+#endif
+    }
+
+    if (arg->block_status_cache) {
+        BlockDriverState *bs = blk_bs(blk);
+
+        exp->status_map = bdrv_block_status_map_new(bs, NULL, exp->size,
+                                                    true, errp);
+        if (!exp->status_map) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        exp->status_bs = bs;
+        bdrv_ref(exp->status_bs);
+    }
+
     for (bitmaps = arg->bitmaps; bitmaps; bitmaps = bitmaps->next) {
         exp->nr_export_bitmaps++;
     }
@@ -1722,6 +1835,11 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
     return 0;
 
 fail:
+    nbd_export_free_status_map(exp);
+    if (exp->zero_copy_fd >= 0) {
+        qemu_close(exp->zero_copy_fd);
+        bdrv_unref(exp->zero_copy_bs);
+    }
     g_free(exp->export_bitmaps);
     g_free(exp->name);
     g_free(exp->description);
@@ -1793,6 +1911,12 @@ static void nbd_export_delete(BlockExport *blk_exp)
     for (i = 0; i < exp->nr_export_bitmaps; i++) {
         bdrv_dirty_bitmap_set_busy(exp->export_bitmaps[i], false);
     }
+
+    nbd_export_free_status_map(exp);
+    if (exp->zero_copy_fd >= 0) {
+        qemu_close(exp->zero_copy_fd);
+        bdrv_unref(exp->zero_copy_bs);
+    }
 }
 
 const BlockExportDriver blk_exp_nbd = {
@@ -1820,6 +1944,109 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     return ret;
 }
 
+/*
+ * Whether read data for @client can be sent straight from the image file.
+ * The graph may have changed since the export was created, so check that
+ * the file is still the one that holds the data.
+ */
+static bool nbd_client_zero_copy(NBDClient *client)
+{
+    NBDExport *exp = client->exp;
+
+    return exp->zero_copy_fd >= 0 &&
+           client->ioc == QIO_CHANNEL(client->sioc) &&
+           nbd_zero_copy_file(blk_bs(exp->common.blk)) == exp->zero_copy_bs;
+}
+
+#ifdef CONFIG_SENDFILE
+typedef struct NBDSendfileData {
+    int sockfd;
+    int fd;
+    off_t offset;
+    size_t len;
+} NBDSendfileData;
+
+/*
+ * Runs in a worker thread, so that page cache misses do not block the
+ * export's AioContext.  The caller holds send_lock, so nothing else
+ * writes to the socket in the meantime.
+ */
+static int nbd_sendfile_worker(void *opaque)
+{
+    NBDSendfileData *data = opaque;
+
+    while (data->len) {
+        ssize_t ret = sendfile(data->sockfd, data->fd, &data->offset,
+                               data->len);
+
+        if (ret < 0) {
+            if (errno == EAGAIN) {
+                GPollFD pfd = { .fd = data->sockfd, .events = G_IO_OUT };
+
+                g_poll(&pfd, 1, -1);
+                continue;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        } else if (ret == 0) {
+            /* The image file was truncated under our feet */
+            return -EIO;
+        }
+        data->len -= ret;
+    }
+
+    return 0;
+}
+#endif
+
+/*
+ * Send @iov followed by @len bytes of the image file at @offset.  Only
+ * used if nbd_client_zero_copy() is true.
+ */
+static int coroutine_fn nbd_co_send_iov_file(NBDClient *client,
+                                             struct iovec *iov, unsigned niov,
+                                             uint64_t offset, size_t len,
+                                             Error **errp)
+{
+#ifdef CONFIG_SENDFILE
+    NBDExport *exp = client->exp;
+    NBDSendfileData data = {
+        .sockfd = client->sioc->fd,
+        .fd = exp->zero_copy_fd,
+        .offset = offset,
+        .len = len,
+    };
+    int ret;
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+
+    qio_channel_set_cork(client->ioc, true);
+    ret = qio_channel_writev_all(client->ioc, iov, niov, errp) < 0 ? -EIO : 0;
+    if (ret == 0) {
+        /* Draining the export must wait for reads that bypass the blk */
+        blk_inc_in_flight(exp->common.blk);
+        ret = thread_pool_submit_co(aio_get_thread_pool(exp->common.ctx),
+                                    nbd_sendfile_worker, &data);
+        blk_dec_in_flight(exp->common.blk);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "sending data from file failed");
+            ret = -EIO;
+        }
+    }
+    qio_channel_set_cork(client->ioc, false);
+
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+
+    return ret;
+#else
+    g_assert_not_reached();
+#endif
+}
+
 static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
                                        uint64_t handle)
 {
@@ -1828,9 +2055,14 @@ static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
     stq_be_p(&reply->handle, handle);
 }
 
+/*
+ * If @data is NULL but @len is not zero, the payload is sent straight from
+ * the image file at @offset.
+ */
 static int nbd_co_send_simple_reply(NBDClient *client,
                                     uint64_t handle,
                                     uint32_t error,
+                                    uint64_t offset,
                                     void *data,
                                     size_t len,
                                     Error **errp)
@@ -1846,6 +2078,9 @@ static int nbd_co_send_simple_reply(NBDClient *client,
                                    len);
     set_be_simple_reply(&reply, nbd_err, handle);
 
+    if (!data && len) {
+        return nbd_co_send_iov_file(client, iov, 1, offset, len, errp);
+    }
     return nbd_co_send_iov(client, iov, len ? 2 : 1, errp);
 }
 
@@ -1874,6 +2109,7 @@ static int coroutine_fn nbd_co_send_structured_done(NBDClient *client,
     return nbd_co_send_iov(client, iov, 1, errp);
 }
 
+/* If @data is NULL, the payload is sent straight from the image file */
 static int coroutine_fn nbd_co_send_structured_read(NBDClient *client,
                                                     uint64_t handle,
                                                     uint64_t offset,
@@ -1895,6 +2131,9 @@ static int coroutine_fn nbd_co_send_structured_read(NBDClient *client,
                  sizeof(chunk) - sizeof(chunk.h) + size);
     stq_be_p(&chunk.offset, offset);
 
+    if (!data) {
+        return nbd_co_send_iov_file(client, iov, 1, offset, size, errp);
+    }
     return nbd_co_send_iov(client, iov, 2, errp);
 }
 
@@ -1926,16 +2165,34 @@ static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
  * Returns -errno if sending fails. bdrv_block_status_above() failure is
  * reported to the client, at which point this function succeeds.
  */
+/*
+ * Return the buffer for the data of the read @req.  It was not allocated
+ * if the request was received for zero-copy; allocate it now, because the
+ * graph of the export has changed since.
+ */
+static uint8_t *nbd_request_buffer(NBDRequestData *req, size_t size,
+                                   Error **errp)
+{
+    if (!req->data) {
+        req->data = blk_try_blockalign(req->client->exp->common.blk, size);
+        if (!req->data) {
+            error_setg(errp, "No memory");
+        }
+    }
+    return req->data;
+}
+
 static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
                                                 uint64_t handle,
                                                 uint64_t offset,
-                                                uint8_t *data,
+                                                NBDRequestData *req,
                                                 size_t size,
                                                 Error **errp)
 {
     int ret = 0;
     NBDExport *exp = client->exp;
     size_t progress = 0;
+    uint8_t *data;
 
     while (progress < size) {
         int64_t pnum;
@@ -1970,7 +2227,15 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
             stq_be_p(&chunk.offset, offset + progress);
             stl_be_p(&chunk.length, pnum);
             ret = nbd_co_send_iov(client, iov, 1, errp);
+        } else if (nbd_client_zero_copy(client)) {
+            ret = nbd_co_send_structured_read(client, handle, offset + progress,
+                                              NULL, pnum, final, errp);
         } else {
+            data = nbd_request_buffer(req, size, errp);
+            if (!data) {
+                ret = -ENOMEM;
+                break;
+            }
             ret = blk_pread(exp->common.blk, offset + progress,
                             data + progress, pnum);
             if (ret < 0) {
@@ -1992,6 +2257,7 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
 
 typedef struct NBDExtentArray {
     NBDExtent *extents;
+    unsigned int nb_max;
     unsigned int nb_alloc;
     unsigned int count;
     uint64_t total_length;
@@ -1999,12 +2265,14 @@ typedef struct NBDExtentArray {
     bool converted_to_be;
 } NBDExtentArray;
 
-static NBDExtentArray *nbd_extent_array_new(unsigned int nb_alloc)
+/* @nb_max is the maximum number of extents, the array grows up to it */
+static NBDExtentArray *nbd_extent_array_new(unsigned int nb_max)
 {
     NBDExtentArray *ea = g_new0(NBDExtentArray, 1);
 
-    ea->nb_alloc = nb_alloc;
-    ea->extents = g_new(NBDExtent, nb_alloc);
+    ea->nb_max = nb_max;
+    ea->nb_alloc = MIN(nb_max, NBD_MIN_BLOCK_STATUS_EXTENTS);
+    ea->extents = g_new(NBDExtent, ea->nb_alloc);
     ea->can_add = true;
 
     return ea;
@@ -2062,10 +2330,14 @@ static int nbd_extent_array_add(NBDExtentArray *ea,
         }
     }
 
-    if (ea->count >= ea->nb_alloc) {
+    if (ea->count >= ea->nb_max) {
         ea->can_add = false;
         return -1;
     }
+    if (ea->count >= ea->nb_alloc) {
+        ea->nb_alloc = MIN((uint64_t)ea->nb_alloc * 2, ea->nb_max);
+        ea->extents = g_renew(NBDExtent, ea->extents, ea->nb_alloc);
+    }
 
     ea->total_length += length;
     ea->extents[ea->count] = (NBDExtent) {.length = length, .flags = flags};
@@ -2074,14 +2346,22 @@ static int nbd_extent_array_add(NBDExtentArray *ea,
     return 0;
 }
 
-static int blockstatus_to_extents(BlockDriverState *bs, uint64_t offset,
-                                  uint64_t bytes, NBDExtentArray *ea)
+/* If @map is not NULL, it is used instead of querying @bs */
+static int blockstatus_to_extents(BlockDriverState *bs, BlockStatusMap *map,
+                                  uint64_t offset, uint64_t bytes,
+                                  NBDExtentArray *ea)
 {
     while (bytes) {
         uint32_t flags;
         int64_t num;
-        int ret = bdrv_block_status_above(bs, NULL, offset, bytes, &num,
+        int ret;
+
+        if (map) {
+            ret = bdrv_block_status_map_get(map, offset, bytes, &num);
+        } else {
+            ret = bdrv_block_status_above(bs, NULL, offset, bytes, &num,
                                           NULL, NULL);
+        }
 
         if (ret < 0) {
             return ret;
@@ -2152,6 +2432,20 @@ static int nbd_co_send_extents(NBDClient *client, uint64_t handle,
     return nbd_co_send_iov(client, iov, 2, errp);
 }
 
+/*
+ * Return the status map of @exp if it caches the status of @bs.  The map
+ * tracks writes to the node, so a reply reflects every write that
+ * completed before the request.
+ */
+static BlockStatusMap *nbd_export_status_map(NBDExport *exp,
+                                             BlockDriverState *bs)
+{
+    if (!exp->status_map || bs != exp->status_bs) {
+        return NULL;
+    }
+    return exp->status_map;
+}
+
 /* Get block status from the exported device and send it to the client */
 static int nbd_co_send_block_status(NBDClient *client, uint64_t handle,
                                     BlockDriverState *bs, uint64_t offset,
@@ -2160,11 +2454,24 @@ static int nbd_co_send_block_status(NBDClient *client, uint64_t handle,
                                     Error **errp)
 {
     int ret;
-    unsigned int nb_extents = dont_fragment ? 1 : NBD_MAX_BLOCK_STATUS_EXTENTS;
-    g_autoptr(NBDExtentArray) ea = nbd_extent_array_new(nb_extents);
+    BlockStatusMap *map = NULL;
+    unsigned int nb_extents;
+    g_autoptr(NBDExtentArray) ea = NULL;
+
+    if (context_id == NBD_META_ID_BASE_ALLOCATION) {
+        map = nbd_export_status_map(client->exp, bs);
+    }
+    if (dont_fragment) {
+        nb_extents = 1;
+    } else if (map) {
+        nb_extents = NBD_MAX_CACHED_BLOCK_STATUS_EXTENTS;
+    } else {
+        nb_extents = NBD_MAX_BLOCK_STATUS_EXTENTS;
+    }
+    ea = nbd_extent_array_new(nb_extents);
 
     if (context_id == NBD_META_ID_BASE_ALLOCATION) {
-        ret = blockstatus_to_extents(bs, offset, length, ea);
+        ret = blockstatus_to_extents(bs, map, offset, length, ea);
     } else {
         ret = blockalloc_to_extents(bs, offset, length, ea);
     }
@@ -2265,7 +2572,10 @@ static int nbd_co_receive_request(NBDRequestData *req, NBDRequest *request,
             return -EINVAL;
         }
 
-        if (request->type != NBD_CMD_CACHE) {
+        /* Reads that use sendfile() allocate a buffer only if they must */
+        if (request->type == NBD_CMD_WRITE ||
+            (request->type == NBD_CMD_READ && !nbd_client_zero_copy(client)))
+        {
             req->data = blk_try_blockalign(client->exp->common.blk,
                                            request->len);
             if (req->data == NULL) {
@@ -2346,7 +2656,7 @@ static coroutine_fn int nbd_send_generic_reply(NBDClient *client,
                                             errp);
     } else {
         return nbd_co_send_simple_reply(client, handle, ret < 0 ? -ret : 0,
-                                        NULL, 0, errp);
+                                        0, NULL, 0, errp);
     }
 }
 
@@ -2354,10 +2664,11 @@ static coroutine_fn int nbd_send_generic_reply(NBDClient *client,
  * Return -errno if sending fails. Other errors are reported directly to the
  * client as an error reply. */
 static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
-                                        uint8_t *data, Error **errp)
+                                        NBDRequestData *req, Error **errp)
 {
     int ret;
     NBDExport *exp = client->exp;
+    uint8_t *data;
 
     assert(request->type == NBD_CMD_READ);
 
@@ -2374,9 +2685,24 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
         request->len)
     {
         return nbd_co_send_sparse_read(client, request->handle, request->from,
-                                       data, request->len, errp);
+                                       req, request->len, errp);
     }
 
+    if (request->len && nbd_client_zero_copy(client)) {
+        if (client->structured_reply) {
+            return nbd_co_send_structured_read(client, request->handle,
+                                               request->from, NULL,
+                                               request->len, true, errp);
+        }
+        return nbd_co_send_simple_reply(client, request->handle, 0,
+                                        request->from, NULL, request->len,
+                                        errp);
+    }
+
+    data = nbd_request_buffer(req, request->len, errp);
+    if (!data) {
+        return -ENOMEM;
+    }
     ret = blk_pread(exp->common.blk, request->from, data, request->len);
     if (ret < 0) {
         return nbd_send_generic_reply(client, request->handle, ret,
@@ -2393,7 +2719,8 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
         }
     } else {
         return nbd_co_send_simple_reply(client, request->handle, 0,
-                                        data, request->len, errp);
+                                        request->from, data, request->len,
+                                        errp);
     }
 }
 
@@ -2424,7 +2751,7 @@ static coroutine_fn int nbd_do_cmd_cache(NBDClient *client, NBDRequest *request,
  * client as an error reply. */
 static coroutine_fn int nbd_handle_request(NBDClient *client,
                                            NBDRequest *request,
-                                           uint8_t *data, Error **errp)
+                                           NBDRequestData *req, Error **errp)
 {
     int ret;
     int flags;
@@ -2437,15 +2764,15 @@ static coroutine_fn int nbd_handle_request(NBDClient *client,
         return nbd_do_cmd_cache(client, request, errp);
 
     case NBD_CMD_READ:
-        return nbd_do_cmd_read(client, request, data, errp);
+        return nbd_do_cmd_read(client, request, req, errp);
 
     case NBD_CMD_WRITE:
         flags = 0;
         if (request->flags & NBD_CMD_FLAG_FUA) {
             flags |= BDRV_REQ_FUA;
         }
-        ret = blk_pwrite(exp->common.blk, request->from, data, request->len,
-                         flags);
+        ret = blk_pwrite(exp->common.blk, request->from, req->data,
+                         request->len, flags);
         return nbd_send_generic_reply(client, request->handle, ret,
                                       "writing to file failed", errp);
 
@@ -2625,7 +2952,7 @@ static coroutine_fn void nbd_trip(void *opaque)
                                      error_get_pretty(export_err), &local_err);
         error_free(export_err);
     } else {
-        ret = nbd_handle_request(client, &request, req->data, &local_err);
+        ret = nbd_handle_request(client, &request, req, &local_err);
     }
     if (ret < 0) {
         error_prepend(&local_err, "Failed to send reply: ");
@@ -46,6 +46,7 @@
 #include "sysemu/block-backend.h"
 #include "block/block_int.h"
 #include "block/blockjob.h"
+#include "block/block-status-map.h"
 #include "block/qapi.h"
 #include "crypto/init.h"
 #include "trace/control.h"
@@ -1281,6 +1282,31 @@ static int is_allocated_sectors_min(const uint8_t *buf, int n, int *pnum,
     return 1;
 }
 
+/*
+ * Returns true if the first cluster of buf contains data. Compressed
+ * clusters are written as a whole, so only clusters that are completely
+ * zeroed can be skipped.
+ *
+ * pnum is set to the number of sectors at the start of buf made of
+ * clusters with the same status as the first one.
+ */
+static bool is_allocated_clusters(const uint8_t *buf, int n, int *pnum,
+                                  int cluster_sectors)
+{
+    int i, len = MIN(n, cluster_sectors);
+    bool is_zero = buffer_is_zero(buf, len * BDRV_SECTOR_SIZE);
+
+    for (i = len; i < n; i += len) {
+        len = MIN(n - i, cluster_sectors);
+        if (is_zero != buffer_is_zero(buf + i * BDRV_SECTOR_SIZE,
+                                      len * BDRV_SECTOR_SIZE)) {
+            break;
+        }
+    }
+    *pnum = i;
+    return !is_zero;
+}
+
 /*
  * Compares two buffers sector by sector. Returns 0 if the first
  * sector of each buffer matches, non-zero otherwise.
@@ -1673,6 +1699,7 @@ enum ImgConvertBlockStatus {
 
 typedef struct ImgConvertState {
     BlockBackend **src;
+    BlockStatusMap **src_map;
     int64_t *src_sectors;
     int *src_alignment;
     int src_num;
@@ -1686,6 +1713,7 @@ typedef struct ImgConvertState {
     BlockBackend *target;
     bool has_zero_init;
     bool compressed;
+    bool ordered_compressed_writes;
     bool target_is_new;
     bool target_has_backing;
     int64_t target_backing_sectors; /* negative if unknown */
@@ -1742,20 +1770,12 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         uint64_t offset = (sector_num - src_cur_offset) * BDRV_SECTOR_SIZE;
         int64_t count;
         int tail;
-        BlockDriverState *src_bs = blk_bs(s->src[src_cur]);
-        BlockDriverState *base;
-
-        if (s->target_has_backing) {
-            base = bdrv_cow_bs(bdrv_skip_filters(src_bs));
-        } else {
-            base = NULL;
-        }
 
         do {
             count = n * BDRV_SECTOR_SIZE;
 
-            ret = bdrv_block_status_above(src_bs, base, offset, count, &count,
-                                          NULL, NULL);
+            ret = bdrv_block_status_map_get(s->src_map[src_cur], offset, count,
+                                            &count);
 
             if (ret < 0) {
                 if (s->salvage) {
@@ -1900,14 +1920,14 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
              * is real non-zero data, we must write it. Otherwise we can treat
              * it as zero sectors.
              * Compressed clusters need to be written as a whole, so in that
-             * case we can only save the write if the buffer is completely
-             * zeroed. */
+             * case we can only save the write of completely zeroed
+             * clusters. */
             if (!s->min_sparse ||
                 (!s->compressed &&
                  is_allocated_sectors_min(buf, n, &n, s->min_sparse,
                                           sector_num, s->alignment)) ||
                 (s->compressed &&
-                 !buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)))
+                 is_allocated_clusters(buf, n, &n, s->cluster_sectors)))
             {
                 ret = blk_co_pwrite(s->target, sector_num << BDRV_SECTOR_BITS,
                                     n << BDRV_SECTOR_BITS, buf, flags);
@@ -2096,6 +2116,21 @@ static int convert_do_copy(ImgConvertState *s)
     int ret, i, n;
     int64_t sector_num = 0;
 
+    /* The block status of the sources is queried once for counting the
+     * allocated sectors and once more during the copy; keep it in memory
+     * in between.  The sources are not written to while we run. */
+    s->src_map = g_new0(BlockStatusMap *, s->src_num);
+    for (i = 0; i < s->src_num; i++) {
+        BlockDriverState *src_bs = blk_bs(s->src[i]);
+        BlockDriverState *base = NULL;
+
+        if (s->target_has_backing) {
+            base = bdrv_cow_bs(bdrv_skip_filters(src_bs));
+        }
+        s->src_map[i] = bdrv_block_status_map_new(src_bs, base, 0, false,
+                                                  &error_abort);
+    }
+
     /* Check whether we have zero initialisation or can get it efficiently */
     if (!s->has_zero_init && s->target_is_new && s->min_sparse &&
         !s->target_has_backing) {
@@ -2103,13 +2138,21 @@ static int convert_do_copy(ImgConvertState *s)
     }
 
     /* Allocate buffer for copied data. For compressed images, only one cluster
-     * can be copied at a time. */
+     * can be copied at a time, unless the target compresses the clusters of
+     * a request in parallel and still allocates them in order. Then whole
+     * buffers are written and the writes stay ordered between coroutines,
+     * which gives the same image as cluster by cluster writes. */
     if (s->compressed) {
         if (s->cluster_sectors <= 0 || s->cluster_sectors > s->buf_sectors) {
             error_report("invalid cluster size");
             return -EINVAL;
         }
-        s->buf_sectors = s->cluster_sectors;
+        if (s->ordered_compressed_writes) {
+            s->buf_sectors = QEMU_ALIGN_DOWN(s->buf_sectors,
+                                             s->cluster_sectors);
+        } else {
+            s->buf_sectors = s->cluster_sectors;
+        }
     }
 
     while (sector_num < s->total_sectors) {
@@ -2728,6 +2771,7 @@ static int img_convert(int argc, char **argv)
         }
     } else {
         s.compressed = s.compressed || bdi.needs_compressed_writes;
+        s.ordered_compressed_writes = bdi.ordered_compressed_writes;
         s.cluster_sectors = bdi.cluster_size / BDRV_SECTOR_SIZE;
     }
 
@@ -2757,6 +2801,12 @@ out:
         }
         g_free(s.src);
     }
+    if (s.src_map) {
+        for (bs_i = 0; bs_i < s.src_num; bs_i++) {
+            bdrv_block_status_map_free(s.src_map[bs_i]);
+        }
+        g_free(s.src_map);
+    }
     g_free(s.src_sectors);
     g_free(s.src_alignment);
 fail_getopt:
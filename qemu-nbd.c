@@ -63,6 +63,8 @@
 #define QEMU_NBD_OPT_FORK          263
 #define QEMU_NBD_OPT_TLSAUTHZ      264
 #define QEMU_NBD_OPT_PID_FILE      265
+#define QEMU_NBD_OPT_ZERO_COPY     266
+#define QEMU_NBD_OPT_STATUS_CACHE  267
 
 #define MBR_SIZE 512
 
@@ -102,6 +104,8 @@ static void usage(const char *name)
 "  -o, --offset=OFFSET       offset into the image\n"
 "  -A, --allocation-depth    expose the allocation depth\n"
 "  -B, --bitmap=NAME         expose a persistent dirty bitmap\n"
+"  --zero-copy               send read data straight from a raw image file\n"
+"  --block-status-cache      remember block status between requests\n"
 "\n"
 "General purpose options:\n"
 "  -L, --list                list exports available from another NBD server\n"
@@ -555,6 +559,9 @@ int main(int argc, char **argv)
         { "trace", required_argument, NULL, 'T' },
         { "fork", no_argument, NULL, QEMU_NBD_OPT_FORK },
         { "pid-file", required_argument, NULL, QEMU_NBD_OPT_PID_FILE },
+        { "zero-copy", no_argument, NULL, QEMU_NBD_OPT_ZERO_COPY },
+        { "block-status-cache", no_argument, NULL,
+          QEMU_NBD_OPT_STATUS_CACHE },
         { NULL, 0, NULL, 0 }
     };
     int ch;
@@ -573,6 +580,8 @@ int main(int argc, char **argv)
     const char *export_description = NULL;
     strList *bitmaps = NULL;
     bool alloc_depth = false;
+    bool zero_copy = false;
+    bool status_cache = false;
     const char *tlscredsid = NULL;
     bool imageOpts = false;
     bool writethrough = true;
@@ -776,6 +785,12 @@ int main(int argc, char **argv)
         case QEMU_NBD_OPT_PID_FILE:
             pid_file_name = optarg;
             break;
+        case QEMU_NBD_OPT_ZERO_COPY:
+            zero_copy = true;
+            break;
+        case QEMU_NBD_OPT_STATUS_CACHE:
+            status_cache = true;
+            break;
         }
     }
 
@@ -786,7 +801,8 @@ int main(int argc, char **argv)
         }
         if (export_name || export_description || dev_offset ||
             device || disconnect || fmt || sn_id_or_name || bitmaps ||
-            alloc_depth || seen_aio || seen_discard || seen_cache) {
+            alloc_depth || zero_copy || status_cache || seen_aio ||
+            seen_discard || seen_cache) {
             error_report("List mode is incompatible with per-device settings");
             exit(EXIT_FAILURE);
         }
@@ -1082,6 +1098,13 @@ int main(int argc, char **argv)
             .bitmaps              = bitmaps,
             .has_allocation_depth = alloc_depth,
             .allocation_depth     = alloc_depth,
+            .has_multi_conn       = true,
+            .multi_conn           = shared == 1 ? ON_OFF_AUTO_AUTO
+                                                : ON_OFF_AUTO_ON,
+            .has_zero_copy        = zero_copy,
+            .zero_copy            = zero_copy,
+            .has_block_status_cache = status_cache,
+            .block_status_cache   = status_cache,
         },
     };
     blk_exp_add(export_opts, &error_fatal);
@@ -0,0 +1,261 @@
+/*
+ * Multifd compression method speed benchmark
+ *
+ * Compresses guest memory in multifd sized packets with the settings
+ * used by the lz4, zstd and zlib multifd methods, and reports the
+ * throughput of a single channel thread.
+ *
+ * By default a synthetic mix of zero, text-like and random pages is
+ * used.  Set MULTIFD_BENCH_RAM_DUMP to the path of a raw guest memory
+ * dump (for example the file of a memory-backend-file) to use real
+ * guest RAM instead.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include <lz4.h>
+#include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+
+#define BENCH_PAGE_SIZE     (4 * KiB)
+/* Same as MULTIFD_PACKET_SIZE */
+#define BENCH_PACKET_SIZE   (512 * KiB)
+#define SYNTHETIC_SIZE      (256 * MiB)
+#define TOTAL               (2 * GiB)
+
+typedef struct MultiFDCompressBenchOpts {
+    const char *name;
+    /* Returns the compressed size */
+    size_t (*compress)(const uint8_t *in, size_t in_len,
+                       uint8_t *out, size_t out_len);
+    void (*decompress)(const uint8_t *in, size_t in_len,
+                       uint8_t *out, size_t out_len);
+    size_t (*bound)(size_t in_len);
+} MultiFDCompressBenchOpts;
+
+static uint8_t *ram;
+static size_t ram_size;
+
+static size_t lz4_compress(const uint8_t *in, size_t in_len,
+                           uint8_t *out, size_t out_len)
+{
+    static LZ4_stream_t *stream;
+    int ret;
+
+    if (!stream) {
+        stream = LZ4_createStream();
+    }
+    LZ4_resetStream_fast(stream);
+    ret = LZ4_compress_fast_continue(stream, (const char *)in, (char *)out,
+                                     in_len, out_len, 1);
+    g_assert(ret > 0);
+    return ret;
+}
+
+static void lz4_decompress(const uint8_t *in, size_t in_len,
+                           uint8_t *out, size_t out_len)
+{
+    int ret = LZ4_decompress_safe((const char *)in, (char *)out,
+                                  in_len, out_len);
+
+    g_assert_cmpint(ret, ==, out_len);
+}
+
+static size_t lz4_bound(size_t in_len)
+{
+    return LZ4_compressBound(in_len);
+}
+
+#ifdef CONFIG_ZSTD
+static size_t zstd_compress(const uint8_t *in, size_t in_len,
+                            uint8_t *out, size_t out_len)
+{
+    static ZSTD_CCtx *cctx;
+    size_t ret;
+
+    if (!cctx) {
+        cctx = ZSTD_createCCtx();
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, 1);
+    }
+    ret = ZSTD_compress2(cctx, out, out_len, in, in_len);
+    g_assert(!ZSTD_isError(ret));
+    return ret;
+}
+
+static void zstd_decompress(const uint8_t *in, size_t in_len,
+                            uint8_t *out, size_t out_len)
+{
+    static ZSTD_DCtx *dctx;
+    size_t ret;
+
+    if (!dctx) {
+        dctx = ZSTD_createDCtx();
+    }
+    ret = ZSTD_decompressDCtx(dctx, out, out_len, in, in_len);
+    g_assert_cmpint(ret, ==, out_len);
+}
+
+static size_t zstd_bound(size_t in_len)
+{
+    return ZSTD_compressBound(in_len);
+}
+#endif
+
+static size_t zlib_compress(const uint8_t *in, size_t in_len,
+                            uint8_t *out, size_t out_len)
+{
+    uLongf len = out_len;
+
+    g_assert_cmpint(compress2(out, &len, in, in_len, 1), ==, Z_OK);
+    return len;
+}
+
+static void zlib_decompress(const uint8_t *in, size_t in_len,
+                            uint8_t *out, size_t out_len)
+{
+    uLongf len = out_len;
+
+    g_assert_cmpint(uncompress(out, &len, in, in_len), ==, Z_OK);
+    g_assert_cmpint(len, ==, out_len);
+}
+
+static size_t zlib_bound(size_t in_len)
+{
+    return compressBound(in_len);
+}
+
+static void fill_synthetic_ram(void)
+{
+    static const char words[][8] = {
+        "qemu", "page", "kernel", "struct", "0x0000", "return", "\n", " ",
+    };
+    size_t off = 0;
+
+    ram_size = SYNTHETIC_SIZE;
+    ram = g_malloc0(ram_size);
+
+    /* half zero pages, a quarter text-like, a quarter random */
+    for (off = 0; off < ram_size; off += BENCH_PAGE_SIZE) {
+        uint8_t *page = ram + off;
+        int kind = g_test_rand_int_range(0, 4);
+        size_t i;
+
+        if (kind == 2) {
+            size_t pos = 0;
+
+            while (pos < BENCH_PAGE_SIZE) {
+                const char *w = words[g_test_rand_int_range(0,
+                                                    ARRAY_SIZE(words))];
+                size_t len = MIN(strlen(w), BENCH_PAGE_SIZE - pos);
+
+                memcpy(page + pos, w, len);
+                pos += len;
+            }
+        } else if (kind == 3) {
+            for (i = 0; i < BENCH_PAGE_SIZE; i += sizeof(uint32_t)) {
+                uint32_t r = g_test_rand_int();
+
+                memcpy(page + i, &r, sizeof(r));
+            }
+        }
+    }
+}
+
+static void load_ram(void)
+{
+    const char *path = g_getenv("MULTIFD_BENCH_RAM_DUMP");
+    GError *err = NULL;
+    gchar *contents;
+    gsize len;
+
+    if (!path) {
+        fill_synthetic_ram();
+        return;
+    }
+
+    if (!g_file_get_contents(path, &contents, &len, &err)) {
+        g_printerr("Unable to read %s: %s\n", path, err->message);
+        exit(1);
+    }
+    ram_size = QEMU_ALIGN_DOWN(len, BENCH_PACKET_SIZE);
+    g_assert(ram_size);
+    ram = (uint8_t *)contents;
+}
+
+static void test_compress_speed(const void *opaque)
+{
+    const MultiFDCompressBenchOpts *opts = opaque;
+    size_t zbuff_len = opts->bound(BENCH_PACKET_SIZE);
+    uint8_t *zbuff = g_malloc(zbuff_len);
+    uint8_t *out = g_malloc(BENCH_PACKET_SIZE);
+    size_t npackets = ram_size / BENCH_PACKET_SIZE;
+    size_t total_in = 0, total_out = 0;
+    double compress_time, decompress_time;
+    size_t i, len;
+
+    /* Compress from a copy, as the multifd methods do */
+    g_test_timer_start();
+    for (i = 0; total_in < TOTAL; i = (i + 1) % npackets) {
+        memcpy(out, ram + i * BENCH_PACKET_SIZE, BENCH_PACKET_SIZE);
+        len = opts->compress(out, BENCH_PACKET_SIZE, zbuff, zbuff_len);
+        total_in += BENCH_PACKET_SIZE;
+        total_out += len;
+    }
+    compress_time = g_test_timer_elapsed();
+
+    /* Check that the output decompresses back to the input */
+    for (i = 0; i < npackets; i++) {
+        len = opts->compress(ram + i * BENCH_PACKET_SIZE, BENCH_PACKET_SIZE,
+                             zbuff, zbuff_len);
+        opts->decompress(zbuff, len, out, BENCH_PACKET_SIZE);
+        g_assert(memcmp(out, ram + i * BENCH_PACKET_SIZE, BENCH_PACKET_SIZE) == 0);
+    }
+
+    /* Decompression speed, using the last packet */
+    g_test_timer_start();
+    for (total_in = 0; total_in < TOTAL; total_in += BENCH_PACKET_SIZE) {
+        opts->decompress(zbuff, len, out, BENCH_PACKET_SIZE);
+    }
+    decompress_time = g_test_timer_elapsed();
+
+    g_test_message("multifd-compression(%s): compress %.2f MB/sec, "
+                   "decompress %.2f MB/sec, ratio %.2f",
+                   opts->name, TOTAL / compress_time / MiB,
+                   TOTAL / decompress_time / MiB,
+                   (double)TOTAL / total_out);
+
+    g_free(out);
+    g_free(zbuff);
+}
+
+int main(int argc, char **argv)
+{
+    static const MultiFDCompressBenchOpts tests[] = {
+        { "lz4", lz4_compress, lz4_decompress, lz4_bound },
+#ifdef CONFIG_ZSTD
+        { "zstd", zstd_compress, zstd_decompress, zstd_bound },
+#endif
+        { "zlib", zlib_compress, zlib_decompress, zlib_bound },
+    };
+    char name[64];
+    int i, ret;
+
+    g_test_init(&argc, &argv, NULL);
+    load_ram();
+
+    for (i = 0; i < ARRAY_SIZE(tests); i++) {
+        snprintf(name, sizeof(name), "/migration/benchmark/multifd/%s",
+                 tests[i].name);
+        g_test_add_data_func(name, &tests[i], test_compress_speed);
+    }
+
+    ret = g_test_run();
+
+    g_free(ram);
+    return ret;
+}
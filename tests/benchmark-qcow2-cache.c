@@ -0,0 +1,113 @@
+/*
+ * QCOW2 metadata cache lookup benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/main-loop.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "sysemu/block-backend.h"
+#include "block/qcow2.h"
+
+#define TABLE_SIZE      (4 * KiB)
+#define TABLE_BASE      (1 * MiB)
+#define LOOKUPS         (256 * 1024)
+
+typedef struct Qcow2CacheBenchOpts {
+    const char *name;
+    int num_tables;
+    /* Number of distinct tables that are looked up */
+    int working_set;
+    bool sequential;
+} Qcow2CacheBenchOpts;
+
+static char img_path[] = "/tmp/qcow2-cache-bench.XXXXXX";
+
+static BlockBackend *open_image(void)
+{
+    QDict *options = qdict_new();
+
+    qdict_put_str(options, "driver", "qcow2");
+    qdict_put_str(options, "file.locking", "off");
+    return blk_new_open(img_path, NULL, options, 0, &error_abort);
+}
+
+static void test_cache_speed(const void *opaque)
+{
+    const Qcow2CacheBenchOpts *opts = opaque;
+    BlockBackend *blk = open_image();
+    BlockDriverState *bs = blk_bs(blk);
+    Qcow2Cache *c;
+    uint64_t *offsets;
+    void *table;
+    int i, ret;
+
+    c = qcow2_cache_create(bs, opts->num_tables, TABLE_SIZE);
+    g_assert(c);
+
+    offsets = g_new(uint64_t, LOOKUPS);
+    for (i = 0; i < LOOKUPS; i++) {
+        int idx = opts->sequential ? i % opts->working_set :
+                                     g_test_rand_int_range(0,
+                                                           opts->working_set);
+        offsets[i] = TABLE_BASE + (uint64_t) idx * TABLE_SIZE;
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < LOOKUPS; i++) {
+        ret = qcow2_cache_get(bs, c, offsets[i], &table);
+        g_assert_cmpint(ret, ==, 0);
+        qcow2_cache_put(c, &table);
+    }
+    g_test_timer_elapsed();
+
+    g_test_message("qcow2-cache(%s): %d tables, working set %d: "
+                   "%.2f M lookups/sec", opts->name, opts->num_tables,
+                   opts->working_set, LOOKUPS / g_test_timer_last() / 1e6);
+
+    qcow2_cache_destroy(c);
+    g_free(offsets);
+    blk_unref(blk);
+}
+
+int main(int argc, char **argv)
+{
+    static const Qcow2CacheBenchOpts tests[] = {
+        { "random-hit",       1024,   1024,   false },
+        { "random-hit",       65536,  65536,  false },
+        { "random-miss",      1024,   8192,   false },
+        { "random-miss",      65536,  262144, false },
+        { "sequential-hit",   65536,  65536,  true },
+        { "sequential-miss",  1024,   65536,  true },
+        { "sequential-miss",  65536,  262144, true },
+    };
+    char name[64];
+    int fd, i, ret;
+
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+
+    fd = mkstemp(img_path);
+    g_assert(fd >= 0);
+    close(fd);
+    bdrv_img_create(img_path, "qcow2", NULL, NULL, NULL, 1 * TiB, 0, true,
+                    &error_abort);
+
+    for (i = 0; i < ARRAY_SIZE(tests); i++) {
+        snprintf(name, sizeof(name),
+                 "/qcow2/benchmark/cache/%s/tables-%d/working-set-%d",
+                 tests[i].name, tests[i].num_tables, tests[i].working_set);
+        g_test_add_data_func(name, &tests[i], test_cache_speed);
+    }
+
+    ret = g_test_run();
+
+    unlink(img_path);
+    return ret;
+}
@@ -0,0 +1,100 @@
+/*
+ * XBZRLE encoder speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "../migration/xbzrle.h"
+
+#define XBZRLE_PAGE_SIZE    4096
+#define NUM_PAGES           1024
+#define TOTAL               (1 * GiB)
+
+typedef struct XBZRLEBenchOpts {
+    const char *name;
+    /* Number of changed ranges per page */
+    int ranges;
+    /* Length of each changed range */
+    int range_len;
+} XBZRLEBenchOpts;
+
+static uint8_t *make_pages(const XBZRLEBenchOpts *opts, uint8_t *old_buf)
+{
+    uint8_t *new_buf = g_memdup(old_buf, NUM_PAGES * XBZRLE_PAGE_SIZE);
+    int i, j, k;
+
+    for (i = 0; i < NUM_PAGES; i++) {
+        uint8_t *page = new_buf + i * XBZRLE_PAGE_SIZE;
+
+        for (j = 0; j < opts->ranges; j++) {
+            int pos = g_test_rand_int_range(0, XBZRLE_PAGE_SIZE -
+                                               opts->range_len);
+
+            for (k = 0; k < opts->range_len; k++) {
+                page[pos + k] = ~page[pos + k];
+            }
+        }
+    }
+    return new_buf;
+}
+
+static void test_encode_speed(void)
+{
+    static const XBZRLEBenchOpts tests[] = {
+        { "unchanged",  0,  0 },
+        { "sparse",     4,  8 },
+        { "dense",      32, 16 },
+    };
+    uint8_t *old_buf = g_malloc(NUM_PAGES * XBZRLE_PAGE_SIZE);
+    uint8_t *new_buf[ARRAY_SIZE(tests)];
+    uint8_t *dst = g_malloc(XBZRLE_PAGE_SIZE);
+    size_t total;
+    int i, t, level = 0;
+
+    for (i = 0; i < NUM_PAGES * XBZRLE_PAGE_SIZE; i += sizeof(uint32_t)) {
+        uint32_t r = g_test_rand_int();
+
+        memcpy(old_buf + i, &r, sizeof(r));
+    }
+    for (t = 0; t < ARRAY_SIZE(tests); t++) {
+        new_buf[t] = make_pages(&tests[t], old_buf);
+    }
+
+    /* Run every implementation, from the fastest to the portable one */
+    do {
+        for (t = 0; t < ARRAY_SIZE(tests); t++) {
+            g_test_timer_start();
+            for (total = 0; total < TOTAL;
+                 total += NUM_PAGES * XBZRLE_PAGE_SIZE) {
+                for (i = 0; i < NUM_PAGES; i++) {
+                    xbzrle_encode_buffer(old_buf + i * XBZRLE_PAGE_SIZE,
+                                         new_buf[t] + i * XBZRLE_PAGE_SIZE,
+                                         XBZRLE_PAGE_SIZE, dst,
+                                         XBZRLE_PAGE_SIZE);
+                }
+            }
+            g_test_timer_elapsed();
+
+            g_test_message("xbzrle(%s): implementation %d: %.2f MB/sec",
+                           tests[t].name, level,
+                           TOTAL / g_test_timer_last() / MiB);
+        }
+        level++;
+    } while (test_xbzrle_encode_next_accel());
+
+    for (t = 0; t < ARRAY_SIZE(tests); t++) {
+        g_free(new_buf[t]);
+    }
+    g_free(old_buf);
+    g_free(dst);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/migration/benchmark/xbzrle/encode", test_encode_speed);
+    return g_test_run();
+}
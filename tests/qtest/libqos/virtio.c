@@ -377,7 +377,7 @@ void qvirtqueue_kick(QTestState *qts, QVirtioDevice *d, QVirtQueue *vq,
     qvirtio_writew(d, qts, vq->avail + 2, idx + 1);
 
     /* Must read after idx is updated */
-    flags = qvirtio_readw(d, qts, vq->avail);
+    flags = qvirtio_readw(d, qts, vq->used);
     avail_event = qvirtio_readw(d, qts, vq->used + 4 +
                                 sizeof(struct vring_used_elem) * vq->size);
 
@@ -388,6 +388,25 @@ void qvirtqueue_kick(QTestState *qts, QVirtioDevice *d, QVirtQueue *vq,
     }
 }
 
+/*
+ * qvirtqueue_add_avail:
+ * @free_head: The vq->desc[] index of the request
+ *
+ * This function makes a request available to the device without notifying
+ * it, so that a following qvirtqueue_kick() submits several requests at once.
+ */
+void qvirtqueue_add_avail(QTestState *qts, QVirtioDevice *d, QVirtQueue *vq,
+                          uint32_t free_head)
+{
+    /* vq->avail->idx */
+    uint16_t idx = qvirtio_readw(d, qts, vq->avail + 2);
+
+    /* vq->avail->ring[idx % vq->size] */
+    qvirtio_writew(d, qts, vq->avail + 4 + (2 * (idx % vq->size)), free_head);
+    /* vq->avail->idx */
+    qvirtio_writew(d, qts, vq->avail + 2, idx + 1);
+}
+
 /*
  * qvirtqueue_get_buf:
  * @desc_idx: A pointer that is filled with the vq->desc[] index, may be NULL
@@ -437,6 +456,13 @@ void qvirtqueue_set_used_event(QTestState *qts, QVirtQueue *vq, uint16_t idx)
     qvirtio_writew(vq->vdev, qts, vq->avail + 4 + (2 * vq->size), idx);
 }
 
+void qvirtqueue_set_no_interrupt(QTestState *qts, QVirtQueue *vq, bool enable)
+{
+    /* vq->avail->flags */
+    qvirtio_writew(vq->vdev, qts, vq->avail,
+                   enable ? VRING_AVAIL_F_NO_INTERRUPT : 0);
+}
+
 void qvirtio_start_device(QVirtioDevice *vdev)
 {
     qvirtio_reset(vdev);
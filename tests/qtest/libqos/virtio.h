@@ -145,10 +145,13 @@ uint32_t qvirtqueue_add_indirect(QTestState *qts, QVirtQueue *vq,
                                  QVRingIndirectDesc *indirect);
 void qvirtqueue_kick(QTestState *qts, QVirtioDevice *d, QVirtQueue *vq,
                      uint32_t free_head);
+void qvirtqueue_add_avail(QTestState *qts, QVirtioDevice *d, QVirtQueue *vq,
+                          uint32_t free_head);
 bool qvirtqueue_get_buf(QTestState *qts, QVirtQueue *vq, uint32_t *desc_idx,
                         uint32_t *len);
 
 void qvirtqueue_set_used_event(QTestState *qts, QVirtQueue *vq, uint16_t idx);
+void qvirtqueue_set_no_interrupt(QTestState *qts, QVirtQueue *vq, bool enable);
 
 void qvirtio_start_device(QVirtioDevice *vdev);
 
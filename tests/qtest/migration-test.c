@@ -42,6 +42,11 @@ static bool uffd_feature_thread_id;
 #include <sys/vfs.h>
 #endif
 
+#if defined(__linux__) && defined(HOST_X86_64)
+#include <sys/ioctl.h>
+#include <linux/kvm.h>
+#endif
+
 #if defined(__linux__) && defined(__NR_userfaultfd) && defined(CONFIG_EVENTFD)
 #include <sys/eventfd.h>
 #include <sys/ioctl.h>
@@ -472,6 +477,8 @@ typedef struct {
     bool use_shmem;
     /* only launch the target process */
     bool only_target;
+    /* Use dirty ring if true; dirty logging otherwise */
+    bool use_dirty_ring;
     char *opts_source;
     char *opts_target;
 } MigrateStart;
@@ -504,6 +511,7 @@ static int test_migrate_start(QTestState **from, QTestState **to,
     const char *arch = qtest_get_arch();
     const char *machine_opts = NULL;
     const char *memory_size;
+    const char *accel_opts;
     int ret = 0;
 
     if (args->use_shmem) {
@@ -567,6 +575,8 @@ static int test_migrate_start(QTestState **from, QTestState **to,
         ignore_stderr = "";
     }
 
+    accel_opts = args->use_dirty_ring ? ",dirty-ring-size=4096" : "";
+
     if (args->use_shmem) {
         shmem_path = g_strdup_printf("/dev/shm/qemu-%d", getpid());
         shmem_opts = g_strdup_printf(
@@ -578,11 +588,12 @@ static int test_migrate_start(QTestState **from, QTestState **to,
         shmem_opts = g_strdup("");
     }
 
-    cmd_source = g_strdup_printf("-accel kvm -accel tcg%s%s "
+    cmd_source = g_strdup_printf("-accel kvm%s -accel tcg%s%s "
                                  "-name source,debug-threads=on "
                                  "-m %s "
                                  "-serial file:%s/src_serial "
                                  "%s %s %s %s",
+                                 accel_opts,
                                  machine_opts ? " -machine " : "",
                                  machine_opts ? machine_opts : "",
                                  memory_size, tmpfs,
@@ -594,12 +605,13 @@ static int test_migrate_start(QTestState **from, QTestState **to,
     }
     g_free(cmd_source);
 
-    cmd_target = g_strdup_printf("-accel kvm -accel tcg%s%s "
+    cmd_target = g_strdup_printf("-accel kvm%s -accel tcg%s%s "
                                  "-name target,debug-threads=on "
                                  "-m %s "
                                  "-serial file:%s/dest_serial "
                                  "-incoming %s "
                                  "%s %s %s %s",
+                                 accel_opts,
                                  machine_opts ? " -machine " : "",
                                  machine_opts ? machine_opts : "",
                                  memory_size, tmpfs, uri,
@@ -845,12 +857,14 @@ static void test_baddest(void)
     test_migrate_end(from, to, false);
 }
 
-static void test_precopy_unix(void)
+static void test_precopy_unix_common(bool dirty_ring)
 {
     char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
     MigrateStart *args = migrate_start_new();
     QTestState *from, *to;
 
+    args->use_dirty_ring = dirty_ring;
+
     if (test_migrate_start(&from, &to, uri, args)) {
         return;
     }
@@ -886,6 +900,18 @@ static void test_precopy_unix(void)
     g_free(uri);
 }
 
+static void test_precopy_unix(void)
+{
+    /* Using default dirty logging */
+    test_precopy_unix_common(false);
+}
+
+static void test_precopy_unix_dirty_ring(void)
+{
+    /* Using dirty ring tracking */
+    test_precopy_unix_common(true);
+}
+
 #if 0
 /* Currently upset on aarch64 TCG */
 static void test_ignore_shared(void)
@@ -1266,7 +1292,11 @@ static void test_migrate_auto_converge(void)
     test_migrate_end(from, to, true);
 }
 
-static void test_multifd_tcp(const char *method)
+typedef void (*MultifdFinishHook)(QTestState *from);
+
+static void test_multifd_tcp_common(const char *method, bool zero_copy,
+                                    const char *capability,
+                                    MultifdFinishHook finish_hook)
 {
     MigrateStart *args = migrate_start_new();
     QTestState *from, *to;
@@ -1295,6 +1325,13 @@ static void test_multifd_tcp(const char *method)
 
     migrate_set_capability(from, "multifd", "true");
     migrate_set_capability(to, "multifd", "true");
+    if (zero_copy) {
+        migrate_set_capability(from, "zero-copy-send", true);
+    }
+    if (capability) {
+        migrate_set_capability(from, capability, true);
+        migrate_set_capability(to, capability, true);
+    }
 
     /* Start incoming migration from the 1st socket */
     rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
@@ -1319,10 +1356,18 @@ static void test_multifd_tcp(const char *method)
 
     wait_for_serial("dest_serial");
     wait_for_migration_complete(from);
+    if (finish_hook) {
+        finish_hook(from);
+    }
     test_migrate_end(from, to, true);
     g_free(uri);
 }
 
+static void test_multifd_tcp(const char *method)
+{
+    test_multifd_tcp_common(method, false, NULL, NULL);
+}
+
 static void test_multifd_tcp_none(void)
 {
     test_multifd_tcp("none");
@@ -1340,6 +1385,49 @@ static void test_multifd_tcp_zstd(void)
 }
 #endif
 
+#ifdef CONFIG_LZ4
+static void test_multifd_tcp_lz4(void)
+{
+    test_multifd_tcp("lz4");
+}
+#endif
+
+static void test_multifd_tcp_xbzrle(void)
+{
+    test_multifd_tcp("xbzrle");
+}
+
+static void test_multifd_tcp_zero_copy(void)
+{
+    test_multifd_tcp_common("none", true, NULL, NULL);
+}
+
+static void multifd_zero_page_finish(QTestState *from)
+{
+    int64_t normal = read_ram_property_int(from, "normal");
+    int64_t duplicate = read_ram_property_int(from, "duplicate");
+    int64_t transferred = read_ram_property_int(from, "transferred");
+    int64_t page_size = read_ram_property_int(from, "page-size");
+
+    /* Only the test area of guest memory is ever dirtied */
+    g_assert_cmpint(duplicate, >, 0);
+
+    /*
+     * Zero pages found by the channels only cost their offset in the
+     * packet, they must not be accounted as transferred page data.
+     * Allow a generous per page overhead for packet headers.
+     */
+    g_assert_cmpint(transferred, <,
+                    normal * page_size +
+                    (normal + duplicate) * 64 + 16 * 1024 * 1024);
+}
+
+static void test_multifd_tcp_zero_page(void)
+{
+    test_multifd_tcp_common("none", false, "multifd-zero-page",
+                            multifd_zero_page_finish);
+}
+
 /*
  * This test does:
  *  source               target
@@ -1437,6 +1525,48 @@ static void test_multifd_tcp_cancel(void)
     g_free(uri);
 }
 
+static bool kvm_dirty_ring_supported(void)
+{
+#if defined(__linux__) && defined(HOST_X86_64)
+    int ret, kvm_fd = open("/dev/kvm", O_RDONLY);
+
+    if (kvm_fd < 0) {
+        return false;
+    }
+
+    ret = ioctl(kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_DIRTY_LOG_RING);
+    close(kvm_fd);
+
+    /* We test with 4096 slots */
+    if (ret < 4096) {
+        return false;
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+static bool zero_copy_send_supported(void)
+{
+#if defined(__linux__) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+    int ret, v = 1, fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    /* Kernels without MSG_ZEROCOPY support reject the socket option */
+    ret = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &v, sizeof(v));
+    close(fd);
+
+    return ret == 0;
+#else
+    return false;
+#endif
+}
+
 int main(int argc, char **argv)
 {
     char template[] = "/tmp/migration-test-XXXXXX";
@@ -1490,6 +1620,9 @@ int main(int argc, char **argv)
     qtest_add_func("/migration/bad_dest", test_baddest);
     qtest_add_func("/migration/precopy/unix", test_precopy_unix);
     qtest_add_func("/migration/precopy/tcp", test_precopy_tcp);
+    if (kvm_dirty_ring_supported()) {
+        qtest_add_func("/migration/dirty_ring", test_precopy_unix_dirty_ring);
+    }
     /* qtest_add_func("/migration/ignore_shared", test_ignore_shared); */
     qtest_add_func("/migration/xbzrle/unix", test_xbzrle_unix);
     qtest_add_func("/migration/fd_proto", test_migrate_fd_proto);
@@ -1507,6 +1640,16 @@ int main(int argc, char **argv)
 #ifdef CONFIG_ZSTD
     qtest_add_func("/migration/multifd/tcp/zstd", test_multifd_tcp_zstd);
 #endif
+#ifdef CONFIG_LZ4
+    qtest_add_func("/migration/multifd/tcp/lz4", test_multifd_tcp_lz4);
+#endif
+    qtest_add_func("/migration/multifd/tcp/xbzrle", test_multifd_tcp_xbzrle);
+    qtest_add_func("/migration/multifd/tcp/zero-page",
+                   test_multifd_tcp_zero_page);
+    if (zero_copy_send_supported()) {
+        qtest_add_func("/migration/multifd/tcp/zero-copy",
+                       test_multifd_tcp_zero_copy);
+    }
 
     ret = g_test_run();
 
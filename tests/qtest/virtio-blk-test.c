@@ -12,6 +12,8 @@
 #include "libqtest-single.h"
 #include "qemu/bswap.h"
 #include "qemu/module.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
 #include "standard-headers/linux/virtio_blk.h"
 #include "standard-headers/linux/virtio_pci.h"
 #include "libqos/qgraph.h"
@@ -695,6 +697,279 @@ static void idx(void *obj, void *u_data, QGuestAllocator *t_alloc)
     qvirtqueue_cleanup(dev->bus, vq, t_alloc);
 }
 
+static uint64_t notification_counter(QTestState *qts, const char *name)
+{
+    QDict *rsp;
+    uint64_t value;
+
+    rsp = qtest_qmp(qts, "{ 'execute': 'qom-get', 'arguments': "
+                    "{ 'path': '/machine/peripheral/drv0/virtio-backend', "
+                    "'property': %s } }", name);
+    g_assert(qdict_haskey(rsp, "return"));
+    value = qdict_get_int(rsp, "return");
+    qobject_unref(rsp);
+
+    return value;
+}
+
+static uint32_t notification_request(QTestState *qts, QVirtioDevice *dev,
+                                     QGuestAllocator *alloc, QVirtQueue *vq,
+                                     uint32_t type, uint64_t sector,
+                                     uint64_t *req_addr)
+{
+    QVirtioBlkReq req;
+    uint32_t free_head;
+
+    req.type = type;
+    req.ioprio = 1;
+    req.sector = sector;
+    req.data = g_malloc0(512);
+    if (type == VIRTIO_BLK_T_OUT) {
+        strcpy(req.data, "TEST");
+    }
+
+    *req_addr = virtio_blk_request(alloc, dev, &req, 512);
+
+    g_free(req.data);
+
+    free_head = qvirtqueue_add(qts, vq, *req_addr, 16, false, true);
+    qvirtqueue_add(qts, vq, *req_addr + 16, 512, type == VIRTIO_BLK_T_IN,
+                   true);
+    qvirtqueue_add(qts, vq, *req_addr + 528, 1, true, false);
+    qvirtqueue_kick(qts, dev, vq, free_head);
+
+    return free_head;
+}
+
+/*
+ * Check the x-notifications-sent and x-notifications-suppressed counters:
+ * completions are only counted as notified if the guest did not suppress
+ * the interrupt.
+ */
+static void notification_counters(void *obj, void *u_data,
+                                  QGuestAllocator *t_alloc)
+{
+    QVirtioBlkPCI *blk = obj;
+    QVirtioDevice *dev = &blk->pci_vdev.vdev;
+    QTestState *qts = global_qtest;
+    QVirtQueue *vq;
+    uint64_t req_addr;
+    uint64_t features;
+    uint32_t free_head;
+    uint32_t desc_idx;
+    gint64 start_time;
+    uint8_t status;
+    char *data;
+
+    features = qvirtio_get_features(dev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                    (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                    (1u << VIRTIO_RING_F_EVENT_IDX) |
+                    (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(dev, features);
+
+    vq = qvirtqueue_setup(dev, t_alloc, 0);
+
+    qvirtio_set_driver_ok(dev);
+
+    g_assert_cmpint(notification_counter(qts, "x-notifications-sent"), ==, 0);
+    g_assert_cmpint(notification_counter(qts, "x-notifications-suppressed"),
+                    ==, 0);
+
+    /* Each request completes on its own and raises an interrupt */
+    free_head = notification_request(qts, dev, t_alloc, vq, VIRTIO_BLK_T_OUT,
+                                     0, &req_addr);
+    qvirtio_wait_used_elem(qts, dev, vq, free_head, NULL,
+                           QVIRTIO_BLK_TIMEOUT_US);
+    status = readb(req_addr + 528);
+    g_assert_cmpint(status, ==, 0);
+    guest_free(t_alloc, req_addr);
+
+    free_head = notification_request(qts, dev, t_alloc, vq, VIRTIO_BLK_T_IN,
+                                     0, &req_addr);
+    qvirtio_wait_used_elem(qts, dev, vq, free_head, NULL,
+                           QVIRTIO_BLK_TIMEOUT_US);
+    status = readb(req_addr + 528);
+    g_assert_cmpint(status, ==, 0);
+
+    data = g_malloc0(512);
+    memread(req_addr + 16, data, 512);
+    g_assert_cmpstr(data, ==, "TEST");
+    g_free(data);
+    guest_free(t_alloc, req_addr);
+
+    g_assert_cmpint(notification_counter(qts, "x-notifications-sent"), ==, 2);
+    g_assert_cmpint(notification_counter(qts, "x-notifications-suppressed"),
+                    ==, 0);
+
+    /* A completion the guest does not want an interrupt for is not counted */
+    qvirtqueue_set_no_interrupt(qts, vq, true);
+    free_head = notification_request(qts, dev, t_alloc, vq, VIRTIO_BLK_T_OUT,
+                                     1, &req_addr);
+
+    start_time = g_get_monotonic_time();
+    while (!qvirtqueue_get_buf(qts, vq, &desc_idx, NULL)) {
+        qtest_clock_step(qts, 100);
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_BLK_TIMEOUT_US);
+    }
+    g_assert_cmpint(desc_idx, ==, free_head);
+    g_assert(!dev->bus->get_queue_isr_status(dev, vq));
+    status = readb(req_addr + 528);
+    g_assert_cmpint(status, ==, 0);
+    guest_free(t_alloc, req_addr);
+
+    g_assert_cmpint(notification_counter(qts, "x-notifications-sent"), ==, 2);
+    g_assert_cmpint(notification_counter(qts, "x-notifications-suppressed"),
+                    ==, 1);
+
+    qvirtqueue_set_no_interrupt(qts, vq, false);
+    qvirtqueue_cleanup(dev->bus, vq, t_alloc);
+}
+
+static int64_t merged_writes(void)
+{
+    QDict *rsp = qmp("{ 'execute': 'query-blockstats' }");
+    QListEntry *entry;
+    int64_t value = -1;
+
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(rsp, "return"), entry) {
+        QDict *dev = qobject_to(QDict, qlist_entry_obj(entry));
+
+        if (!strcmp(qdict_get_str(dev, "device"), "drive0")) {
+            value = qdict_get_int(qdict_get_qdict(dev, "stats"), "wr_merged");
+        }
+    }
+    qobject_unref(rsp);
+
+    g_assert_cmpint(value, >=, 0);
+    return value;
+}
+
+/*
+ * Submit one-sector writes to @sectors with a single kick, so that they
+ * are all added to the same MultiReqBuffer, then read them back.
+ */
+static void merge_batch(QVirtioDevice *dev, QGuestAllocator *alloc,
+                        QVirtQueue *vq, const uint64_t *sectors, int n)
+{
+    QTestState *qts = global_qtest;
+    QVirtioBlkReq req;
+    uint64_t req_addr[4];
+    uint64_t first = sectors[0];
+    int64_t merged = merged_writes();
+    gint64 start_time;
+    uint32_t free_head;
+    uint32_t desc_idx;
+    uint8_t status;
+    char *data;
+    int i, done;
+
+    g_assert(n <= ARRAY_SIZE(req_addr));
+
+    for (i = 0; i < n; i++) {
+        req.type = VIRTIO_BLK_T_OUT;
+        req.ioprio = 1;
+        req.sector = sectors[i];
+        req.data = g_malloc0(512);
+        sprintf(req.data, "TEST%" PRIu64, sectors[i]);
+
+        req_addr[i] = virtio_blk_request(alloc, dev, &req, 512);
+
+        g_free(req.data);
+
+        free_head = qvirtqueue_add(qts, vq, req_addr[i], 16, false, true);
+        qvirtqueue_add(qts, vq, req_addr[i] + 16, 512, false, true);
+        qvirtqueue_add(qts, vq, req_addr[i] + 528, 1, true, false);
+
+        if (i < n - 1) {
+            qvirtqueue_add_avail(qts, dev, vq, free_head);
+        } else {
+            qvirtqueue_kick(qts, dev, vq, free_head);
+        }
+        first = MIN(first, sectors[i]);
+    }
+
+    /* Merged requests complete in sector order, not in submission order */
+    start_time = g_get_monotonic_time();
+    for (done = 0; done < n; ) {
+        if (qvirtqueue_get_buf(qts, vq, &desc_idx, NULL)) {
+            done++;
+            continue;
+        }
+        qtest_clock_step(qts, 100);
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_BLK_TIMEOUT_US);
+    }
+
+    for (i = 0; i < n; i++) {
+        status = readb(req_addr[i] + 528);
+        g_assert_cmpint(status, ==, 0);
+        guest_free(alloc, req_addr[i]);
+    }
+
+    /* All writes were adjacent, so they must have become a single request */
+    g_assert_cmpint(merged_writes() - merged, ==, n - 1);
+
+    req.type = VIRTIO_BLK_T_IN;
+    req.ioprio = 1;
+    req.sector = first;
+    req.data = g_malloc0(512 * n);
+
+    req_addr[0] = virtio_blk_request(alloc, dev, &req, 512 * n);
+
+    g_free(req.data);
+
+    free_head = qvirtqueue_add(qts, vq, req_addr[0], 16, false, true);
+    qvirtqueue_add(qts, vq, req_addr[0] + 16, 512 * n, true, true);
+    qvirtqueue_add(qts, vq, req_addr[0] + 16 + 512 * n, 1, true, false);
+    qvirtqueue_kick(qts, dev, vq, free_head);
+
+    qvirtio_wait_used_elem(qts, dev, vq, free_head, NULL,
+                           QVIRTIO_BLK_TIMEOUT_US);
+    status = readb(req_addr[0] + 16 + 512 * n);
+    g_assert_cmpint(status, ==, 0);
+
+    data = g_malloc0(512);
+    for (i = 0; i < n; i++) {
+        g_autofree char *expected = g_strdup_printf("TEST%" PRIu64,
+                                                    first + i);
+
+        memread(req_addr[0] + 16 + 512 * i, data, 512);
+        g_assert_cmpstr(data, ==, expected);
+    }
+    g_free(data);
+
+    guest_free(alloc, req_addr[0]);
+}
+
+/* Exercise both the already sorted and the qsort() path of request merging */
+static void merge(void *obj, void *u_data, QGuestAllocator *t_alloc)
+{
+    static const uint64_t sorted[] = { 0, 1, 2, 3 };
+    static const uint64_t unsorted[] = { 11, 9, 10, 8 };
+    QVirtioBlk *blk_if = obj;
+    QVirtioDevice *dev = blk_if->vdev;
+    QVirtQueue *vq;
+    uint64_t features;
+
+    features = qvirtio_get_features(dev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                    (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                    (1u << VIRTIO_RING_F_EVENT_IDX) |
+                    (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(dev, features);
+
+    vq = qvirtqueue_setup(dev, t_alloc, 0);
+
+    qvirtio_set_driver_ok(dev);
+
+    merge_batch(dev, t_alloc, vq, sorted, ARRAY_SIZE(sorted));
+    merge_batch(dev, t_alloc, vq, unsorted, ARRAY_SIZE(unsorted));
+
+    qvirtqueue_cleanup(dev->bus, vq, t_alloc);
+}
+
 static void pci_hotplug(void *obj, void *data, QGuestAllocator *t_alloc)
 {
     QVirtioPCIDevice *dev1 = obj;
@@ -790,6 +1065,7 @@ static void register_virtio_blk_test(void)
     qos_add_test("config", "virtio-blk", config, &opts);
     qos_add_test("basic", "virtio-blk", basic, &opts);
     qos_add_test("resize", "virtio-blk", resize, &opts);
+    qos_add_test("merge", "virtio-blk", merge, &opts);
 
     /* tests just for virtio-blk-pci */
     qos_add_test("msix", "virtio-blk-pci", msix, &opts);
@@ -797,6 +1073,12 @@ static void register_virtio_blk_test(void)
     qos_add_test("nxvirtq", "virtio-blk-pci",
                       test_nonexistent_virtqueue, &opts);
     qos_add_test("hotplug", "virtio-blk-pci", pci_hotplug, &opts);
+    qos_add_test("notification-counters", "virtio-blk-pci",
+                 notification_counters, &opts);
+
+    opts.edge.extra_device_opts = "completion-batch-size=1";
+    qos_add_test("notification-counters-batch-size-1", "virtio-blk-pci",
+                 notification_counters, &opts);
 }
 
 libqos_init(register_virtio_blk_test);
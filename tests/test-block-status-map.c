@@ -0,0 +1,184 @@
+/*
+ * Block status map tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qapi/error.h"
+#include "qemu/main-loop.h"
+#include "block/block_int.h"
+#include "block/block-status-map.h"
+
+#define TEST_IMAGE_SIZE (1 * MiB)
+
+typedef struct TestExtent {
+    int64_t offset;
+    int64_t bytes;
+    int status;
+} TestExtent;
+
+static const TestExtent test_extents[] = {
+    { 0,            64 * KiB,   BDRV_BLOCK_DATA },
+    { 64 * KiB,     448 * KiB,  BDRV_BLOCK_ZERO },
+    { 512 * KiB,    512 * KiB,  BDRV_BLOCK_DATA },
+};
+
+#define STATUS_DATA (BDRV_BLOCK_DATA | BDRV_BLOCK_ALLOCATED)
+#define STATUS_ZERO (BDRV_BLOCK_ZERO | BDRV_BLOCK_ALLOCATED)
+
+/* Number of queries that reached the driver */
+static int nb_queries;
+/* If set, invalidated during each query, as a concurrent write would */
+static BlockStatusMap *racing_map;
+
+static int coroutine_fn bdrv_test_co_block_status(BlockDriverState *bs,
+                                                  bool want_zero,
+                                                  int64_t offset,
+                                                  int64_t bytes, int64_t *pnum,
+                                                  int64_t *map,
+                                                  BlockDriverState **file)
+{
+    int i;
+
+    nb_queries++;
+    if (racing_map) {
+        bdrv_block_status_map_invalidate(racing_map, offset, 1);
+    }
+
+    for (i = 0; i < ARRAY_SIZE(test_extents); i++) {
+        const TestExtent *e = &test_extents[i];
+
+        if (offset < e->offset + e->bytes) {
+            *pnum = MIN(e->offset + e->bytes - offset, bytes);
+            return e->status;
+        }
+    }
+    g_assert_not_reached();
+}
+
+static int64_t bdrv_test_getlength(BlockDriverState *bs)
+{
+    return TEST_IMAGE_SIZE;
+}
+
+static BlockDriver bdrv_test = {
+    .format_name            = "test",
+    .bdrv_co_block_status   = bdrv_test_co_block_status,
+    .bdrv_getlength         = bdrv_test_getlength,
+};
+
+static BlockDriverState *test_node(void)
+{
+    nb_queries = 0;
+    return bdrv_new_open_driver(&bdrv_test, "test-node", 0, &error_abort);
+}
+
+static void check_status(BlockStatusMap *map, int64_t offset, int64_t bytes,
+                         int status, int64_t pnum, int queries)
+{
+    int64_t count;
+
+    g_assert_cmpint(bdrv_block_status_map_get(map, offset, bytes, &count),
+                    ==, status);
+    g_assert_cmpint(count, ==, pnum);
+    g_assert_cmpint(nb_queries, ==, queries);
+}
+
+static void test_exact(void)
+{
+    BlockDriverState *bs = test_node();
+    BlockStatusMap *map = bdrv_block_status_map_new(bs, NULL, 0);
+
+    /* Without prefetch, only what was asked for is remembered */
+    check_status(map, 0, 4 * KiB, STATUS_DATA, 4 * KiB, 1);
+    check_status(map, 0, 4 * KiB, STATUS_DATA, 4 * KiB, 1);
+    check_status(map, 2 * KiB, 8 * KiB, STATUS_DATA, 2 * KiB, 1);
+    check_status(map, 4 * KiB, 4 * KiB, STATUS_DATA, 4 * KiB, 2);
+    check_status(map, 60 * KiB, 8 * KiB, STATUS_DATA, 4 * KiB, 3);
+
+    bdrv_block_status_map_free(map);
+    bdrv_unref(bs);
+}
+
+static void test_prefetch(void)
+{
+    BlockDriverState *bs = test_node();
+    BlockStatusMap *map = bdrv_block_status_map_new(bs, NULL,
+                                                    TEST_IMAGE_SIZE);
+
+    /* Whole extents are fetched on a miss */
+    check_status(map, 0, 4 * KiB, STATUS_DATA, 4 * KiB, 1);
+    check_status(map, 8 * KiB, 4 * KiB, STATUS_DATA, 4 * KiB, 1);
+    check_status(map, 60 * KiB, 8 * KiB, STATUS_DATA, 4 * KiB, 1);
+    check_status(map, 64 * KiB, 4 * KiB, STATUS_ZERO, 4 * KiB, 2);
+    check_status(map, 128 * KiB, 1 * MiB, STATUS_ZERO, 384 * KiB, 2);
+    check_status(map, 512 * KiB, 4 * KiB, STATUS_DATA, 4 * KiB, 3);
+    check_status(map, 768 * KiB, 1 * MiB, STATUS_DATA, 256 * KiB, 3);
+
+    bdrv_block_status_map_free(map);
+    bdrv_unref(bs);
+}
+
+static void test_invalidate(void)
+{
+    BlockDriverState *bs = test_node();
+    BlockStatusMap *map = bdrv_block_status_map_new(bs, NULL,
+                                                    TEST_IMAGE_SIZE);
+
+    check_status(map, 0, 64 * KiB, STATUS_DATA, 64 * KiB, 1);
+
+    /* The extent is split around the invalidated range */
+    bdrv_block_status_map_invalidate(map, 16 * KiB, 4 * KiB);
+    check_status(map, 0, 64 * KiB, STATUS_DATA, 16 * KiB, 1);
+    check_status(map, 20 * KiB, 64 * KiB, STATUS_DATA, 44 * KiB, 1);
+
+    /* Refetching the hole replaces the rest of the extent */
+    check_status(map, 16 * KiB, 4 * KiB, STATUS_DATA, 4 * KiB, 2);
+    check_status(map, 16 * KiB, 64 * KiB, STATUS_DATA, 48 * KiB, 2);
+    check_status(map, 0, 64 * KiB, STATUS_DATA, 16 * KiB, 2);
+
+    /* Invalidation across extents */
+    check_status(map, 64 * KiB, 4 * KiB, STATUS_ZERO, 4 * KiB, 3);
+    bdrv_block_status_map_invalidate(map, 32 * KiB, 64 * KiB);
+    check_status(map, 16 * KiB, 64 * KiB, STATUS_DATA, 16 * KiB, 3);
+    check_status(map, 96 * KiB, 4 * KiB, STATUS_ZERO, 4 * KiB, 3);
+    check_status(map, 64 * KiB, 4 * KiB, STATUS_ZERO, 4 * KiB, 4);
+
+    bdrv_block_status_map_free(map);
+    bdrv_unref(bs);
+}
+
+static void test_racing_write(void)
+{
+    BlockDriverState *bs = test_node();
+    BlockStatusMap *map = bdrv_block_status_map_new(bs, NULL,
+                                                    TEST_IMAGE_SIZE);
+
+    /* A result that raced with an invalidation is returned, not cached */
+    racing_map = map;
+    check_status(map, 0, 4 * KiB, STATUS_DATA, 4 * KiB, 1);
+    racing_map = NULL;
+    check_status(map, 0, 4 * KiB, STATUS_DATA, 4 * KiB, 2);
+    check_status(map, 0, 4 * KiB, STATUS_DATA, 4 * KiB, 2);
+
+    bdrv_block_status_map_free(map);
+    bdrv_unref(bs);
+}
+
+int main(int argc, char **argv)
+{
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/block-status-map/exact", test_exact);
+    g_test_add_func("/block-status-map/prefetch", test_prefetch);
+    g_test_add_func("/block-status-map/invalidate", test_invalidate);
+    g_test_add_func("/block-status-map/racing-write", test_racing_write);
+
+    return g_test_run();
+}
@@ -0,0 +1,110 @@
+/*
+ * QCOW2 metadata cache tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/main-loop.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "sysemu/block-backend.h"
+#include "block/qcow2.h"
+
+static char img_path[] = "/tmp/qcow2-cache-test.XXXXXX";
+
+static BlockBackend *open_image(void)
+{
+    QDict *options = qdict_new();
+
+    qdict_put_str(options, "driver", "qcow2");
+    /* Preloading needs a few spare cache entries */
+    qdict_put_str(options, "l2-cache-size", "1M");
+    qdict_put_str(options, "file.driver", "blkdebug");
+    qdict_put_str(options, "file.image.driver", "file");
+    qdict_put_str(options, "file.image.filename", img_path);
+    qdict_put_str(options, "file.image.locking", "off");
+    return blk_new_open(NULL, NULL, options, BDRV_O_RDWR, &error_abort);
+}
+
+typedef struct PreloadData {
+    BlockDriverState *bs;
+    uint64_t offset;
+    bool done;
+} PreloadData;
+
+static void coroutine_fn preload_entry(void *opaque)
+{
+    PreloadData *data = opaque;
+    BDRVQcow2State *s = data->bs->opaque;
+
+    qcow2_cache_preload(data->bs, s->l2_table_cache, data->offset);
+    data->done = true;
+}
+
+static void resume_preload_bh(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+
+    g_assert_cmpint(bdrv_debug_resume(bs, "A"), ==, 0);
+}
+
+/*
+ * Emptying the cache must wait for a preload that holds a reference to a
+ * cache entry instead of tripping over the reference.
+ */
+static void test_empty_during_preload(void)
+{
+    BlockBackend *blk = open_image();
+    BlockDriverState *bs = blk_bs(blk);
+    BDRVQcow2State *s = bs->opaque;
+    PreloadData data = {
+        .bs = bs,
+        .offset = 4 * s->cluster_size,
+    };
+    Coroutine *co;
+    int ret;
+
+    g_assert_cmpint(bdrv_debug_breakpoint(bs, "l2_load", "A"), ==, 0);
+
+    co = qemu_coroutine_create(preload_entry, &data);
+    qemu_coroutine_enter(co);
+    g_assert(bdrv_debug_is_suspended(bs, "A"));
+    g_assert(!data.done);
+
+    /* The preload can only complete while qcow2_cache_empty() waits */
+    aio_bh_schedule_oneshot(qemu_get_aio_context(), resume_preload_bh, bs);
+    ret = qcow2_cache_empty(bs, s->l2_table_cache);
+    g_assert_cmpint(ret, ==, 0);
+    g_assert(data.done);
+
+    g_assert(!qcow2_cache_is_table_offset(s->l2_table_cache, data.offset));
+
+    blk_unref(blk);
+}
+
+int main(int argc, char **argv)
+{
+    int fd, ret;
+
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+
+    fd = mkstemp(img_path);
+    g_assert(fd >= 0);
+    close(fd);
+    bdrv_img_create(img_path, "qcow2", NULL, NULL, NULL, 1 * TiB, 0, true,
+                    &error_abort);
+
+    g_test_add_func("/qcow2/cache/empty-during-preload",
+                    test_empty_during_preload);
+
+    ret = g_test_run();
+
+    unlink(img_path);
+    return ret;
+}
@@ -174,6 +174,61 @@ static void test_encode_decode(void)
     }
 }
 
+static void encode_compare_range(uint8_t *old_buf, uint8_t *new_buf,
+                                 uint8_t *ref, uint8_t *out)
+{
+    int i, n, pos, len;
+    int dlen, ref_len, out_len;
+
+    memset(old_buf, g_test_rand_int_range(0, 4), XBZRLE_PAGE_SIZE);
+    memcpy(new_buf, old_buf, XBZRLE_PAGE_SIZE);
+
+    /* a few changed ranges of random length, some touching the ends */
+    n = g_test_rand_int_range(0, 64);
+    for (i = 0; i < n; i++) {
+        pos = g_test_rand_int_range(0, XBZRLE_PAGE_SIZE);
+        len = g_test_rand_int_range(1, 200);
+        while (len-- && pos < XBZRLE_PAGE_SIZE) {
+            /* leave some bytes unchanged inside a range */
+            new_buf[pos++] ^= g_test_rand_bit() ? 0xff : 0;
+        }
+    }
+
+    /* also exercise the overflow checks */
+    dlen = g_test_rand_bit() ? XBZRLE_PAGE_SIZE :
+                               g_test_rand_int_range(0, XBZRLE_PAGE_SIZE);
+
+    ref_len = xbzrle_encode_buffer_int(old_buf, new_buf, XBZRLE_PAGE_SIZE,
+                                       ref, dlen);
+    out_len = xbzrle_encode_buffer(old_buf, new_buf, XBZRLE_PAGE_SIZE,
+                                   out, dlen);
+    g_assert_cmpint(out_len, ==, ref_len);
+    if (ref_len > 0) {
+        g_assert(memcmp(out, ref, ref_len) == 0);
+    }
+}
+
+/* Each accelerated encoder must produce the same bytes as the portable one */
+static void test_encode_accel(void)
+{
+    uint8_t *old_buf = g_malloc(XBZRLE_PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(XBZRLE_PAGE_SIZE);
+    uint8_t *ref = g_malloc(XBZRLE_PAGE_SIZE);
+    uint8_t *out = g_malloc(XBZRLE_PAGE_SIZE);
+    int i;
+
+    do {
+        for (i = 0; i < 10000; i++) {
+            encode_compare_range(old_buf, new_buf, ref, out);
+        }
+    } while (test_xbzrle_encode_next_accel());
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(ref);
+    g_free(out);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +241,8 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    /* Must come last, it leaves the portable encoder selected */
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
 
     return g_test_run();
 }
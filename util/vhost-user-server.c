@@ -51,6 +51,19 @@
  * possible by QIOChannel's support for spurious coroutine re-entry in
  * qio_channel_yield(). The coroutine will restart I/O when re-entered from the
  * new AioContext.
+ *
+ * Optionally, each virtqueue can have its own AioContext (VuServer->queue_ctx)
+ * so that queues are processed by several threads.  Kick fds then stay in the
+ * queue's AioContext, and switching VuServer->ctx only moves the socket.  The
+ * VuVirtq state is protected by a per-queue lock: the kick handler and the
+ * device's completion path take the lock of their queue, and vu_client_trip()
+ * takes all of them while libvhost-user processes a message.
+ *
+ * Requests that the device popped from a virtqueue are counted per queue
+ * until they complete.  vu_client_trip() waits for all of them before
+ * vu_deinit() unmaps guest memory, and vhost_user_server_stop() waits for
+ * each queue's AioContext to be done with the queue before freeing the
+ * locks.
  */
 
 static void vmsg_close_fds(VhostUserMsg *vmsg)
@@ -74,6 +87,94 @@ static void panic_cb(VuDev *vu_dev, const char *buf)
     error_report("vu_panic: %s", buf);
 }
 
+AioContext *vhost_user_server_queue_ctx(VuServer *server, int idx)
+{
+    return server->queue_ctx ? server->queue_ctx[idx] : server->ctx;
+}
+
+void vhost_user_server_queue_lock(VuServer *server, int idx)
+{
+    if (server->queue_lock) {
+        qemu_rec_mutex_lock(&server->queue_lock[idx]);
+    }
+}
+
+void vhost_user_server_queue_unlock(VuServer *server, int idx)
+{
+    if (server->queue_lock) {
+        qemu_rec_mutex_unlock(&server->queue_lock[idx]);
+    }
+}
+
+void vhost_user_server_inc_in_flight(VuServer *server, int idx)
+{
+    qatomic_inc(&server->queue_in_flight[idx]);
+}
+
+void vhost_user_server_dec_in_flight(VuServer *server, int idx)
+{
+    if (qatomic_fetch_dec(&server->queue_in_flight[idx]) == 1) {
+        /* Only one of the completing requests may wake vu_client_trip() */
+        if (qatomic_xchg(&server->wait_idle, false)) {
+            aio_co_wake(server->co_trip);
+        }
+        aio_wait_kick();
+    }
+}
+
+static bool vu_requests_in_flight(VuServer *server)
+{
+    int i;
+
+    for (i = 0; i < server->max_queues; i++) {
+        if (qatomic_read(&server->queue_in_flight[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Wait until the device has completed all requests */
+static void coroutine_fn vu_wait_requests(VuServer *server)
+{
+    for (;;) {
+        qatomic_mb_set(&server->wait_idle, true);
+        if (vu_requests_in_flight(server)) {
+            qemu_coroutine_yield();
+            continue;
+        }
+        if (qatomic_xchg(&server->wait_idle, false)) {
+            return;
+        }
+        /* The last request completed meanwhile and is about to wake us */
+        qemu_coroutine_yield();
+    }
+}
+
+static void vu_lock_queues(VuServer *server)
+{
+    int i;
+
+    if (server->queue_lock && !server->queues_locked) {
+        for (i = 0; i < server->max_queues; i++) {
+            qemu_rec_mutex_lock(&server->queue_lock[i]);
+        }
+        server->queues_locked = true;
+    }
+}
+
+static void vu_unlock_queues(VuServer *server)
+{
+    int i;
+
+    if (server->queues_locked) {
+        server->queues_locked = false;
+        for (i = server->max_queues - 1; i >= 0; i--) {
+            qemu_rec_mutex_unlock(&server->queue_lock[i]);
+        }
+    }
+}
+
 static bool coroutine_fn
 vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
 {
@@ -160,6 +261,8 @@ vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
         }
     }
 
+    /* Released by vu_client_trip() once the message is processed */
+    vu_lock_queues(server);
     return true;
 
 fail:
@@ -172,12 +275,29 @@ static coroutine_fn void vu_client_trip(void *opaque)
 {
     VuServer *server = opaque;
     VuDev *vu_dev = &server->vu_dev;
+    VuFdWatch *vu_fd_watch;
 
     while (!vu_dev->broken && vu_dispatch(vu_dev)) {
-        /* Keep running */
+        vu_unlock_queues(server);
     }
+    vu_unlock_queues(server);
 
+    /*
+     * Stop processing kicks, but requests that were already started still
+     * use the virtqueues and guest memory until they complete.
+     */
+    vu_lock_queues(server);
+    QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+        aio_set_fd_handler(vu_fd_watch->ctx, vu_fd_watch->fd, true,
+                           NULL, NULL, NULL, NULL);
+        vu_fd_watch->cb = NULL;
+    }
+    vu_unlock_queues(server);
+    vu_wait_requests(server);
+
+    vu_lock_queues(server);
     vu_deinit(vu_dev);
+    vu_unlock_queues(server);
 
     /* vu_deinit() should have called remove_watch() */
     assert(QTAILQ_EMPTY(&server->vu_fd_watches));
@@ -206,15 +326,22 @@ static void kick_handler(void *opaque)
 {
     VuFdWatch *vu_fd_watch = opaque;
     VuDev *vu_dev = vu_fd_watch->vu_dev;
+    VuServer *server = container_of(vu_dev, VuServer, vu_dev);
+    int idx = (long)vu_fd_watch->pvt;
 
-    vu_fd_watch->cb(vu_dev, 0, vu_fd_watch->pvt);
+    vhost_user_server_queue_lock(server, idx);
+
+    /* The watch may have been removed while we waited for the lock */
+    if (vu_fd_watch->cb) {
+        vu_fd_watch->cb(vu_dev, 0, vu_fd_watch->pvt);
+    }
 
     /* Stop vu_client_trip() if an error occurred in vu_fd_watch->cb() */
     if (vu_dev->broken) {
-        VuServer *server = container_of(vu_dev, VuServer, vu_dev);
-
         qio_channel_shutdown(server->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
     }
+
+    vhost_user_server_queue_unlock(server, idx);
 }
 
 static VuFdWatch *find_vu_fd_watch(VuServer *server, int fd)
@@ -248,11 +375,14 @@ set_watch(VuDev *vu_dev, int fd, int vu_evt,
 
         vu_fd_watch->fd = fd;
         vu_fd_watch->cb = cb;
-        qemu_set_nonblock(fd);
-        aio_set_fd_handler(server->ioc->ctx, fd, true, kick_handler,
-                           NULL, NULL, vu_fd_watch);
         vu_fd_watch->vu_dev = vu_dev;
         vu_fd_watch->pvt = pvt;
+        /* libvhost-user only watches kick fds, @pvt is the queue index */
+        vu_fd_watch->ctx = server->queue_ctx ?
+                           server->queue_ctx[(long)pvt] : server->ioc->ctx;
+        qemu_set_nonblock(fd);
+        aio_set_fd_handler(vu_fd_watch->ctx, fd, true, kick_handler,
+                           NULL, NULL, vu_fd_watch);
     }
 }
 
@@ -270,10 +400,20 @@ static void remove_watch(VuDev *vu_dev, int fd)
     if (!vu_fd_watch) {
         return;
     }
-    aio_set_fd_handler(server->ioc->ctx, fd, true, NULL, NULL, NULL, NULL);
+    aio_set_fd_handler(vu_fd_watch->ctx, fd, true, NULL, NULL, NULL, NULL);
 
     QTAILQ_REMOVE(&server->vu_fd_watches, vu_fd_watch, next);
-    g_free(vu_fd_watch);
+    vu_fd_watch->cb = NULL;
+
+    if (server->queue_ctx) {
+        /*
+         * kick_handler() may be waiting for the queue lock in another
+         * thread; free the watch only after it has returned.
+         */
+        aio_bh_schedule_oneshot(vu_fd_watch->ctx, g_free, vu_fd_watch);
+    } else {
+        g_free(vu_fd_watch);
+    }
 }
 
 
@@ -322,9 +462,20 @@ static void vu_accept(QIONetListener *listener, QIOChannelSocket *sioc,
     aio_context_release(server->ctx);
 }
 
+/* Runs after whatever the queue's AioContext was doing */
+static void vu_queue_idle_bh(void *opaque)
+{
+}
+
+/*
+ * Called with server->ctx acquired exactly once, so that AIO_WAIT_WHILE()
+ * releases it completely while we wait: vu_client_trip() and the requests it
+ * waits for run in server->ctx, and requests of queues with their own
+ * AioContext still hop into it.
+ */
 void vhost_user_server_stop(VuServer *server)
 {
-    aio_context_acquire(server->ctx);
+    int i;
 
     qemu_bh_delete(server->restart_listener_bh);
     server->restart_listener_bh = NULL;
@@ -333,7 +484,7 @@ void vhost_user_server_stop(VuServer *server)
         VuFdWatch *vu_fd_watch;
 
         QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-            aio_set_fd_handler(server->ctx, vu_fd_watch->fd, true,
+            aio_set_fd_handler(vu_fd_watch->ctx, vu_fd_watch->fd, true,
                                NULL, NULL, NULL, vu_fd_watch);
         }
 
@@ -342,12 +493,42 @@ void vhost_user_server_stop(VuServer *server)
         AIO_WAIT_WHILE(server->ctx, server->co_trip);
     }
 
-    aio_context_release(server->ctx);
-
     if (server->listener) {
         qio_net_listener_disconnect(server->listener);
         object_unref(OBJECT(server->listener));
     }
+
+    /*
+     * Completed requests and kick handlers may still be returning in the
+     * queues' AioContexts, and they use the queue locks until then.
+     */
+    for (i = 0; i < server->max_queues; i++) {
+        AioContext *queue_ctx = vhost_user_server_queue_ctx(server, i);
+        bool acquire = queue_ctx != server->ctx;
+
+        if (acquire) {
+            aio_context_acquire(queue_ctx);
+        }
+        AIO_WAIT_WHILE(queue_ctx, qatomic_read(&server->queue_in_flight[i]));
+        if (server->queue_ctx) {
+            aio_wait_bh_oneshot(queue_ctx, vu_queue_idle_bh, NULL);
+        }
+        if (acquire) {
+            aio_context_release(queue_ctx);
+        }
+    }
+    g_free(server->queue_in_flight);
+    server->queue_in_flight = NULL;
+
+    if (server->queue_lock) {
+        for (i = 0; i < server->max_queues; i++) {
+            qemu_rec_mutex_destroy(&server->queue_lock[i]);
+        }
+        g_free(server->queue_lock);
+        server->queue_lock = NULL;
+    }
+    g_free(server->queue_ctx);
+    server->queue_ctx = NULL;
 }
 
 /*
@@ -375,9 +556,13 @@ void vhost_user_server_attach_aio_context(VuServer *server, AioContext *ctx)
 
     qio_channel_attach_aio_context(server->ioc, ctx);
 
-    QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-        aio_set_fd_handler(ctx, vu_fd_watch->fd, true, kick_handler, NULL,
-                           NULL, vu_fd_watch);
+    /* Kick fds of queues with their own AioContext stay where they are */
+    if (!server->queue_ctx) {
+        QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+            vu_fd_watch->ctx = ctx;
+            aio_set_fd_handler(ctx, vu_fd_watch->fd, true, kick_handler, NULL,
+                               NULL, vu_fd_watch);
+        }
     }
 
     aio_co_schedule(ctx, server->co_trip);
@@ -389,9 +574,11 @@ void vhost_user_server_detach_aio_context(VuServer *server)
     if (server->sioc) {
         VuFdWatch *vu_fd_watch;
 
-        QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-            aio_set_fd_handler(server->ctx, vu_fd_watch->fd, true,
-                               NULL, NULL, NULL, vu_fd_watch);
+        if (!server->queue_ctx) {
+            QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+                aio_set_fd_handler(server->ctx, vu_fd_watch->fd, true,
+                                   NULL, NULL, NULL, vu_fd_watch);
+            }
         }
 
         qio_channel_detach_aio_context(server->ioc);
@@ -403,16 +590,19 @@ void vhost_user_server_detach_aio_context(VuServer *server)
 bool vhost_user_server_start(VuServer *server,
                              SocketAddress *socket_addr,
                              AioContext *ctx,
+                             AioContext **queue_ctx,
                              uint16_t max_queues,
                              const VuDevIface *vu_iface,
                              Error **errp)
 {
     QEMUBH *bh;
     QIONetListener *listener;
+    int i;
 
     if (socket_addr->type != SOCKET_ADDRESS_TYPE_UNIX &&
         socket_addr->type != SOCKET_ADDRESS_TYPE_FD) {
         error_setg(errp, "Only socket address types 'unix' and 'fd' are supported");
+        g_free(queue_ctx);
         return false;
     }
 
@@ -420,6 +610,7 @@ bool vhost_user_server_start(VuServer *server,
     if (qio_net_listener_open_sync(listener, socket_addr, 1,
                                    errp) < 0) {
         object_unref(OBJECT(listener));
+        g_free(queue_ctx);
         return false;
     }
 
@@ -432,8 +623,17 @@ bool vhost_user_server_start(VuServer *server,
         .vu_iface              = vu_iface,
         .max_queues            = max_queues,
         .ctx                   = ctx,
+        .queue_ctx             = queue_ctx,
+        .queue_in_flight       = g_new0(unsigned int, max_queues),
     };
 
+    if (queue_ctx) {
+        server->queue_lock = g_new(QemuRecMutex, max_queues);
+        for (i = 0; i < max_queues; i++) {
+            qemu_rec_mutex_init(&server->queue_lock[i]);
+        }
+    }
+
     qio_net_listener_set_name(server->listener, "vhost-user-backend-listener");
 
     qio_net_listener_set_client_func(server->listener,